@@ -14,6 +14,11 @@
 static void
 apfs_buf_ioend(struct apfs_buf	*bp)
 {
+	if (!bp->error && bp->io_errors)
+		apfs_crit_in_rcu(bp->fs_info, "buf bio errors %d",
+				 bp->io_errors);
+	if (!bp->error)
+		bp->error = bp->io_errors;
 	complete(&bp->io_wait);
 }
 
@@ -32,14 +37,8 @@ apfs_buf_bio_end_io(struct bio *bio)
 		cmpxchg(&bp->io_errors, 0, error);
 	}
 
-	atomic_dec(&bp->io_remaining);
-	if (atomic_read(&bp->io_remaining) == 1) {
-		if (!bp->error && bp->io_errors)
-			apfs_crit_in_rcu(bp->fs_info, "buf bio errors %d",
-					 bp->io_errors);
-		bp->error = bp->io_errors;
-		complete(&bp->io_wait);
-	}
+	if (atomic_dec_and_test(&bp->io_remaining))
+		apfs_buf_ioend(bp);
 	bio_put(bio);
 }
 
@@ -199,9 +198,9 @@ void apfs_buf_init(struct apfs_fs_info *fs_info, struct apfs_buf *bp,
 
 
 /*
- * Wait for I/O completion of a sync buffer and return the I/O error code.
+ * Wait for I/O completion of a buffer and return the I/O error code.
  */
-static int
+int
 apfs_buf_iowait(
 	struct apfs_buf	*bp)
 {
@@ -211,19 +210,47 @@ apfs_buf_iowait(
 }
 
 
+/*
+ * Submit @bp. Without @wait the caller must collect the result with
+ * apfs_buf_iowait() before freeing @bp.
+ */
 int apfs_buf_submit(struct apfs_buf *bp, bool wait)
 {
 
 	/* clear the internal error state to avoid spurious errors */
 	bp->error = 0;
 	bp->io_errors = 0;
+	reinit_completion(&bp->io_wait);
 
+	/* our own count keeps early bio completions from finishing the buf */
 	atomic_set(&bp->io_remaining, 1);
 
 	apfs_buf_ioapply(bp);
 
+	if (atomic_dec_and_test(&bp->io_remaining))
+		apfs_buf_ioend(bp);
+
 	if (wait)
-		wait_for_completion(&bp->io_wait);
+		return apfs_buf_iowait(bp);
 
-	return bp->error;
+	return 0;
+}
+
+/*
+ * Copy @len bytes starting @start bytes into the data of @bp to @dst.
+ */
+void apfs_buf_copy(struct apfs_buf *bp, void *dst, size_t start, size_t len)
+{
+	size_t pos = bp->offset + start;
+
+	while (len > 0) {
+		size_t offset = offset_in_page(pos);
+		size_t cur = min_t(size_t, len, PAGE_SIZE - offset);
+
+		memcpy(dst, page_address(bp->pages[pos >> PAGE_SHIFT]) + offset,
+		       cur);
+		dst += cur;
+		pos += cur;
+		len -= cur;
+	}
 }
@@ -33,6 +33,8 @@ void apfs_buf_free(struct apfs_buf *bp);
 struct apfs_buf *apfs_buf_alloc(void);
 int apfs_buf_alloc_pages(struct apfs_buf *bp, u32 flags);
 int apfs_buf_submit(struct apfs_buf *bp, bool wait);
+int apfs_buf_iowait(struct apfs_buf *bp);
+void apfs_buf_copy(struct apfs_buf *bp, void *dst, size_t start, size_t len);
 void apfs_buf_init(struct apfs_fs_info *fs_info, struct apfs_buf *bp, int op,
 		   u64 bytenr, size_t size);
 
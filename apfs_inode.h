@@ -66,6 +66,20 @@ struct apfs_inode {
 	 */
 	u64 cid;
 
+	/*
+	 * Cursor path left by the last apfs_get_extent_regular() so sequential
+	 * reads resume from the same leaf. Handed over with xchg(). Pins its
+	 * extent buffers until the inode is evicted, see
+	 * apfs_put_extent_cursor().
+	 */
+	struct apfs_path *extent_cursor;
+
+	/*
+	 * Chunk table of a resource fork compressed file, parsed on first
+	 * read. See apfs_chunk_to_extent_map().
+	 */
+	struct apfs_chunk_index *chunk_index;
+
 	/* key used to find this inode on disk.  This is used by the code
 	 * to read in roots of subvolumes
 	 */
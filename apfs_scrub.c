@@ -0,0 +1,816 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/sizes.h>
+#include <linux/wait.h>
+
+#include "ctree.h"
+#include "disk-io.h"
+#include "volumes.h"
+#include "async-thread.h"
+#include "apfs_buf.h"
+
+/*
+ * Metadata scrub of a mounted volume and its container.
+ *
+ * scrub.c walks btrfs chunks and knows nothing about apfs objects. This one
+ * enumerates every reachable metadata object instead:
+ *
+ * - every ephemeral object of the mounted checkpoint (spaceman, reaper, free
+ *   queue tree nodes...) and the checkpoint map blocks describing them
+ * - the chunk info (address) blocks the spaceman points to
+ * - the container and volume omaps, fs tree, fext tree, extentref tree and
+ *   snapshot meta tree, node by node
+ *
+ * For each object we remember where it is and what its referrer says it is
+ * (oid, type, subtype, size).  Objects are collected into batches of up to
+ * APFS_SCRUB_MAX_OBJS, sorted by physical address and handed out in ranges
+ * to a workqueue, so reads go in disk order and the checksumming is spread
+ * over all cpus.  A worker merges neighbouring objects into one read and
+ * checks fletcher64, o_oid, o_type, o_subtype and that o_xid isn't newer
+ * than the mounted checkpoint.
+ *
+ * Index nodes are read through the extent buffer cache to find their
+ * children, leaves are only ever read by the workers.
+ */
+
+/* objects collected before they are sorted and verified */
+#define APFS_SCRUB_MAX_OBJS		(SZ_8M / sizeof(struct apfs_scrub_obj))
+/* physical span one worker reads and verifies */
+#define APFS_SCRUB_BATCH_SIZE		SZ_1M
+
+#define APFS_SCRUB_TYPE_MASK	(APFS_OBJ_TYPE_MASK | APFS_OBJ_STG_TYPE_MASK)
+
+struct apfs_scrub_obj {
+	u64 paddr;
+	u64 oid;
+	u32 type;
+	/* 0 if the referrer doesn't know */
+	u32 subtype;
+	u32 size;
+};
+
+struct apfs_meta_scrub {
+	struct apfs_fs_info *fs_info;
+	struct apfs_workqueue *workers;
+	/* only objects in [start, end] are verified */
+	u64 start;
+	u64 end;
+	/* xid of the mounted checkpoint, no object can be newer */
+	u64 max_xid;
+
+	struct apfs_scrub_obj *objs;
+	u32 nr_objs;
+
+	atomic_t pending;
+	wait_queue_head_t wait;
+
+	spinlock_t stat_lock;
+	struct apfs_scrub_progress stat;
+};
+
+struct apfs_scrub_batch {
+	struct apfs_work work;
+	struct apfs_meta_scrub *ms;
+	const struct apfs_scrub_obj *objs;
+	u32 nr;
+};
+
+static bool scrub_cancelled(struct apfs_meta_scrub *ms)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+
+	return atomic_read(&fs_info->scrub_cancel_req) ||
+	       apfs_fs_closing(fs_info);
+}
+
+static void scrub_merge_stat(struct apfs_meta_scrub *ms,
+			     const struct apfs_scrub_progress *stat)
+{
+	spin_lock(&ms->stat_lock);
+	ms->stat.tree_extents_scrubbed += stat->tree_extents_scrubbed;
+	ms->stat.tree_bytes_scrubbed += stat->tree_bytes_scrubbed;
+	ms->stat.read_errors += stat->read_errors;
+	ms->stat.csum_errors += stat->csum_errors;
+	ms->stat.verify_errors += stat->verify_errors;
+	ms->stat.super_errors += stat->super_errors;
+	ms->stat.malloc_errors += stat->malloc_errors;
+	ms->stat.last_physical = max(ms->stat.last_physical,
+				     stat->last_physical);
+	spin_unlock(&ms->stat_lock);
+}
+
+static void scrub_check_obj(struct apfs_meta_scrub *ms,
+			    const struct apfs_scrub_obj *obj, const void *data,
+			    struct apfs_scrub_progress *stat)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	const struct apfs_obj_header *o = data;
+	u64 oid = apfs_stack_obj_oid(o);
+	u64 xid = apfs_stack_obj_xid(o);
+	u32 type = apfs_stack_obj_type(o);
+	u32 subtype = apfs_stack_obj_subtype(o);
+
+	stat->tree_extents_scrubbed++;
+	stat->tree_bytes_scrubbed += obj->size;
+	stat->last_physical = max(stat->last_physical, obj->paddr);
+
+	if (apfs_verify_obj_csum(data, obj->size)) {
+		stat->csum_errors++;
+		apfs_warn_rl(fs_info,
+			     "scrub: checksum error on object %llu at %llu",
+			     obj->oid, obj->paddr);
+		return;
+	}
+
+	if (oid != obj->oid ||
+	    (type & APFS_SCRUB_TYPE_MASK) !=
+	    (obj->type & APFS_SCRUB_TYPE_MASK) ||
+	    (obj->subtype && subtype != obj->subtype) ||
+	    xid == 0 || xid > ms->max_xid) {
+		stat->verify_errors++;
+		apfs_warn_rl(fs_info,
+"scrub: bad object header at %llu: oid %llu type 0x%x subtype 0x%x xid %llu, expected oid %llu type 0x%x subtype 0x%x xid <= %llu",
+			     obj->paddr, oid, type, subtype, xid, obj->oid,
+			     obj->type, obj->subtype, ms->max_xid);
+	}
+}
+
+/*
+ * Verify the sorted objects @objs.  Objects adjacent on disk are read with
+ * one apfs_buf of up to APFS_SCRUB_BATCH_SIZE.
+ */
+static void scrub_verify_objs(struct apfs_meta_scrub *ms,
+			      const struct apfs_scrub_obj *objs, u32 nr)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	struct apfs_scrub_progress stat = {};
+	void *data = NULL;
+	u32 data_size = 0;
+	u32 i = 0;
+	u32 j;
+
+	while (i < nr) {
+		struct apfs_buf *bp;
+		u64 start = objs[i].paddr;
+		u64 len = objs[i].size;
+		u32 n = 1;
+		int ret;
+
+		if (scrub_cancelled(ms))
+			break;
+
+		while (i + n < nr && objs[i + n].paddr == start + len &&
+		       len + objs[i + n].size <= APFS_SCRUB_BATCH_SIZE)
+			len += objs[i + n++].size;
+
+		for (j = i; j < i + n; j++) {
+			if (objs[j].size <= data_size)
+				continue;
+			kvfree(data);
+			data_size = objs[j].size;
+			data = kvmalloc(data_size, GFP_NOFS);
+			if (!data) {
+				data_size = 0;
+				break;
+			}
+		}
+
+		bp = apfs_buf_alloc();
+		if (!data || !bp) {
+			kfree(bp);
+			stat.malloc_errors++;
+			i += n;
+			continue;
+		}
+		apfs_buf_init(fs_info, bp, ABF_READ, start, len);
+		ret = apfs_buf_alloc_pages(bp, ABF_READ);
+		if (ret) {
+			kfree(bp);
+			stat.malloc_errors++;
+			i += n;
+			continue;
+		}
+
+		ret = apfs_buf_submit(bp, true);
+		if (ret) {
+			stat.read_errors += n;
+			apfs_warn_rl(fs_info,
+				     "scrub: read error %d on [%llu, %llu)",
+				     ret, start, start + len);
+		} else {
+			for (j = i; j < i + n; j++) {
+				apfs_buf_copy(bp, data, objs[j].paddr - start,
+					      objs[j].size);
+				scrub_check_obj(ms, &objs[j], data, &stat);
+			}
+		}
+		apfs_buf_free(bp);
+		i += n;
+	}
+
+	kvfree(data);
+	scrub_merge_stat(ms, &stat);
+}
+
+static void scrub_batch_worker(struct apfs_work *work)
+{
+	struct apfs_scrub_batch *batch;
+	struct apfs_meta_scrub *ms;
+
+	batch = container_of(work, struct apfs_scrub_batch, work);
+	ms = batch->ms;
+
+	scrub_verify_objs(ms, batch->objs, batch->nr);
+	kfree(batch);
+
+	if (atomic_dec_and_test(&ms->pending))
+		wake_up(&ms->wait);
+}
+
+static int scrub_obj_cmp(const void *a, const void *b)
+{
+	const struct apfs_scrub_obj *obj1 = a;
+	const struct apfs_scrub_obj *obj2 = b;
+
+	if (obj1->paddr < obj2->paddr)
+		return -1;
+	if (obj1->paddr > obj2->paddr)
+		return 1;
+	return 0;
+}
+
+/*
+ * Sort the collected objects, drop duplicates (blocks shared by snapshots
+ * or reached twice), hand them to the workers in disk order and wait.
+ */
+static int scrub_flush(struct apfs_meta_scrub *ms)
+{
+	struct apfs_scrub_obj *objs = ms->objs;
+	u32 nr = 0;
+	u32 i;
+
+	if (!ms->nr_objs)
+		return 0;
+
+	sort(objs, ms->nr_objs, sizeof(*objs), scrub_obj_cmp, NULL);
+	for (i = 0; i < ms->nr_objs; i++) {
+		if (nr && objs[nr - 1].paddr == objs[i].paddr)
+			continue;
+		objs[nr++] = objs[i];
+	}
+
+	i = 0;
+	while (i < nr) {
+		struct apfs_scrub_batch *batch;
+		u64 start = objs[i].paddr;
+		u32 n = 1;
+
+		while (i + n < nr &&
+		       objs[i + n].paddr + objs[i + n].size - start <=
+		       APFS_SCRUB_BATCH_SIZE)
+			n++;
+
+		batch = kmalloc(sizeof(*batch), GFP_NOFS);
+		if (!batch) {
+			/* still make progress, just not in parallel */
+			scrub_verify_objs(ms, objs + i, n);
+			i += n;
+			continue;
+		}
+		batch->ms = ms;
+		batch->objs = objs + i;
+		batch->nr = n;
+		atomic_inc(&ms->pending);
+		apfs_init_work(&batch->work, scrub_batch_worker, NULL, NULL);
+		apfs_queue_work(ms->workers, &batch->work);
+		i += n;
+	}
+
+	wait_event(ms->wait, atomic_read(&ms->pending) == 0);
+	ms->nr_objs = 0;
+
+	return scrub_cancelled(ms) ? -ECANCELED : 0;
+}
+
+static int scrub_add_obj(struct apfs_meta_scrub *ms, u64 paddr, u64 oid,
+			 u32 type, u32 subtype, u32 size)
+{
+	struct apfs_scrub_obj *obj;
+	int ret;
+
+	if (paddr + size <= ms->start || paddr > ms->end)
+		return 0;
+
+	if (ms->nr_objs == APFS_SCRUB_MAX_OBJS) {
+		ret = scrub_flush(ms);
+		if (ret)
+			return ret;
+	}
+
+	obj = &ms->objs[ms->nr_objs++];
+	obj->paddr = paddr;
+	obj->oid = oid;
+	obj->type = type;
+	obj->subtype = subtype;
+	obj->size = size;
+	return 0;
+}
+
+static void scrub_count_error(struct apfs_meta_scrub *ms, u64 *counter)
+{
+	spin_lock(&ms->stat_lock);
+	(*counter)++;
+	spin_unlock(&ms->stat_lock);
+}
+
+/* The oid a node stores for child @slot, before any translation */
+static u64 scrub_child_oid(const struct extent_buffer *eb, int slot)
+{
+	__le64 oid;
+
+	read_extent_buffer(eb, &oid, apfs_item_offset_nr(eb, slot),
+			   sizeof(oid));
+	return le64_to_cpu(oid);
+}
+
+/*
+ * Collect every node of the tree @root as @fs_info sees it.
+ *
+ * The walk is depth first and only holds one index node per level, leaves
+ * are collected from their parents without being read.
+ */
+static int scrub_collect_tree(struct apfs_meta_scrub *ms,
+			      struct apfs_fs_info *fs_info,
+			      struct apfs_root *root, u64 root_oid, u32 stg,
+			      u32 subtype)
+{
+	struct extent_buffer *nodes[APFS_MAX_LEVEL] = {};
+	int slots[APFS_MAX_LEVEL] = {};
+	const u32 nodesize = fs_info->block_size;
+	int top;
+	int level;
+	int ret;
+
+	if (!root || !root->node)
+		return 0;
+
+	ret = scrub_add_obj(ms, root->node->start, root_oid,
+			    stg | APFS_OBJ_TYPE_BTREE, subtype, nodesize);
+	if (ret)
+		return ret;
+
+	top = apfs_header_level(root->node);
+	if (top == 0)
+		return 0;
+
+	atomic_inc(&root->node->refs);
+	nodes[top] = root->node;
+	level = top;
+
+	while (level <= top) {
+		struct extent_buffer *node = nodes[level];
+		struct extent_buffer *child;
+		int slot = slots[level];
+		u64 bytenr;
+		u64 oid;
+		int i;
+
+		if (slot >= apfs_header_nritems(node)) {
+			free_extent_buffer(node);
+			nodes[level] = NULL;
+			level++;
+			continue;
+		}
+
+		if (scrub_cancelled(ms)) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		/* the children of this node are read one after another */
+		if (slot == 0 && level > 1) {
+			for (i = 1; i < apfs_header_nritems(node); i++) {
+				bytenr = apfs_node_child_bytenr(fs_info, node,
+								i);
+				if (bytenr)
+					apfs_readahead_tree_block(fs_info,
+						bytenr, apfs_header_owner(node),
+						0, level - 1);
+			}
+		}
+		slots[level]++;
+
+		oid = scrub_child_oid(node, slot);
+		bytenr = apfs_node_child_bytenr(fs_info, node, slot);
+		if (!bytenr) {
+			scrub_count_error(ms, &ms->stat.verify_errors);
+			apfs_warn_rl(fs_info,
+				     "scrub: can't locate child oid %llu of node %llu",
+				     oid, node->start);
+			continue;
+		}
+
+		ret = scrub_add_obj(ms, bytenr, oid,
+				    stg | APFS_OBJ_TYPE_BTREE_NODE, subtype,
+				    nodesize);
+		if (ret)
+			break;
+
+		if (level == 1)
+			continue;
+
+		child = apfs_read_node_child(fs_info, node, slot);
+		if (IS_ERR(child)) {
+			/* the worker reports what's wrong with it */
+			continue;
+		}
+		nodes[level - 1] = child;
+		slots[level - 1] = 0;
+		level--;
+	}
+
+	for (level = 0; level <= top; level++)
+		free_extent_buffer(nodes[level]);
+	return ret;
+}
+
+/*
+ * Collect the chunk info blocks of spaceman device @dev, either listed in
+ * the spaceman itself or in chunk info address blocks.
+ */
+static int scrub_collect_spaceman_dev(struct apfs_meta_scrub *ms,
+				      const struct spaceman_phys *sm,
+				      u32 sm_size, int dev)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	struct apfs_nx_info *nx_info = fs_info->nx_info;
+	const u32 block_size = nx_info->block_size;
+	u32 cib_count = le32_to_cpu(sm->dev[dev].cib_count);
+	u32 cab_count = le32_to_cpu(sm->dev[dev].cab_count);
+	u32 offset = le32_to_cpu(sm->dev[dev].addr_offset);
+	u32 nr_addrs = cab_count ? cab_count : cib_count;
+	const __le64 *addrs = (const void *)sm + offset;
+	struct cib_addr_block *cab = NULL;
+	u32 max_per_cab;
+	u32 i;
+	u32 j;
+	int ret = 0;
+
+	if (!nr_addrs)
+		return 0;
+	if (offset > sm_size ||
+	    nr_addrs > (sm_size - offset) / sizeof(__le64)) {
+		scrub_count_error(ms, &ms->stat.verify_errors);
+		apfs_warn_rl(fs_info,
+			     "scrub: spaceman device %d address array out of bounds",
+			     dev);
+		return 0;
+	}
+
+	if (!cab_count) {
+		for (i = 0; i < cib_count && !ret; i++) {
+			u64 bno = le64_to_cpu(addrs[i]);
+
+			ret = scrub_add_obj(ms, bno << nx_info->block_size_bits,
+				bno, APFS_STG_PHYSICAL |
+				APFS_OBJ_TYPE_SPACEMAN_CIB, 0, block_size);
+		}
+		return ret;
+	}
+
+	cab = kmalloc(block_size, GFP_NOFS);
+	if (!cab) {
+		scrub_count_error(ms, &ms->stat.malloc_errors);
+		return -ENOMEM;
+	}
+	max_per_cab = (block_size - sizeof(*cab)) / sizeof(__le64);
+
+	for (i = 0; i < cab_count && !ret; i++) {
+		u64 bno = le64_to_cpu(addrs[i]);
+		u64 paddr = bno << nx_info->block_size_bits;
+		u32 count;
+
+		ret = scrub_add_obj(ms, paddr, bno, APFS_STG_PHYSICAL |
+				    APFS_OBJ_TYPE_SPACEMAN_CAB, 0, block_size);
+		if (ret)
+			break;
+
+		if (apfs_read_generic(nx_info->device->bdev, paddr, block_size,
+				      cab)) {
+			/* the worker counts the read error */
+			continue;
+		}
+		count = le32_to_cpu(cab->cib_count);
+		if (count > max_per_cab) {
+			scrub_count_error(ms, &ms->stat.verify_errors);
+			apfs_warn_rl(fs_info,
+				     "scrub: chunk info address block %llu has too many entries: %u > %u",
+				     paddr, count, max_per_cab);
+			continue;
+		}
+		for (j = 0; j < count && !ret; j++) {
+			u64 cib = le64_to_cpu(((__le64 *)cab->cib_addr)[j]);
+
+			ret = scrub_add_obj(ms, cib << nx_info->block_size_bits,
+				cib, APFS_STG_PHYSICAL |
+				APFS_OBJ_TYPE_SPACEMAN_CIB, 0, block_size);
+		}
+	}
+
+	kfree(cab);
+	return ret;
+}
+
+static int scrub_collect_spaceman(struct apfs_meta_scrub *ms, u64 paddr,
+				  u32 size)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	struct spaceman_phys *sm;
+	int ret;
+	int dev;
+
+	if (size < sizeof(*sm)) {
+		scrub_count_error(ms, &ms->stat.verify_errors);
+		return 0;
+	}
+
+	sm = kvmalloc(size, GFP_NOFS);
+	if (!sm) {
+		scrub_count_error(ms, &ms->stat.malloc_errors);
+		return -ENOMEM;
+	}
+
+	ret = apfs_read_generic(fs_info->nx_info->device->bdev, paddr, size,
+				sm);
+	if (ret) {
+		/* the worker counts the read error */
+		ret = 0;
+		goto out;
+	}
+	if (apfs_verify_obj_csum(sm, size))
+		goto out;
+
+	for (dev = 0; dev < SD_COUNT && !ret; dev++)
+		ret = scrub_collect_spaceman_dev(ms, sm, size, dev);
+out:
+	kvfree(sm);
+	return ret;
+}
+
+/*
+ * Collect the checkpoint map blocks of the mounted checkpoint and every
+ * ephemeral object they map.
+ */
+static int scrub_collect_checkpoint(struct apfs_meta_scrub *ms)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	struct apfs_nx_info *nx_info = fs_info->nx_info;
+	struct apfs_nx_superblock *sb = nx_info->super_copy;
+	u64 desc_base = apfs_nx_super_xp_desc_base(sb);
+	u64 desc_blocks = apfs_nx_super_xp_desc_blocks(sb);
+	u64 desc_index = apfs_nx_super_xp_desc_index(sb);
+	u64 desc_len = apfs_nx_super_xp_desc_len(sb);
+	const u32 block_size = nx_info->block_size;
+	struct apfs_checkpoint_map_phys *cpm;
+	u32 max_per_block;
+	int ret = 0;
+	u64 i;
+
+	if (desc_base == 0 || desc_len == 0 || desc_blocks == 0)
+		return 0;
+
+	cpm = kmalloc(block_size, GFP_NOFS);
+	if (!cpm) {
+		scrub_count_error(ms, &ms->stat.malloc_errors);
+		return -ENOMEM;
+	}
+	max_per_block = (block_size - sizeof(*cpm)) /
+		sizeof(struct apfs_checkpoint_mapping);
+
+	/* the last block of the checkpoint is the container superblock */
+	for (i = 0; i + 1 < desc_len && !ret; i++) {
+		u64 bno = desc_base + (desc_index + i) % desc_blocks;
+		u64 cpm_paddr = bno << nx_info->block_size_bits;
+		u32 count;
+		u32 j;
+
+		if (scrub_cancelled(ms)) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		if (apfs_read_generic(nx_info->device->bdev, cpm_paddr,
+				      block_size, cpm)) {
+			scrub_count_error(ms, &ms->stat.read_errors);
+			continue;
+		}
+		if ((apfs_stack_obj_type(&cpm->o) & APFS_OBJ_TYPE_MASK) !=
+		    APFS_OBJ_TYPE_CHECKPOINT_MAP)
+			continue;
+
+		ret = scrub_add_obj(ms, cpm_paddr, bno, APFS_STG_PHYSICAL |
+				    APFS_OBJ_TYPE_CHECKPOINT_MAP, 0,
+				    block_size);
+		if (ret)
+			break;
+
+		count = apfs_checkpoint_map_count(cpm);
+		if (count > max_per_block) {
+			scrub_count_error(ms, &ms->stat.verify_errors);
+			apfs_warn_rl(fs_info,
+				     "scrub: checkpoint map at %llu has too many mappings: %u > %u",
+				     cpm_paddr, count, max_per_block);
+			continue;
+		}
+
+		for (j = 0; j < count && !ret; j++) {
+			const struct apfs_checkpoint_mapping *map = &cpm->map[j];
+			u64 paddr = le64_to_cpu(map->paddr) <<
+				nx_info->block_size_bits;
+			u32 type = le32_to_cpu(map->type);
+			u32 size = le32_to_cpu(map->size);
+
+			if (!size || !IS_ALIGNED(size, block_size)) {
+				scrub_count_error(ms, &ms->stat.verify_errors);
+				continue;
+			}
+			ret = scrub_add_obj(ms, paddr, le64_to_cpu(map->oid),
+					    type, le32_to_cpu(map->subtype),
+					    size);
+			if (!ret && (type & APFS_OBJ_TYPE_MASK) ==
+			    APFS_OBJ_TYPE_SPACEMAN)
+				ret = scrub_collect_spaceman(ms, paddr, size);
+		}
+
+		if (apfs_checkpoint_map_flags(cpm) & APFS_CHECKPOINT_MAP_LAST)
+			break;
+	}
+
+	kfree(cpm);
+	return ret;
+}
+
+static int scrub_collect_all(struct apfs_meta_scrub *ms)
+{
+	struct apfs_fs_info *fs_info = ms->fs_info;
+	struct apfs_nx_info *nx_info = fs_info->nx_info;
+	struct apfs_vol_superblock *vsb = fs_info->__super_copy;
+	const u32 block_size = nx_info->block_size;
+	u64 omap_oid;
+	int ret;
+
+	ret = scrub_collect_checkpoint(ms);
+	if (ret)
+		return ret;
+
+	/* container omap */
+	omap_oid = apfs_nx_super_omap_oid(nx_info->super_copy);
+	ret = scrub_add_obj(ms, omap_oid << nx_info->block_size_bits, omap_oid,
+			    APFS_STG_PHYSICAL | APFS_OBJ_TYPE_OMAP, 0,
+			    block_size);
+	if (ret)
+		return ret;
+	if (nx_info->omap_root && nx_info->omap_root->node) {
+		ret = scrub_collect_tree(ms, nx_info->vol, nx_info->omap_root,
+				nx_info->omap_root->node->start >>
+				nx_info->block_size_bits,
+				APFS_STG_PHYSICAL, APFS_OBJ_TYPE_OMAP);
+		if (ret)
+			return ret;
+	}
+
+	/* volume omap */
+	omap_oid = apfs_volume_super_omap_oid(vsb);
+	ret = scrub_add_obj(ms, omap_oid << fs_info->block_size_bits, omap_oid,
+			    APFS_STG_PHYSICAL | APFS_OBJ_TYPE_OMAP, 0,
+			    block_size);
+	if (ret)
+		return ret;
+	if (fs_info->omap_root && fs_info->omap_root->node) {
+		ret = scrub_collect_tree(ms, fs_info, fs_info->omap_root,
+				fs_info->omap_root->node->start >>
+				fs_info->block_size_bits,
+				APFS_STG_PHYSICAL, APFS_OBJ_TYPE_OMAP);
+		if (ret)
+			return ret;
+	}
+
+	ret = scrub_collect_tree(ms, fs_info, fs_info->root_root,
+				 apfs_volume_super_root_tree(vsb),
+				 APFS_STG_VIRTUAL, APFS_OBJ_TYPE_FSTREE);
+	if (ret)
+		return ret;
+
+	ret = scrub_collect_tree(ms, fs_info, fs_info->fext_root,
+				 apfs_volume_super_fext_tree(vsb),
+				 APFS_STG_VIRTUAL, APFS_OBJ_TYPE_FEXT_TREE);
+	if (ret)
+		return ret;
+
+	/* extentref and snapshot meta trees are physical */
+	ret = scrub_collect_tree(ms, fs_info, fs_info->extref_root,
+				 apfs_volume_super_extref_tree(vsb),
+				 APFS_STG_PHYSICAL,
+				 APFS_OBJ_TYPE_EXTENT_LIST_TREE);
+	if (ret)
+		return ret;
+
+	return scrub_collect_tree(ms, fs_info, fs_info->snap_root,
+				  apfs_volume_super_snap_tree(vsb),
+				  APFS_STG_PHYSICAL, APFS_OBJ_TYPE_SNAPTREE);
+}
+
+/*
+ * Verify every metadata object of the volume behind @fs_info and of its
+ * container that lies in the physical range [@start, @end].
+ *
+ * Progress can be read with apfs_scrub_metadata_progress() while this runs,
+ * and apfs_scrub_cancel() stops it with -ECANCELED.  The final counters are
+ * copied to @progress in any case.
+ */
+int apfs_scrub_metadata(struct apfs_fs_info *fs_info, u64 start, u64 end,
+			struct apfs_scrub_progress *progress)
+{
+	struct apfs_meta_scrub *ms;
+	int ret;
+
+	if (apfs_fs_closing(fs_info))
+		return -EAGAIN;
+
+	ms = kzalloc(sizeof(*ms), GFP_KERNEL);
+	if (!ms)
+		return -ENOMEM;
+	ms->fs_info = fs_info;
+	ms->start = start;
+	ms->end = end;
+	ms->max_xid = fs_info->nx_info->generation;
+	atomic_set(&ms->pending, 0);
+	init_waitqueue_head(&ms->wait);
+	spin_lock_init(&ms->stat_lock);
+
+	ms->objs = kvmalloc_array(APFS_SCRUB_MAX_OBJS, sizeof(*ms->objs),
+				  GFP_KERNEL);
+	ms->workers = apfs_alloc_workqueue(fs_info, "scrub-meta",
+					   WQ_FREEZABLE | WQ_UNBOUND,
+					   fs_info->thread_pool_size, 4);
+	if (!ms->objs || !ms->workers) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	mutex_lock(&fs_info->scrub_lock);
+	if (fs_info->meta_scrub || atomic_read(&fs_info->scrubs_running)) {
+		mutex_unlock(&fs_info->scrub_lock);
+		ret = -EINPROGRESS;
+		goto out_free;
+	}
+	fs_info->meta_scrub = ms;
+	atomic_inc(&fs_info->scrubs_running);
+	mutex_unlock(&fs_info->scrub_lock);
+
+	ret = scrub_collect_all(ms);
+	if (!ret)
+		ret = scrub_flush(ms);
+	else
+		scrub_flush(ms);
+
+	mutex_lock(&fs_info->scrub_lock);
+	fs_info->meta_scrub = NULL;
+	atomic_dec(&fs_info->scrubs_running);
+	mutex_unlock(&fs_info->scrub_lock);
+	wake_up(&fs_info->scrub_pause_wait);
+
+	memcpy(progress, &ms->stat, sizeof(*progress));
+	apfs_info(fs_info,
+"scrub: metadata %llu objects %llu bytes, %llu read %llu csum %llu verify errors",
+		  ms->stat.tree_extents_scrubbed, ms->stat.tree_bytes_scrubbed,
+		  ms->stat.read_errors, ms->stat.csum_errors,
+		  ms->stat.verify_errors);
+
+out_free:
+	apfs_destroy_workqueue(ms->workers);
+	kvfree(ms->objs);
+	kfree(ms);
+	return ret;
+}
+
+int apfs_scrub_metadata_progress(struct apfs_fs_info *fs_info,
+				 struct apfs_scrub_progress *progress)
+{
+	struct apfs_meta_scrub *ms;
+	int ret = -ENOTCONN;
+
+	mutex_lock(&fs_info->scrub_lock);
+	ms = fs_info->meta_scrub;
+	if (ms) {
+		spin_lock(&ms->stat_lock);
+		memcpy(progress, &ms->stat, sizeof(*progress));
+		spin_unlock(&ms->stat_lock);
+		ret = 0;
+	}
+	mutex_unlock(&fs_info->scrub_lock);
+
+	return ret;
+}
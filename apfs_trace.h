@@ -30,6 +30,8 @@ struct apfs_qgroup;
 struct extent_io_tree;
 struct prelim_ref;
 struct apfs_space_info;
+struct apfs_key;
+struct apfs_path;
 
 #define show_ref_type(type)						\
 	__print_symbolic(type,						\
@@ -159,10 +161,11 @@ FLUSH_STATES
 #define APFS_FSID_SIZE 16
 #define TP_STRUCT__entry_fsid __array(u8, fsid, APFS_FSID_SIZE)
 
+/* volumes have no fs_devices of their own, tag events with the volume uuid */
 #define TP_fast_assign_fsid(fs_info)					\
 ({									\
-	if (fs_info)							\
-		memcpy(__entry->fsid, fs_info->fs_devices->fsid,	\
+	if (fs_info && fs_info->__super_copy)				\
+		memcpy(__entry->fsid, fs_info->__super_copy->uuid,	\
 		       APFS_FSID_SIZE);				\
 	else								\
 		memset(__entry->fsid, 0, APFS_FSID_SIZE);		\
@@ -2250,6 +2253,198 @@ DEFINE_EVENT(apfs__space_info_update, update_bytes_pinned,
 	TP_ARGS(fs_info, sinfo, old, diff)
 );
 
+/*
+ * Read path events.  Callers that report a latency sample ktime_get_ns() into
+ * @start_ns only when the event is enabled, the delta is taken at record time
+ * so a disabled event costs nothing but the static branch.
+ */
+#define apfs_trace_latency(start_ns)					\
+	((start_ns) ? ktime_get_ns() - (start_ns) : 0)
+
+TRACE_EVENT(apfs_lookup_dir_rec,
+
+	TP_PROTO(const struct apfs_root *root, const struct apfs_key *key,
+		 const struct apfs_path *path, int ret, u64 start_ns),
+
+	TP_ARGS(root, key, path, ret, start_ns),
+
+	TP_STRUCT__entry_apfs(
+		__field(	u64,	dir		)
+		__field(	u32,	hash		)
+		__field(	u16,	namelen		)
+		__field(	u64,	leaf		)
+		__field(	int,	slot		)
+		__field(	int,	ret		)
+		__field(	u64,	latency_ns	)
+	),
+
+	TP_fast_assign_apfs(root->fs_info,
+		__entry->dir		= key->oid;
+		__entry->hash		= key->hash;
+		__entry->namelen	= key->namelen;
+		__entry->leaf		= path->nodes[0] ?
+					  path->nodes[0]->start : 0;
+		__entry->slot		= path->slots[0];
+		__entry->ret		= ret;
+		__entry->latency_ns	= apfs_trace_latency(start_ns);
+	),
+
+	TP_printk_apfs("dir=%llu hash=0x%x namelen=%u leaf=%llu slot=%d ret=%d "
+		  "latency_ns=%llu",
+		  __entry->dir, __entry->hash, __entry->namelen,
+		  __entry->leaf, __entry->slot, __entry->ret,
+		  __entry->latency_ns)
+);
+
+TRACE_EVENT(apfs_omap_lookup,
+
+	TP_PROTO(const struct apfs_root *omap_root, u64 oid, u64 xid,
+		 u64 paddr, bool cached, int ret, u64 start_ns),
+
+	TP_ARGS(omap_root, oid, xid, paddr, cached, ret, start_ns),
+
+	TP_STRUCT__entry_apfs(
+		__field(	u64,	omap		)
+		__field(	u64,	oid		)
+		__field(	u64,	xid		)
+		__field(	u64,	paddr		)
+		__field(	bool,	cached		)
+		__field(	int,	ret		)
+		__field(	u64,	latency_ns	)
+	),
+
+	TP_fast_assign_apfs(omap_root->fs_info,
+		__entry->omap		= omap_root->node->start;
+		__entry->oid		= oid;
+		__entry->xid		= xid;
+		__entry->paddr		= paddr;
+		__entry->cached		= cached;
+		__entry->ret		= ret;
+		__entry->latency_ns	= apfs_trace_latency(start_ns);
+	),
+
+	TP_printk_apfs("omap=%llu oid=%llu xid=%llu paddr=%llu cached=%d "
+		  "ret=%d latency_ns=%llu",
+		  __entry->omap, __entry->oid, __entry->xid, __entry->paddr,
+		  __entry->cached, __entry->ret, __entry->latency_ns)
+);
+
+TRACE_EVENT(apfs_map_compressed_extent,
+
+	TP_PROTO(const struct apfs_inode *inode, const struct extent_map *map),
+
+	TP_ARGS(inode, map),
+
+	TP_STRUCT__entry_apfs(
+		__field(	u64,  ino		)
+		__field(	u64,  start		)
+		__field(	u64,  len		)
+		__field(	u64,  orig_start	)
+		__field(	u64,  block_start	)
+		__field(	u64,  block_len		)
+		__field(	u64,  offset		)
+		__field(	unsigned int,  compress_type	)
+	),
+
+	TP_fast_assign_apfs(inode->root->fs_info,
+		__entry->ino		= apfs_ino(inode);
+		__entry->start		= map->start;
+		__entry->len		= map->len;
+		__entry->orig_start	= map->orig_start;
+		__entry->block_start	= map->block_start;
+		__entry->block_len	= map->block_len;
+		__entry->offset		= map->offset;
+		__entry->compress_type	= map->compress_type;
+	),
+
+	TP_printk_apfs("ino=%llu start=%llu len=%llu orig_start=%llu "
+		  "block_start=%llu block_len=%llu offset=%llu "
+		  "compress_type=%u",
+		  __entry->ino, __entry->start, __entry->len,
+		  __entry->orig_start, __entry->block_start,
+		  __entry->block_len, __entry->offset,
+		  __entry->compress_type)
+);
+
+DECLARE_EVENT_CLASS(apfs__decompress,
+
+	TP_PROTO(const struct inode *inode, u64 start, int type,
+		 u32 compressed_len, u32 len, int ret, u64 start_ns),
+
+	TP_ARGS(inode, start, type, compressed_len, len, ret, start_ns),
+
+	TP_STRUCT__entry_apfs(
+		__field(	u64,	ino		)
+		__field(	u64,	start		)
+		__field(	int,	type		)
+		__field(	u32,	compressed_len	)
+		__field(	u32,	len		)
+		__field(	int,	ret		)
+		__field(	u64,	latency_ns	)
+	),
+
+	TP_fast_assign_apfs(apfs_sb(inode->i_sb),
+		__entry->ino		= apfs_ino(APFS_I(inode));
+		__entry->start		= start;
+		__entry->type		= type;
+		__entry->compressed_len	= compressed_len;
+		__entry->len		= len;
+		__entry->ret		= ret;
+		__entry->latency_ns	= apfs_trace_latency(start_ns);
+	),
+
+	TP_printk_apfs("ino=%llu start=%llu type=%d compressed_len=%u len=%u "
+		  "ret=%d latency_ns=%llu",
+		  __entry->ino, __entry->start, __entry->type,
+		  __entry->compressed_len, __entry->len, __entry->ret,
+		  __entry->latency_ns)
+);
+
+DEFINE_EVENT(apfs__decompress, apfs_decompress_bio,
+
+	TP_PROTO(const struct inode *inode, u64 start, int type,
+		 u32 compressed_len, u32 len, int ret, u64 start_ns),
+
+	TP_ARGS(inode, start, type, compressed_len, len, ret, start_ns)
+);
+
+DEFINE_EVENT(apfs__decompress, apfs_decompress_inline,
+
+	TP_PROTO(const struct inode *inode, u64 start, int type,
+		 u32 compressed_len, u32 len, int ret, u64 start_ns),
+
+	TP_ARGS(inode, start, type, compressed_len, len, ret, start_ns)
+);
+
+TRACE_EVENT(apfs_readdir_entry,
+
+	TP_PROTO(const struct inode *dir, u64 pos, u64 ino, u8 type,
+		 const char *name, int name_len),
+
+	TP_ARGS(dir, pos, ino, type, name, name_len),
+
+	TP_STRUCT__entry_apfs(
+		__field(	u64,	dir		)
+		__field(	u64,	pos		)
+		__field(	u64,	ino		)
+		__field(	u8,	type		)
+		__dynamic_array(char,	name,	name_len + 1	)
+	),
+
+	TP_fast_assign_apfs(apfs_sb(dir->i_sb),
+		__entry->dir		= apfs_ino(APFS_I(dir));
+		__entry->pos		= pos;
+		__entry->ino		= ino;
+		__entry->type		= type;
+		memcpy(__get_str(name), name, name_len);
+		__get_str(name)[name_len] = '\0';
+	),
+
+	TP_printk_apfs("dir=%llu pos=%llu ino=%llu type=%u name=%s",
+		  __entry->dir, __entry->pos, __entry->ino, __entry->type,
+		  __get_str(name))
+);
+
 #endif /* _TRACE_APFS_H */
 
 #undef TRACE_INCLUDE_PATH
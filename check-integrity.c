@@ -2475,25 +2475,25 @@ static void apfsic_dump_tree_sub(const struct apfsic_state *state,
 			     block->logical_bytenr, block->dev_state->name,
 			     block->dev_bytenr, block->mirror_num);
 	if (indent_level + indent_add > APFSIC_TREE_DUMP_MAX_INDENT_LEVEL) {
-		trace_printk("[...]\n");
+		pr_cont("[...]\n");
 		return;
 	}
-	trace_printk(buf);
+	pr_cont("%s", buf);
 	indent_level += indent_add;
 	if (list_empty(&block->ref_to_list)) {
-		trace_printk("\n");
+		pr_cont("\n");
 		return;
 	}
 	if (block->mirror_num > 1 &&
 	    !(state->print_mask & APFSIC_PRINT_MASK_TREE_WITH_ALL_MIRRORS)) {
-		trace_printk(" [...]\n");
+		pr_cont(" [...]\n");
 		return;
 	}
 
 	cursor_position = indent_level;
 	list_for_each_entry(l, &block->ref_to_list, node_ref_to) {
 		while (cursor_position < indent_level) {
-			trace_printk(" ");
+			pr_cont(" ");
 			cursor_position++;
 		}
 		if (l->ref_cnt > 1)
@@ -2502,12 +2502,12 @@ static void apfsic_dump_tree_sub(const struct apfsic_state *state,
 			indent_add = sprintf(buf, " --> ");
 		if (indent_level + indent_add >
 		    APFSIC_TREE_DUMP_MAX_INDENT_LEVEL) {
-			trace_printk("[...]\n");
+			pr_cont("[...]\n");
 			cursor_position = 0;
 			continue;
 		}
 
-		trace_printk(buf);
+		pr_cont("%s", buf);
 
 		apfsic_dump_tree_sub(state, l->block_ref_to,
 				      indent_level + indent_add);
@@ -2754,12 +2754,6 @@ leave:
 void apfsic_submit_bio(struct bio *bio)
 {
 	__apfsic_submit_bio(bio);
-
-	trace_printk(
-		"apfs_map_bio: rw %d 0x%x, sector=%llu, size=%u",
-		bio_op(bio), bio->bi_opf, bio->bi_iter.bi_sector,
-		bio->bi_iter.bi_size);
-
 	submit_bio(bio);
 }
 
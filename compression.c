@@ -17,6 +17,9 @@
 #include <linux/slab.h>
 #include <linux/sched/mm.h>
 #include <linux/log2.h>
+#include <linux/hashtable.h>
+#include <linux/shrinker.h>
+#include <linux/vmalloc.h>
 #include <crypto/hash.h>
 #include "misc.h"
 #include "ctree.h"
@@ -29,6 +32,7 @@
 #include "extent_io.h"
 #include "extent_map.h"
 #include "zoned.h"
+#include "apfs_trace.h"
 
 static const char* const apfs_compress_types[] = {
 	"", "zlib_attr", "zlib_rsrc", "lzvn_attr", "lzvn_rsrc"
@@ -320,7 +324,9 @@ static void end_compressed_bio_read(struct bio *bio)
 
 csum_failed:
 	if (ret) {
-		trace_printk("APFS: failed to decompress bio start %llu\n", cb->start);
+		apfs_err_rl(apfs_sb(cb->inode->i_sb),
+			    "failed to read compressed ino %llu start %llu: %d",
+			    apfs_ino(APFS_I(cb->inode)), cb->start, ret);
 		cb->errors = 1;
 	}
 
@@ -607,121 +613,75 @@ blk_status_t apfs_submit_compressed_write(struct apfs_inode *inode, u64 start,
 	return 0;
 }
 
-static u64 bio_end_offset(struct bio *bio)
-{
-	struct bio_vec *last = bio_last_bvec_all(bio);
-
-	return page_offset(last->bv_page) + last->bv_len + last->bv_offset;
-}
-
-static noinline int add_ra_bio_pages(struct inode *inode,
-				     u64 compressed_end,
-				     struct compressed_bio *cb)
+/*
+ * Put the pages of a decoded chunk that the read didn't ask for into the page
+ * cache, so the readahead coming for them a moment later finds them uptodate
+ * instead of reading and decompressing the chunk again.
+ *
+ * @buf holds the @len bytes of the chunk starting at file offset @start.  This
+ * is opportunistic: pages already cached, the bio's own included, are skipped
+ * and nothing waits for memory.
+ */
+void apfs_fill_chunk_pages(struct inode *inode, u64 start, const u8 *buf,
+			   u32 len)
 {
+	struct address_space *mapping = inode->i_mapping;
+	gfp_t gfp = mapping_gfp_constraint(mapping, ~__GFP_FS) |
+		    __GFP_NORETRY | __GFP_NOWARN;
+	u64 isize = i_size_read(inode);
 	unsigned long end_index;
 	unsigned long pg_index;
-	u64 last_offset;
-	u64 isize = i_size_read(inode);
-	int ret;
-	struct page *page;
 	unsigned long nr_pages = 0;
-	struct extent_map *em;
-	struct address_space *mapping = inode->i_mapping;
-	struct extent_map_tree *em_tree;
-	struct extent_io_tree *tree;
-	u64 end;
-	int misses = 0;
-
-	last_offset = bio_end_offset(cb->orig_bio);
-	em_tree = &APFS_I(inode)->extent_tree;
-	tree = &APFS_I(inode)->io_tree;
-
-	if (isize == 0)
-		return 0;
+	struct page *page;
+	u32 offset;
+	u32 bytes;
 
-	end_index = (i_size_read(inode) - 1) >> PAGE_SHIFT;
+	if (isize == 0 || !IS_ALIGNED(start, PAGE_SIZE))
+		return;
 
-	while (last_offset < compressed_end) {
-		pg_index = last_offset >> PAGE_SHIFT;
+	end_index = (isize - 1) >> PAGE_SHIFT;
 
+	for (offset = 0; offset < len; offset += PAGE_SIZE) {
+		pg_index = (start + offset) >> PAGE_SHIFT;
 		if (pg_index > end_index)
 			break;
 
 		page = xa_load(&mapping->i_pages, pg_index);
-		if (page && !xa_is_value(page)) {
-			misses++;
-			if (misses > 4)
-				break;
-			goto next;
-		}
+		if (page && !xa_is_value(page))
+			continue;
 
-		page = __page_cache_alloc(mapping_gfp_constraint(mapping,
-								 ~__GFP_FS));
+		page = __page_cache_alloc(gfp);
 		if (!page)
 			break;
 
-		if (add_to_page_cache_lru(page, mapping, pg_index, GFP_NOFS)) {
+		if (add_to_page_cache_lru(page, mapping, pg_index, gfp)) {
 			put_page(page);
-			goto next;
-		}
-
-		/*
-		 * at this point, we have a locked page in the page cache
-		 * for these bytes in the file.  But, we have to make
-		 * sure they map to this compressed extent on disk.
-		 */
-		ret = set_page_extent_mapped(page);
-		if (ret < 0) {
-			unlock_page(page);
-			put_page(page);
-			break;
+			continue;
 		}
 
-		end = last_offset + PAGE_SIZE - 1;
-		lock_extent(tree, last_offset, end);
-		read_lock(&em_tree->lock);
-		em = lookup_extent_mapping(em_tree, last_offset,
-					   PAGE_SIZE);
-		read_unlock(&em_tree->lock);
-
-		if (!em || last_offset < em->start ||
-		    (last_offset + PAGE_SIZE > extent_map_end(em)) ||
-		    (em->block_start >> 9) != cb->orig_bio->bi_iter.bi_sector) {
-			free_extent_map(em);
-			unlock_extent(tree, last_offset, end);
+		if (set_page_extent_mapped(page) < 0) {
 			unlock_page(page);
 			put_page(page);
 			break;
 		}
-		free_extent_map(em);
-
-		if (page->index == end_index) {
-			size_t zero_offset = offset_in_page(isize);
-
-			if (zero_offset) {
-				int zeros;
-				zeros = PAGE_SIZE - zero_offset;
-				memzero_page(page, zero_offset, zeros);
-				flush_dcache_page(page);
-			}
-		}
 
-		ret = bio_add_page(cb->orig_bio, page,
-				   PAGE_SIZE, 0);
+		bytes = min_t(u32, PAGE_SIZE, len - offset);
+		if (pg_index == end_index && offset_in_page(isize))
+			bytes = min_t(u32, bytes, offset_in_page(isize));
+		memcpy_to_page(page, 0, buf + offset, bytes);
+		if (bytes < PAGE_SIZE)
+			memzero_page(page, bytes, PAGE_SIZE - bytes);
+		flush_dcache_page(page);
 
-		if (ret == PAGE_SIZE) {
-			nr_pages++;
-			put_page(page);
-		} else {
-			unlock_extent(tree, last_offset, end);
-			unlock_page(page);
-			put_page(page);
-			break;
-		}
-next:
-		last_offset += PAGE_SIZE;
+		SetPageUptodate(page);
+		unlock_page(page);
+		put_page(page);
+		nr_pages++;
 	}
-	return 0;
+
+	if (nr_pages)
+		apfs_stat_add(apfs_sb(inode->i_sb), APFS_STAT_CHUNK_FILL_PAGES,
+			      nr_pages);
 }
 
 /*
@@ -763,6 +723,12 @@ blk_status_t apfs_submit_compressed_read(struct inode *inode, struct bio *bio,
 	if (!em)
 		return BLK_STS_IOERR;
 
+	/* the whole chunk may still be around from an earlier read */
+	if (apfs_chunk_cache_read(inode, em->orig_start, bio)) {
+		free_extent_map(em);
+		return 0;
+	}
+
 	compressed_len = em->block_len;
 
 	if (!IS_ALIGNED(em->offset, PAGE_SIZE))
@@ -788,6 +754,7 @@ blk_status_t apfs_submit_compressed_read(struct inode *inode, struct bio *bio,
 	cb->len = bio->bi_iter.bi_size;
 	cb->compress_type = extent_compress_type(bio_flags);
 	cb->orig_bio = bio;
+	cb->chunk = NULL;
 
 	nr_pages = DIV_ROUND_UP(compressed_len, PAGE_SIZE);
 	cb->compressed_pages = kcalloc(nr_pages, sizeof(struct page *),
@@ -807,11 +774,6 @@ blk_status_t apfs_submit_compressed_read(struct inode *inode, struct bio *bio,
 	faili = nr_pages - 1;
 	cb->nr_pages = nr_pages;
 
-	//add_ra_bio_pages(inode, em_start + em_len, cb);
-
-	/* include any pages we added in add_ra-bio_pages */
-	cb->len = bio->bi_iter.bi_size;
-
 	comp_bio = apfs_bio_alloc(cur_disk_byte);
 	comp_bio->bi_opf = REQ_OP_READ;
 	comp_bio->bi_private = cb;
@@ -839,7 +801,7 @@ blk_status_t apfs_submit_compressed_read(struct inode *inode, struct bio *bio,
 		if (bio_add_page(comp_bio, page, pg_len, 0) < pg_len) {
 
 			ret = apfs_bio_wq_end_io(fs_info, comp_bio,
-						  APFS_WQ_ENDIO_DATA);
+						  APFS_WQ_ENDIO_DECOMPRESS);
 			BUG_ON(ret); /* -ENOMEM */
 
 			/*
@@ -866,11 +828,9 @@ blk_status_t apfs_submit_compressed_read(struct inode *inode, struct bio *bio,
 		cur_disk_byte += pg_len;
 	}
 
-	ret = apfs_bio_wq_end_io(fs_info, comp_bio, APFS_WQ_ENDIO_DATA);
+	ret = apfs_bio_wq_end_io(fs_info, comp_bio, APFS_WQ_ENDIO_DECOMPRESS);
 	BUG_ON(ret); /* -ENOMEM */
 
-	trace_printk("compresss map bio %llu %u %u", comp_bio->bi_iter.bi_sector,
-		comp_bio->bi_iter.bi_idx, comp_bio->bi_iter.bi_size);
 	ret = apfs_map_bio(fs_info, comp_bio, mirror_num);
 	if (ret) {
 		comp_bio->bi_status = ret;
@@ -1301,9 +1261,416 @@ int apfs_compress_pages(unsigned int type_level, struct address_space *mapping,
 	return ret;
 }
 
+/* Count a chunk decompressed into @len bytes of file data */
+static void account_decompressed(struct apfs_fs_info *fs_info, int type,
+				 u32 len)
+{
+	enum apfs_stat chunks;
+	enum apfs_stat bytes;
+
+	switch (type) {
+	case APFS_COMPRESS_ZLIB:
+	case APFS_COMPRESS_ZLIB_ATTR:
+	case APFS_COMPRESS_ZLIB_RSRC:
+		chunks = APFS_STAT_ZLIB_CHUNKS;
+		bytes = APFS_STAT_ZLIB_BYTES;
+		break;
+	case APFS_COMPRESS_LZFSE_ATTR:
+	case APFS_COMPRESS_LZFSE_RSRC:
+		chunks = APFS_STAT_LZFSE_CHUNKS;
+		bytes = APFS_STAT_LZFSE_BYTES;
+		break;
+	case APFS_COMPRESS_LZVN_ATTR:
+	case APFS_COMPRESS_LZVN_RSRC:
+		chunks = APFS_STAT_LZVN_CHUNKS;
+		bytes = APFS_STAT_LZVN_BYTES;
+		break;
+	default:
+		return;
+	}
+
+	apfs_stat_inc(fs_info, chunks);
+	apfs_stat_add(fs_info, bytes, len);
+}
+
+/*
+ * Decompressed chunk cache
+ *
+ * Compressed files are made of independent chunks of up to
+ * APFS_MAX_UNCOMPRESSED bytes and a read of any page of a chunk decodes all
+ * of it, so small random reads keep decoding the same chunks again.  The most
+ * recently decoded chunks are kept in one LRU shared by all mounts, keyed by
+ * (fs_info, ino, chunk start), and a read hitting it is served by a memcpy
+ * without any IO.  The LRU is bounded by chunk_cache_limit bytes, 0 turns
+ * the cache off, and is trimmed by a shrinker under memory pressure.
+ */
+#define CHUNK_CACHE_HASH_BITS		8
+#define CHUNK_CACHE_DEFAULT_LIMIT	SZ_8M
+
+static DEFINE_HASHTABLE(chunk_cache_hash, CHUNK_CACHE_HASH_BITS);
+static LIST_HEAD(chunk_cache_lru);
+/* protects chunk_cache_hash, chunk_cache_lru and chunk_cache_bytes */
+static DEFINE_SPINLOCK(chunk_cache_lock);
+static u64 chunk_cache_bytes;
+static u64 chunk_cache_limit = CHUNK_CACHE_DEFAULT_LIMIT;
+static atomic64_t chunk_cache_hits;
+static atomic64_t chunk_cache_misses;
+static atomic64_t chunk_cache_evictions;
+
+static inline unsigned long chunk_cache_key(struct apfs_fs_info *fs_info,
+					    u64 ino, u64 start)
+{
+	return (unsigned long)fs_info ^ (ino << 16) ^
+		(start >> ilog2(APFS_MAX_UNCOMPRESSED));
+}
+
+/* Must be called with chunk_cache_lock held */
+static struct apfs_cached_chunk *chunk_cache_find(struct apfs_fs_info *fs_info,
+						  u64 ino, u64 start)
+{
+	struct apfs_cached_chunk *chunk;
+
+	hash_for_each_possible(chunk_cache_hash, chunk, hash,
+			       chunk_cache_key(fs_info, ino, start)) {
+		if (chunk->fs_info == fs_info && chunk->ino == ino &&
+		    chunk->start == start)
+			return chunk;
+	}
+
+	return NULL;
+}
+
+static void chunk_cache_put(struct apfs_cached_chunk *chunk)
+{
+	if (refcount_dec_and_test(&chunk->refs))
+		kvfree(chunk);
+}
+
+/*
+ * Unlink @chunk from the cache and queue it on @dispose, the cache's
+ * reference is dropped by chunk_cache_dispose() outside of the lock.
+ */
+static void chunk_cache_unlink(struct apfs_cached_chunk *chunk,
+			       struct list_head *dispose)
+{
+	lockdep_assert_held(&chunk_cache_lock);
+
+	hash_del(&chunk->hash);
+	list_move(&chunk->lru, dispose);
+	chunk_cache_bytes -= sizeof(*chunk);
+}
+
+static void chunk_cache_dispose(struct list_head *dispose)
+{
+	struct apfs_cached_chunk *chunk;
+	struct apfs_cached_chunk *tmp;
+
+	list_for_each_entry_safe(chunk, tmp, dispose, lru) {
+		list_del(&chunk->lru);
+		chunk_cache_put(chunk);
+	}
+}
+
+/* Evict up to @nr least recently used chunks while above @limit bytes */
+static unsigned long chunk_cache_evict(u64 limit, unsigned long nr)
+{
+	struct apfs_cached_chunk *chunk;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&chunk_cache_lock);
+	while (freed < nr && chunk_cache_bytes > limit) {
+		chunk = list_first_entry(&chunk_cache_lru,
+					 struct apfs_cached_chunk, lru);
+		chunk_cache_unlink(chunk, &dispose);
+		freed++;
+	}
+	spin_unlock(&chunk_cache_lock);
+
+	atomic64_add(freed, &chunk_cache_evictions);
+	chunk_cache_dispose(&dispose);
+
+	return freed;
+}
+
+/*
+ * Serve @bio from the chunk cache if the chunk starting at file offset @start
+ * of @inode is cached.
+ *
+ * Returns true if @bio was filled and completed, false if it has to be read
+ * and decompressed.
+ */
+bool apfs_chunk_cache_read(struct inode *inode, u64 start, struct bio *bio)
+{
+	struct apfs_fs_info *fs_info = apfs_sb(inode->i_sb);
+	struct apfs_cached_chunk *chunk;
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bvec;
+	u64 ino = apfs_ino(APFS_I(inode));
+	int ret;
+
+	if (!READ_ONCE(chunk_cache_limit))
+		return false;
+
+	spin_lock(&chunk_cache_lock);
+	chunk = chunk_cache_find(fs_info, ino, start);
+	if (chunk) {
+		refcount_inc(&chunk->refs);
+		list_move_tail(&chunk->lru, &chunk_cache_lru);
+	}
+	spin_unlock(&chunk_cache_lock);
+
+	if (!chunk) {
+		atomic64_inc(&chunk_cache_misses);
+		apfs_stat_inc(fs_info, APFS_STAT_CHUNK_CACHE_MISSES);
+		return false;
+	}
+
+	/* nothing has been copied if the bio starts past the chunk */
+	ret = apfs_decompress_buf2page(chunk->data, 0, chunk->len, start, bio);
+	if (ret < 0) {
+		chunk_cache_put(chunk);
+		return false;
+	}
+	apfs_fill_chunk_pages(inode, start, chunk->data, chunk->len);
+	chunk_cache_put(chunk);
+
+	atomic64_inc(&chunk_cache_hits);
+	apfs_stat_inc(fs_info, APFS_STAT_CHUNK_CACHE_HITS);
+
+	zero_fill_bio(bio);
+	bio_for_each_segment_all(bvec, bio, iter_all)
+		SetPageChecked(bvec->bv_page);
+	bio_endio(bio);
+
+	return true;
+}
+
+/*
+ * Get a buffer to decode the chunk of @cb into so it can be cached
+ * afterwards, NULL if the cache is off or memory is short.
+ */
+static struct apfs_cached_chunk *chunk_cache_alloc(struct compressed_bio *cb)
+{
+	struct apfs_cached_chunk *chunk;
+	unsigned int nofs_flag;
+
+	if (READ_ONCE(chunk_cache_limit) < sizeof(*chunk))
+		return NULL;
+
+	/* kvmalloc() only falls back to vmalloc for GFP_KERNEL */
+	nofs_flag = memalloc_nofs_save();
+	chunk = kvmalloc(sizeof(*chunk), GFP_KERNEL | __GFP_NOWARN);
+	memalloc_nofs_restore(nofs_flag);
+	if (!chunk)
+		return NULL;
+
+	INIT_HLIST_NODE(&chunk->hash);
+	INIT_LIST_HEAD(&chunk->lru);
+	refcount_set(&chunk->refs, 1);
+	chunk->fs_info = apfs_sb(cb->inode->i_sb);
+	chunk->ino = apfs_ino(APFS_I(cb->inode));
+	chunk->start = cb->start;
+	chunk->len = 0;
+
+	return chunk;
+}
+
+/* Hand @chunk, fully decoded, over to the cache */
+static void chunk_cache_insert(struct apfs_cached_chunk *chunk)
+{
+	spin_lock(&chunk_cache_lock);
+	/* another reader of the same chunk may have beaten us */
+	if (chunk_cache_find(chunk->fs_info, chunk->ino, chunk->start)) {
+		spin_unlock(&chunk_cache_lock);
+		chunk_cache_put(chunk);
+		return;
+	}
+	hash_add(chunk_cache_hash, &chunk->hash,
+		 chunk_cache_key(chunk->fs_info, chunk->ino, chunk->start));
+	list_add_tail(&chunk->lru, &chunk_cache_lru);
+	chunk_cache_bytes += sizeof(*chunk);
+	spin_unlock(&chunk_cache_lock);
+
+	chunk_cache_evict(READ_ONCE(chunk_cache_limit), ULONG_MAX);
+}
+
+/* Forget every chunk of @fs_info, before it goes away */
+void apfs_chunk_cache_drop_fs(struct apfs_fs_info *fs_info)
+{
+	struct apfs_cached_chunk *chunk;
+	struct apfs_cached_chunk *tmp;
+	LIST_HEAD(dispose);
+
+	spin_lock(&chunk_cache_lock);
+	list_for_each_entry_safe(chunk, tmp, &chunk_cache_lru, lru) {
+		if (chunk->fs_info == fs_info)
+			chunk_cache_unlink(chunk, &dispose);
+	}
+	spin_unlock(&chunk_cache_lock);
+
+	chunk_cache_dispose(&dispose);
+}
+
+/* Set the byte budget of the cache, 0 turns it off and empties it */
+void apfs_chunk_cache_set_limit(u64 limit)
+{
+	WRITE_ONCE(chunk_cache_limit, limit);
+	chunk_cache_evict(limit, ULONG_MAX);
+}
+
+void apfs_chunk_cache_get_stats(struct apfs_chunk_cache_stats *stats)
+{
+	stats->bytes = READ_ONCE(chunk_cache_bytes);
+	stats->limit = READ_ONCE(chunk_cache_limit);
+	stats->hits = atomic64_read(&chunk_cache_hits);
+	stats->misses = atomic64_read(&chunk_cache_misses);
+	stats->evictions = atomic64_read(&chunk_cache_evictions);
+}
+
+static unsigned long chunk_cache_shrink_count(struct shrinker *shrink,
+					      struct shrink_control *sc)
+{
+	return READ_ONCE(chunk_cache_bytes) /
+		sizeof(struct apfs_cached_chunk) ?: SHRINK_EMPTY;
+}
+
+static unsigned long chunk_cache_shrink_scan(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	return chunk_cache_evict(0, sc->nr_to_scan);
+}
+
+static struct shrinker chunk_cache_shrinker = {
+	.count_objects = chunk_cache_shrink_count,
+	.scan_objects = chunk_cache_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/*
+ * Map the compressed pages of @cb into one virtually contiguous range, so the
+ * decoders can read the compressed data in place instead of copying it into
+ * their workspace first.  Returns NULL if the pages can't be mapped.
+ */
+void *apfs_map_compressed_pages(struct compressed_bio *cb)
+{
+	unsigned int nofs_flag;
+	void *addr;
+
+	/* vm_map_ram() allocates with GFP_KERNEL, the file pages are locked */
+	nofs_flag = memalloc_nofs_save();
+	addr = vm_map_ram(cb->compressed_pages, cb->nr_pages, NUMA_NO_NODE);
+	memalloc_nofs_restore(nofs_flag);
+
+	return addr;
+}
+
+void apfs_unmap_compressed_pages(struct compressed_bio *cb, void *addr)
+{
+	vm_unmap_ram(addr, cb->nr_pages);
+}
+
+/*
+ * Size of the file data in the chunk of @cb: every chunk but the last one of
+ * the file is APFS_MAX_UNCOMPRESSED bytes.
+ */
+static u32 chunk_file_len(struct compressed_bio *cb)
+{
+	u64 isize = i_size_read(cb->inode);
+
+	if (cb->start >= isize)
+		return 0;
+	return min_t(u64, APFS_MAX_UNCOMPRESSED, isize - cb->start);
+}
+
+/*
+ * Does the bio of @cb consist of exactly the pages of its chunk, in file
+ * order?  If so and @pages is not NULL, the pages are returned in it.
+ */
+static bool bio_covers_chunk(struct compressed_bio *cb, struct page **pages)
+{
+	u32 len = chunk_file_len(cb);
+	unsigned int nr_pages = DIV_ROUND_UP(len, PAGE_SIZE);
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bvec;
+	unsigned int nr = 0;
+
+	if (!len || !IS_ALIGNED(cb->start, PAGE_SIZE))
+		return false;
+
+	bio_for_each_segment_all(bvec, cb->orig_bio, iter_all) {
+		if (nr == nr_pages || bvec->bv_offset ||
+		    bvec->bv_len != PAGE_SIZE ||
+		    page_offset(bvec->bv_page) !=
+		    cb->start + ((u64)nr << PAGE_SHIFT))
+			return false;
+		if (pages)
+			pages[nr] = bvec->bv_page;
+		nr++;
+	}
+
+	return nr == nr_pages;
+}
+
+/*
+ * If the bio of @cb covers its whole chunk, map its pages contiguously into
+ * @map so the decoders can write the file data straight into them, saving
+ * the copy out of the workspace.
+ */
+bool apfs_map_chunk_bio(struct compressed_bio *cb, struct apfs_chunk_map *map)
+{
+	struct page *pages[APFS_MAX_UNCOMPRESSED >> PAGE_SHIFT];
+	unsigned int nofs_flag;
+
+	if (!bio_covers_chunk(cb, pages))
+		return false;
+
+	map->len = chunk_file_len(cb);
+	map->nr_pages = DIV_ROUND_UP(map->len, PAGE_SIZE);
+	/* same as apfs_map_compressed_pages() */
+	nofs_flag = memalloc_nofs_save();
+	map->addr = vm_map_ram(pages, map->nr_pages, NUMA_NO_NODE);
+	memalloc_nofs_restore(nofs_flag);
+
+	return map->addr != NULL;
+}
+
+/*
+ * Finish a decode of @total_out bytes into @map and complete the bio of @cb.
+ *
+ * Returns 0 if the chunk decoded to its expected size.  Otherwise the bio is
+ * left alone and -EAGAIN tells the caller to decode it the usual way, which
+ * overwrites whatever was written to the pages.
+ */
+int apfs_unmap_chunk_bio(struct compressed_bio *cb, struct apfs_chunk_map *map,
+			 size_t total_out)
+{
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bvec;
+
+	if (total_out != map->len) {
+		vm_unmap_ram(map->addr, map->nr_pages);
+		return -EAGAIN;
+	}
+
+	/* the tail of the last page past EOF */
+	memset(map->addr + map->len, 0,
+	       ((size_t)map->nr_pages << PAGE_SHIFT) - map->len);
+	vm_unmap_ram(map->addr, map->nr_pages);
+
+	bio_for_each_segment_all(bvec, cb->orig_bio, iter_all)
+		flush_dcache_page(bvec->bv_page);
+	/* as if apfs_decompress_buf2page() had copied all of it */
+	bio_advance(cb->orig_bio, cb->orig_bio->bi_iter.bi_size);
+
+	apfs_stat_inc(apfs_sb(cb->inode->i_sb), APFS_STAT_ZERO_COPY_CHUNKS);
+	return 0;
+}
+
 static int apfs_decompress_bio(struct compressed_bio *cb)
 {
 	struct list_head *workspace;
+	u64 start_ns = ktime_get_ns();
 	int ret;
 	int type;
 
@@ -1311,10 +1678,28 @@ static int apfs_decompress_bio(struct compressed_bio *cb)
 		parse_decompress_bio(cb);
 
 	type = cb->compress_type;
+	/* a chunk read as a whole is all in the page cache anyway */
+	if (!bio_covers_chunk(cb, NULL))
+		cb->chunk = chunk_cache_alloc(cb);
 	workspace = get_workspace(type, 0);
 	ret = compression_decompress_bio(type, workspace, cb);
 	put_workspace(type, workspace);
 
+	if (cb->chunk) {
+		/* the decoder fills in the length once it has the whole chunk */
+		if (!ret && cb->chunk->len)
+			chunk_cache_insert(cb->chunk);
+		else
+			chunk_cache_put(cb->chunk);
+		cb->chunk = NULL;
+	}
+
+	apfs_lat_record(apfs_sb(cb->inode->i_sb), APFS_LAT_DECOMPRESS, start_ns);
+	if (!ret)
+		account_decompressed(apfs_sb(cb->inode->i_sb), type, cb->len);
+	trace_apfs_decompress_bio(cb->inode, cb->start, type,
+				  cb->compressed_len, cb->len, ret, start_ns);
+
 	return ret;
 }
 
@@ -1337,15 +1722,28 @@ int apfs_decompress(int type, unsigned char *data_in, struct page *dest_page,
 	return ret;
 }
 
-void __init apfs_init_compress(void)
+int __init apfs_init_compress(void)
 {
+	int ret;
+
 	apfs_init_workspace_manager(APFS_COMPRESS_ZLIB);
 	apfs_init_workspace_manager(APFS_COMPRESS_LZFSE_RSRC);
 	apfs_init_workspace_manager(APFS_COMPRESS_LZVN_RSRC);
+
+	ret = register_shrinker(&chunk_cache_shrinker);
+	if (ret) {
+		apfs_cleanup_workspace_manager(APFS_COMPRESS_ZLIB);
+		apfs_cleanup_workspace_manager(APFS_COMPRESS_LZFSE_RSRC);
+		apfs_cleanup_workspace_manager(APFS_COMPRESS_LZVN_RSRC);
+	}
+
+	return ret;
 }
 
 void __cold apfs_exit_compress(void)
 {
+	unregister_shrinker(&chunk_cache_shrinker);
+	apfs_chunk_cache_set_limit(0);
 	apfs_cleanup_workspace_manager(APFS_COMPRESS_ZLIB);
 	apfs_cleanup_workspace_manager(APFS_COMPRESS_LZFSE_RSRC);
 	apfs_cleanup_workspace_manager(APFS_COMPRESS_LZVN_RSRC);
@@ -9,6 +9,7 @@
 #include <linux/sizes.h>
 
 struct apfs_inode;
+struct apfs_fs_info;
 
 /*
  * We want to make sure that amount of RAM required to uncompress an extent is
@@ -27,6 +28,36 @@ struct apfs_inode;
 
 #define	APFS_ZLIB_DEFAULT_LEVEL		3
 
+/* One decompressed chunk in the chunk cache, see compression.c */
+struct apfs_cached_chunk {
+	struct hlist_node hash;
+	struct list_head lru;
+	refcount_t refs;
+	/* key, @start is the file offset of the chunk */
+	struct apfs_fs_info *fs_info;
+	u64 ino;
+	u64 start;
+	/* bytes of file data in @data */
+	u32 len;
+	u8 data[APFS_MAX_UNCOMPRESSED];
+};
+
+/* The pages of a bio covering a whole chunk, mapped contiguously */
+struct apfs_chunk_map {
+	void *addr;
+	unsigned int nr_pages;
+	/* bytes of file data in the chunk */
+	u32 len;
+};
+
+struct apfs_chunk_cache_stats {
+	u64 bytes;
+	u64 limit;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+};
+
 struct compressed_bio {
 	/* number of bios pending for this compressed extent */
 	refcount_t pending_bios;
@@ -62,6 +93,12 @@ struct compressed_bio {
 	/* for reads, this is the bio we are copying the data into */
 	struct bio *orig_bio;
 
+	/*
+	 * for reads, where to decode the whole chunk for the chunk cache,
+	 * NULL if it is not to be cached
+	 */
+	struct apfs_cached_chunk *chunk;
+
 	/*
 	 * the start of a variable length array of checksums only
 	 * used by reads
@@ -79,9 +116,16 @@ static inline unsigned int apfs_compress_level(unsigned int type_level)
 	return ((type_level & 0xF0) >> 4);
 }
 
-void __init apfs_init_compress(void);
+int __init apfs_init_compress(void);
 void __cold apfs_exit_compress(void);
 
+void apfs_fill_chunk_pages(struct inode *inode, u64 start, const u8 *buf,
+			   u32 len);
+bool apfs_chunk_cache_read(struct inode *inode, u64 start, struct bio *bio);
+void apfs_chunk_cache_drop_fs(struct apfs_fs_info *fs_info);
+void apfs_chunk_cache_set_limit(u64 limit);
+void apfs_chunk_cache_get_stats(struct apfs_chunk_cache_stats *stats);
+
 int apfs_compress_pages(unsigned int type_level, struct address_space *mapping,
 			 u64 start, struct page **pages,
 			 unsigned long *out_pages,
@@ -92,6 +136,11 @@ int apfs_decompress(int type, unsigned char *data_in, struct page *dest_page,
 int apfs_decompress_buf2page(const char *buf, unsigned long buf_start,
 			      unsigned long total_out, u64 disk_start,
 			      struct bio *bio);
+void *apfs_map_compressed_pages(struct compressed_bio *cb);
+void apfs_unmap_compressed_pages(struct compressed_bio *cb, void *addr);
+bool apfs_map_chunk_bio(struct compressed_bio *cb, struct apfs_chunk_map *map);
+int apfs_unmap_chunk_bio(struct compressed_bio *cb, struct apfs_chunk_map *map,
+			 size_t total_out);
 
 blk_status_t apfs_submit_compressed_write(struct apfs_inode *inode, u64 start,
 				  unsigned int len, u64 disk_start,
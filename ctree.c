@@ -7,6 +7,9 @@
 #include <linux/slab.h>
 #include <linux/rbtree.h>
 #include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
 #include "ctree.h"
 #include "disk-io.h"
 #include "transaction.h"
@@ -15,6 +18,7 @@
 #include "volumes.h"
 #include "qgroup.h"
 #include "tree-mod-log.h"
+#include "tree-checker.h"
 #include "apfs_trace.h"
 
 static int split_node(struct apfs_trans_handle *trans, struct apfs_root
@@ -75,8 +79,27 @@ size_t __attribute_const__ apfs_get_num_csums(void)
 	return ARRAY_SIZE(apfs_csums);
 }
 
+/*
+ * One freed path is parked per cpu, so lookups that allocate and free a path
+ * each time don't go to the slab in steady state.
+ */
+static DEFINE_PER_CPU(struct apfs_path *, apfs_path_pool);
+
+#ifdef CONFIG_APFS_FS_RUN_SANITY_TESTS
+atomic_t apfs_test_path_slab_allocs = ATOMIC_INIT(0);
+#endif
+
 struct apfs_path *apfs_alloc_path(void)
 {
+	struct apfs_path *p;
+
+	p = this_cpu_xchg(apfs_path_pool, NULL);
+	if (p)
+		return p;
+
+#ifdef CONFIG_APFS_FS_RUN_SANITY_TESTS
+	atomic_inc(&apfs_test_path_slab_allocs);
+#endif
 	return kmem_cache_zalloc(apfs_path_cachep, GFP_NOFS);
 }
 
@@ -86,7 +109,23 @@ void apfs_free_path(struct apfs_path *p)
 	if (!p)
 		return;
 	apfs_release_path(p);
-	kmem_cache_free(apfs_path_cachep, p);
+	memset(p, 0, sizeof(*p));
+	if (this_cpu_cmpxchg(apfs_path_pool, NULL, p))
+		kmem_cache_free(apfs_path_cachep, p);
+}
+
+/* Called before apfs_path_cachep is destroyed */
+void apfs_path_pool_drain(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct apfs_path *p = per_cpu(apfs_path_pool, cpu);
+
+		per_cpu(apfs_path_pool, cpu) = NULL;
+		if (p)
+			kmem_cache_free(apfs_path_cachep, p);
+	}
 }
 
 /*
@@ -605,18 +644,33 @@ static int comp_keys(const struct extent_buffer *eb,
 	return apfs_comp_cpu_keys(eb, &k1, k2);
 }
 
-static inline int apfs_comp_str(const char *s1, const char *s2)
+/*
+ * Compare two key names over their namelen, which counts the trailing NUL.
+ * The NUL itself is never read, so a search key name may point into caller
+ * memory that isn't terminated. A search key without namelen sorts before
+ * every name of its oid and type.
+ */
+static inline int apfs_comp_names(const char *s1, u16 len1,
+				  const char *s2, u16 len2)
 {
-	trace_printk("s1 %s s2 %s res\n", s1 ? s1 : "NULL" ,
-	       s2 ? s2 : "NULL");
+	u16 len = min(len1, len2);
+	int ret;
+
 	if (!s1 && !s2)
 		return 0;
 	else if (!s1 && s2)
 		return -1;
 	else if (s1 && !s2)
 		return 1;
-	trace_printk("s1 %s s2 %s res %d\n", s1 ,s2, strcmp(s1, s2));
-	return strcmp(s1, s2);
+
+	if (len) {
+		ret = memcmp(s1, s2, len - 1);
+		if (ret)
+			return ret;
+	}
+	if (len1 != len2)
+		return len1 < len2 ? -1 : 1;
+	return 0;
 }
 
 static inline int apfs_comp_casestr(const char *s1, const char *s2)
@@ -640,15 +694,19 @@ apfs_comp_fs_keys(const struct apfs_key *k1, const struct apfs_key *k2,
 	if (k1->type != k2->type)
 		return k1->type < k2->type ? -1 : 1;
 
-	if (k1->type == APFS_TYPE_DIR_REC) {
-		if (!hashed)
-			return apfs_comp_str(k1->name, k2->name);
-		if (k1->hash == k2->hash)
-			return apfs_comp_str(k1->name, k2->name);
-		return k1->hash < k2->hash ? -1 : 1;
-	} else if (k1->type == APFS_TYPE_SNAP_NAME ||
+	if (k1->type == APFS_TYPE_DIR_REC && hashed) {
+		/* hashed records sort by the (hash, namelen) word first */
+		if (k1->hash != k2->hash)
+			return k1->hash < k2->hash ? -1 : 1;
+		if (k1->namelen != k2->namelen)
+			return k1->namelen < k2->namelen ? -1 : 1;
+		return apfs_comp_names(k1->name, k1->namelen,
+				       k2->name, k2->namelen);
+	} else if (k1->type == APFS_TYPE_DIR_REC ||
+		   k1->type == APFS_TYPE_SNAP_NAME ||
 		   k1->type == APFS_TYPE_XATTR) {
-		return apfs_comp_str(k1->name, k2->name);
+		return apfs_comp_names(k1->name, k1->namelen,
+				       k2->name, k2->namelen);
 	}
 
 	if (k1->offset < k2->offset)
@@ -740,11 +798,6 @@ static noinline int generic_bin_search(struct extent_buffer *eb,
 		apfs_item_key_to_cpu(eb, &tmp, mid);
 
 		ret = apfs_comp_cpu_keys(eb, &tmp, key);
-//		trace_printk("low %d mid %d high %d ret: %d\n", low, mid, high, ret);
-//		apfs_print_key_raw(eb, &tmp);
-//		trace_printk(" comp ");
-//		apfs_print_key_raw(eb, key);
-//		trace_printk("\n");
 
 		if (ret < 0)
 			low = mid + 1;
@@ -759,6 +812,151 @@ static noinline int generic_bin_search(struct extent_buffer *eb,
 	return 1;
 }
 
+/*
+ * Decode every key of the fs-tree node @eb once and attach the packed form
+ * to @eb. The keys are decoded by the same toc walk the tree-checker does,
+ * so a table is only built for a node whose toc and key order are sane.
+ * The mount is readonly, so the table stays valid for the lifetime of the
+ * buffer.
+ *
+ * Returns the table, or NULL if it couldn't be built.
+ */
+static const struct apfs_packed_key *
+apfs_node_key_table(struct extent_buffer *eb)
+{
+	struct apfs_packed_key *table;
+	struct apfs_packed_key *old;
+	u32 nritems;
+
+	table = smp_load_acquire(&eb->key_table);
+	if (table)
+		return table;
+
+	nritems = apfs_header_nritems(eb);
+	if (nritems == 0)
+		return NULL;
+
+	table = kvmalloc_array(nritems, sizeof(*table), GFP_NOFS);
+	if (!table)
+		return NULL;
+
+	/* corrupted node, leave it to the slow path */
+	if (apfs_check_node_toc(eb, table)) {
+		kvfree(table);
+		return NULL;
+	}
+
+	old = cmpxchg(&eb->key_table, NULL, table);
+	if (old) {
+		kvfree(table);
+		return old;
+	}
+	return table;
+}
+
+/*
+ * generic_bin_search() over the packed keys of an fs-tree node. Keys are
+ * only decoded from @eb when the packed parts tie and a name has to be
+ * compared.
+ */
+static int packed_bin_search(struct extent_buffer *eb,
+			     const struct apfs_packed_key *table,
+			     const struct apfs_key *key, int max, int *slot)
+{
+	struct apfs_packed_key target;
+	int low = 0;
+	int high = max;
+	int ret;
+
+	apfs_pack_fs_key(key, eb->fs_info->normalization_insensitive,
+			 &target);
+
+	while (low < high) {
+		int mid;
+
+		mid = (low + high) / 2;
+
+		ret = apfs_comp_packed_keys(&table[mid], &target);
+		if (ret == 0 && apfs_fs_key_has_name(key->type)) {
+			struct apfs_key tmp;
+
+			apfs_item_key_to_cpu(eb, &tmp, mid);
+			ret = apfs_comp_cpu_keys(eb, &tmp, key);
+		}
+
+		if (ret < 0)
+			low = mid + 1;
+		else if (ret > 0)
+			high = mid;
+		else {
+			*slot = mid;
+			return 0;
+		}
+	}
+	*slot = low;
+	return 1;
+}
+
+/*
+ * generic_bin_search() for omap and free queue nodes. Their keys are two
+ * fixed-size little-endian u64 words, (oid, xid) or (xid, paddr), whose
+ * numeric order is the order apfs_comp_normal_keys() gives the decoded keys,
+ * so they are compared in place without building a struct apfs_key.
+ */
+static int fixed_kv_bin_search(struct extent_buffer *eb,
+			       const struct apfs_key *key, int max, int *slot)
+{
+	const void *data = apfs_node_data(eb);
+	const struct apfs_disk_fixed_kv *toc;
+	unsigned long toc_start;
+	u32 key_start = apfs_header_toc_end(eb);
+	u64 hi = ((u64)key->type << APFS_FSKEY_TYPE_SHIFT) | key->id;
+	u64 lo = key->offset;
+	int low = 0;
+	int high = max;
+
+	toc_start = offsetof(struct apfs_disk_node, data) +
+		apfs_header_table_space_offset(eb);
+	if (toc_start + max * sizeof(*toc) > eb->len) {
+		apfs_err(eb->fs_info, "%s: toc of eb %llu beyond node, nritems %d",
+			 __func__, eb->start, max);
+		return -EUCLEAN;
+	}
+	toc = data + toc_start;
+
+	while (low < high) {
+		const __le64 *k;
+		u32 key_off;
+		u64 k_hi;
+		u64 k_lo;
+		int mid;
+
+		mid = (low + high) / 2;
+
+		key_off = key_start + le16_to_cpu(toc[mid].k);
+		if (key_off + APFS_FIXED_KEY_SIZE > eb->len) {
+			apfs_err(eb->fs_info,
+				 "%s: key %d of eb %llu beyond node, offset %u",
+				 __func__, mid, eb->start, key_off);
+			return -EUCLEAN;
+		}
+		k = data + key_off;
+		k_hi = le64_to_cpu(k[0]);
+		k_lo = le64_to_cpu(k[1]);
+
+		if (k_hi < hi || (k_hi == hi && k_lo < lo)) {
+			low = mid + 1;
+		} else if (k_hi > hi || k_lo > lo) {
+			high = mid;
+		} else {
+			*slot = mid;
+			return 0;
+		}
+	}
+	*slot = low;
+	return 1;
+}
+
 /*
  * simple bin_search frontend that does the right thing for
  * leaves vs nodes
@@ -766,7 +964,23 @@ static noinline int generic_bin_search(struct extent_buffer *eb,
 int apfs_bin_search(struct extent_buffer *eb, const struct apfs_key *key,
 		     int *slot)
 {
-	return generic_bin_search(eb, key, apfs_header_nritems(eb), slot);
+	int nritems = apfs_header_nritems(eb);
+
+	/* the in-place compare needs the search key in disk form */
+	if (apfs_is_fixed_kv_node(eb) && key->id <= APFS_FSKEY_ID_MASK &&
+	    key->type <= 0xf)
+		return fixed_kv_bin_search(eb, key, nritems, slot);
+
+	/* oid and type must fit the packed form, see apfs_pack_fs_key() */
+	if (apfs_is_fs_node(eb) && key->oid <= APFS_FSKEY_ID_MASK &&
+	    key->type <= 0xf) {
+		const struct apfs_packed_key *table = apfs_node_key_table(eb);
+
+		if (table)
+			return packed_bin_search(eb, table, key, nritems, slot);
+	}
+
+	return generic_bin_search(eb, key, nritems, slot);
 }
 
 static void root_add_used(struct apfs_root *root, u32 size)
@@ -785,11 +999,14 @@ static void root_sub_used(struct apfs_root *root, u32 size)
 	spin_unlock(&root->accounting_lock);
 }
 
-/* given a node and slot number, this reads the blocks it points to.  The
- * extent buffer is returned with a reference taken (but unlocked).
+/*
+ * given a node and slot number, this reads the blocks it points to as seen by
+ * the mount @fs_info, which decides the xid virtual children are translated
+ * at.  The extent buffer is returned with a reference taken (but unlocked).
  */
-struct extent_buffer *apfs_read_node_slot(struct extent_buffer *parent,
-					   int slot)
+struct extent_buffer *apfs_read_node_child(struct apfs_fs_info *fs_info,
+					    struct extent_buffer *parent,
+					    int slot)
 {
 	int level = apfs_header_level(parent);
 	struct extent_buffer *eb;
@@ -801,7 +1018,8 @@ struct extent_buffer *apfs_read_node_slot(struct extent_buffer *parent,
 	BUG_ON(level == 0);
 
 	apfs_node_key_to_cpu(parent, &first_key, slot);
-	eb = read_tree_block(parent->fs_info, apfs_node_blockptr(parent, slot),
+	eb = read_tree_block(fs_info,
+			     apfs_node_child_bytenr(fs_info, parent, slot),
 			     apfs_header_owner(parent),
 			     apfs_node_ptr_generation(parent, slot),
 			     level - 1, &first_key);
@@ -813,6 +1031,12 @@ struct extent_buffer *apfs_read_node_slot(struct extent_buffer *parent,
 	return eb;
 }
 
+struct extent_buffer *apfs_read_node_slot(struct extent_buffer *parent,
+					   int slot)
+{
+	return apfs_read_node_child(parent->fs_info, parent, slot);
+}
+
 /*
  * node level balancing, used to make sure nodes are in proper order for
  * item deletion.  We balance from the top down, so we have to make sure
@@ -1181,6 +1405,43 @@ static noinline int push_nodes_for_insert(struct apfs_trans_handle *trans,
 	return 1;
 }
 
+/*
+ * Forward readahead below a virtual index node.
+ *
+ * The children of a virtual node are oids, and where the omap placed them on
+ * disk says nothing about their key order, so the distance heuristic below
+ * doesn't apply. @paddrs holds all children already translated through the
+ * omap; start reads for up to @nr_max right siblings of @slot.
+ *
+ * To keep I/O in flight during a scan rather than stalling once per window,
+ * a new window is only issued when the sibling halfway through it isn't
+ * cached yet.
+ */
+static void reada_virtual_siblings(struct apfs_fs_info *fs_info,
+				   struct extent_buffer *node,
+				   const u64 *paddrs, int slot, u32 nr_max)
+{
+	struct extent_buffer *eb;
+	u32 nritems = apfs_header_nritems(node);
+	u32 nr;
+
+	if (slot + 1 >= nritems || nr_max == 0)
+		return;
+
+	nr = min_t(u32, slot + DIV_ROUND_UP(nr_max, 2), nritems - 1);
+	eb = find_extent_buffer(fs_info, paddrs[nr]);
+	if (eb) {
+		free_extent_buffer(eb);
+		return;
+	}
+
+	for (nr = slot + 1; nr < nritems && nr <= slot + nr_max; nr++)
+		apfs_readahead_tree_block(fs_info, paddrs[nr],
+					  apfs_header_owner(node),
+					  apfs_node_ptr_generation(node, nr),
+					  apfs_header_level(node) - 1);
+}
+
 /*
  * readahead one full node of leaves, finding things that are close
  * to the block in 'slot', and triggering ra on them.
@@ -1223,7 +1484,18 @@ static void reada_for_search(struct apfs_fs_info *fs_info,
 		nread_max = SZ_64K;
 	}
 
-	search = apfs_node_blockptr(node, slot);
+	if (path->reada == READA_FORWARD ||
+	    path->reada == READA_FORWARD_ALWAYS) {
+		const u64 *paddrs = apfs_node_child_paddrs(fs_info, node);
+
+		if (paddrs) {
+			reada_virtual_siblings(fs_info, node, paddrs, slot,
+				min_t(u64, nread_max / fs_info->nodesize, 32));
+			return;
+		}
+	}
+
+	search = apfs_node_child_bytenr(fs_info, node, slot);
 	blocksize = fs_info->nodesize;
 	eb = find_extent_buffer(fs_info, search);
 	if (eb) {
@@ -1252,11 +1524,11 @@ static void reada_for_search(struct apfs_fs_info *fs_info,
 			if (apfs_disk_key_objectid(&disk_key) != objectid)
 				break;
 		}
-		search = apfs_node_blockptr(node, nr);
+		search = apfs_node_child_bytenr(fs_info, node, nr);
 		if (path->reada == READA_FORWARD_ALWAYS ||
 		    (search <= target && target - search <= 65536) ||
 		    (search > target && search - target <= 65536)) {
-			apfs_readahead_node_child(node, nr);
+			apfs_readahead_node_child(fs_info, node, nr);
 			nread += blocksize;
 		}
 		nscan++;
@@ -1265,7 +1537,8 @@ static void reada_for_search(struct apfs_fs_info *fs_info,
 	}
 }
 
-static noinline void reada_for_balance(struct apfs_path *path, int level)
+static noinline void reada_for_balance(struct apfs_fs_info *fs_info,
+				       struct apfs_path *path, int level)
 {
 	struct extent_buffer *parent;
 	int slot;
@@ -1279,9 +1552,9 @@ static noinline void reada_for_balance(struct apfs_path *path, int level)
 	slot = path->slots[level + 1];
 
 	if (slot > 0)
-		apfs_readahead_node_child(parent, slot - 1);
+		apfs_readahead_node_child(fs_info, parent, slot - 1);
 	if (slot + 1 < nritems)
-		apfs_readahead_node_child(parent, slot + 1);
+		apfs_readahead_node_child(fs_info, parent, slot + 1);
 }
 
 
@@ -1355,6 +1628,7 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 		      const struct apfs_key *key)
 {
 	struct apfs_fs_info *fs_info = root->fs_info;
+	const u64 *child_paddrs;
 	u64 blocknr;
 	u64 gen;
 	struct extent_buffer *tmp;
@@ -1362,14 +1636,21 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 	int ret;
 	int parent_level;
 
-	blocknr = apfs_node_blockptr(*eb_ret, slot);
+	/* the first descent through a virtual node resolves all its children */
+	child_paddrs = apfs_node_child_paddrs(fs_info, *eb_ret);
+	if (child_paddrs)
+		blocknr = child_paddrs[slot];
+	else
+		blocknr = apfs_node_child_bytenr(fs_info, *eb_ret, slot);
 	gen = apfs_node_ptr_generation(*eb_ret, slot);
 	parent_level = apfs_header_level(*eb_ret);
 	apfs_node_key_to_cpu(*eb_ret, &first_key, slot);
 
 	tmp = find_extent_buffer(fs_info, blocknr);
 	if (tmp) {
-		if (p->reada == READA_FORWARD_ALWAYS)
+		/* virtual siblings slide their readahead window on every hit */
+		if (p->reada == READA_FORWARD_ALWAYS ||
+		    (p->reada == READA_FORWARD && child_paddrs))
 			reada_for_search(fs_info, p, level, slot, key->objectid);
 
 		/* first we do an atomic uptodate check */
@@ -1384,6 +1665,11 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 				free_extent_buffer(tmp);
 				return -EUCLEAN;
 			}
+			/* the -EAGAIN read below already counted this lookup */
+			if (tmp->start == p->reread_bytenr)
+				p->reread_bytenr = 0;
+			else
+				apfs_eb_cache_lookup(tmp, true);
 			*eb_ret = tmp;
 			return 0;
 		}
@@ -1391,6 +1677,10 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 		/* now we're allowed to do a blocking uptodate check */
 		ret = apfs_read_buffer(tmp, gen, parent_level - 1, &first_key);
 		if (!ret) {
+			p->reread_bytenr = 0;
+			apfs_eb_cache_lookup(tmp, false);
+			apfs_stat_inc(fs_info, APFS_STAT_META_READS);
+			apfs_stat_add(fs_info, APFS_STAT_META_READ_BYTES, tmp->len);
 			*eb_ret = tmp;
 			return 0;
 		}
@@ -1411,6 +1701,7 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 	if (p->reada != READA_NONE)
 		reada_for_search(fs_info, p, level, slot, key->objectid);
 
+	/* read_tree_block() counts the lookup, the retry then finds it */
 	ret = -EAGAIN;
 	tmp = read_tree_block(fs_info, blocknr, root->root_key.objectid,
 			      gen, parent_level - 1, &first_key);
@@ -1423,6 +1714,8 @@ read_block_for_search(struct apfs_root *root, struct apfs_path *p,
 		 */
 		if (!extent_buffer_uptodate(tmp))
 			ret = -EIO;
+		else
+			p->reread_bytenr = tmp->start;
 		free_extent_buffer(tmp);
 	} else {
 		ret = PTR_ERR(tmp);
@@ -1459,7 +1752,7 @@ setup_nodes_for_search(struct apfs_trans_handle *trans,
 			return -EAGAIN;
 		}
 
-		reada_for_balance(p, level);
+		reada_for_balance(fs_info, p, level);
 		ret = split_node(trans, root, p, level);
 
 		b = p->nodes[level];
@@ -1472,7 +1765,7 @@ setup_nodes_for_search(struct apfs_trans_handle *trans,
 			return -EAGAIN;
 		}
 
-		reada_for_balance(p, level);
+		reada_for_balance(fs_info, p, level);
 		ret = balance_level(trans, root, p, level);
 		if (ret)
 			return ret;
@@ -1607,6 +1900,81 @@ out:
 }
 
 
+/*
+ * Answer a read-only search from the leaf a cursor path (p->finger) was left
+ * on by the previous search, or from its right sibling under the same parent,
+ * without walking down from the root.
+ *
+ * Returns the apfs_search_slot() result, or -EAGAIN if the key may live
+ * outside those two leaves and a full search is needed.
+ */
+static int apfs_search_finger(struct apfs_root *root,
+			      const struct apfs_key *key, struct apfs_path *p)
+{
+	struct extent_buffer *leaf = p->nodes[0];
+	struct extent_buffer *parent = p->nodes[1];
+	struct extent_buffer *next;
+	struct apfs_key tmp = {};
+	int pslot = p->slots[1];
+	int level;
+	int nritems;
+	int slot;
+	int ret;
+
+	/* the cursor must come from a search of this very tree */
+	for (level = 0; level < APFS_MAX_LEVEL - 1 && p->nodes[level + 1];
+	     level++)
+		;
+	if (p->nodes[level] != root->node)
+		return -EAGAIN;
+
+	nritems = apfs_header_nritems(leaf);
+	if (nritems == 0)
+		return -EAGAIN;
+
+	apfs_item_key_to_cpu(leaf, &tmp, 0);
+	if (apfs_comp_cpu_keys(leaf, &tmp, key) > 0)
+		return -EAGAIN;
+
+	apfs_item_key_to_cpu(leaf, &tmp, nritems - 1);
+	if (apfs_comp_cpu_keys(leaf, &tmp, key) >= 0)
+		goto search;
+
+	/* past the leaf, the parent tells whether the right sibling has it */
+	if (!parent || pslot + 1 >= apfs_header_nritems(parent))
+		return -EAGAIN;
+
+	apfs_node_key_to_cpu(parent, &tmp, pslot + 1);
+	if (apfs_comp_cpu_keys(parent, &tmp, key) > 0) {
+		p->slots[0] = nritems;
+		return 1;
+	}
+
+	/* the last child's upper bound lives above the parent */
+	if (pslot + 2 >= apfs_header_nritems(parent))
+		return -EAGAIN;
+	apfs_node_key_to_cpu(parent, &tmp, pslot + 2);
+	if (apfs_comp_cpu_keys(parent, &tmp, key) <= 0)
+		return -EAGAIN;
+
+	if (p->reada != READA_NONE)
+		reada_for_search(root->fs_info, p, 1, pslot + 1, key->objectid);
+
+	next = apfs_read_node_child(root->fs_info, parent, pslot + 1);
+	if (IS_ERR(next))
+		return PTR_ERR(next);
+
+	free_extent_buffer(leaf);
+	p->nodes[0] = leaf = next;
+	p->slots[1] = pslot + 1;
+search:
+	ret = apfs_bin_search(leaf, key, &slot);
+	if (ret < 0)
+		return ret;
+	p->slots[0] = slot;
+	return ret;
+}
+
 /*
  * apfs_search_slot - look for a key in a tree and perform necessary
  * modifications to preserve tree invariants.
@@ -1656,6 +2024,24 @@ int apfs_search_slot(struct apfs_trans_handle *trans, struct apfs_root *root,
 
 	lowest_level = p->lowest_level;
 	WARN_ON(lowest_level && ins_len > 0);
+
+	apfs_stat_inc(root->fs_info, APFS_STAT_SEARCHES);
+
+	/* nothing can modify the tree, extent buffer refs are enough */
+	if (!cow && apfs_fs_no_trans(root->fs_info))
+		p->skip_locking = 1;
+
+	if (p->finger && p->nodes[0]) {
+		if (!cow && !ins_len && p->skip_locking && !lowest_level) {
+			ret = apfs_search_finger(root, key, p);
+			if (ret != -EAGAIN) {
+				apfs_stat_inc(root->fs_info,
+					      APFS_STAT_NODE_VISITS);
+				return ret;
+			}
+		}
+		apfs_release_path(p);
+	}
 	WARN_ON(p->nodes[0] != NULL);
 	BUG_ON(!cow && ins_len);
 
@@ -1736,6 +2122,7 @@ again:
 		}
 cow_done:
 		p->nodes[level] = b;
+		apfs_stat_inc(root->fs_info, APFS_STAT_NODE_VISITS);
 		/*
 		 * Leave path with blocking locks to avoid massive
 		 * lock context switch, this is made on purpose.
@@ -4222,7 +4609,7 @@ find_next_key:
 			ret = 0;
 			goto out;
 		}
-		cur = apfs_read_node_slot(cur, slot);
+		cur = apfs_read_node_child(root->fs_info, cur, slot);
 		if (IS_ERR(cur)) {
 			ret = PTR_ERR(cur);
 			goto out;
@@ -4571,11 +4958,113 @@ int apfs_previous_extent_item(struct apfs_root *root,
 	return 1;
 }
 
-int
-apfs_find_omap_paddr(struct apfs_root *root, u64 oid, u64 xid, u64 *paddr)
+int apfs_omap_cache_init(struct apfs_omap_cache *cache)
+{
+	int ret;
+
+	spin_lock_init(&cache->lock);
+	cache->slots = kvcalloc(1 << APFS_OMAP_CACHE_BITS,
+				sizeof(*cache->slots), GFP_KERNEL);
+	if (!cache->slots)
+		return -ENOMEM;
+
+	ret = percpu_counter_init(&cache->hits, 0, GFP_KERNEL);
+	if (ret)
+		goto free_slots;
+	ret = percpu_counter_init(&cache->misses, 0, GFP_KERNEL);
+	if (ret)
+		goto free_hits;
+	return 0;
+
+free_hits:
+	percpu_counter_destroy(&cache->hits);
+free_slots:
+	kvfree(cache->slots);
+	cache->slots = NULL;
+	return ret;
+}
+
+/* Caller must make sure there are no more lookups in flight */
+void apfs_omap_cache_free(struct apfs_omap_cache *cache)
+{
+	int i;
+
+	if (!cache->slots)
+		return;
+
+	for (i = 0; i < (1 << APFS_OMAP_CACHE_BITS); i++)
+		kfree(rcu_dereference_protected(cache->slots[i], true));
+	kvfree(cache->slots);
+	cache->slots = NULL;
+	percpu_counter_destroy(&cache->hits);
+	percpu_counter_destroy(&cache->misses);
+}
+
+static inline u32 apfs_omap_cache_hash(u64 omap, u64 oid, u64 xid)
+{
+	return hash_64(oid ^ (xid * GOLDEN_RATIO_64) ^ (omap >> 12),
+		       APFS_OMAP_CACHE_BITS);
+}
+
+static bool apfs_omap_cache_lookup(struct apfs_omap_cache *cache, u64 omap,
+				   u64 oid, u64 xid, u64 *paddr)
+{
+	struct apfs_omap_cache_entry *entry;
+	bool found = false;
+
+	rcu_read_lock();
+	entry = rcu_dereference(cache->slots[apfs_omap_cache_hash(omap, oid,
+								   xid)]);
+	if (entry && entry->omap == omap && entry->oid == oid &&
+	    entry->xid == xid) {
+		*paddr = entry->paddr;
+		found = true;
+	}
+	rcu_read_unlock();
+
+	if (found)
+		percpu_counter_inc(&cache->hits);
+	else
+		percpu_counter_inc(&cache->misses);
+	return found;
+}
+
+static void apfs_omap_cache_insert(struct apfs_omap_cache *cache, u64 omap,
+				   u64 oid, u64 xid, u64 paddr)
+{
+	struct apfs_omap_cache_entry *entry;
+	struct apfs_omap_cache_entry *old;
+	u32 slot = apfs_omap_cache_hash(omap, oid, xid);
+
+	/* The cache is best effort, failing to fill it is fine */
+	entry = kmalloc(sizeof(*entry), GFP_NOFS);
+	if (!entry)
+		return;
+
+	entry->omap = omap;
+	entry->oid = oid;
+	entry->xid = xid;
+	entry->paddr = paddr;
+
+	spin_lock(&cache->lock);
+	old = rcu_dereference_protected(cache->slots[slot],
+					lockdep_is_held(&cache->lock));
+	rcu_assign_pointer(cache->slots[slot], entry);
+	spin_unlock(&cache->lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/*
+ * Search omap tree @root for the newest mapping of @oid not newer than @xid.
+ * On success @path points at the omap item.
+ */
+static int __apfs_find_omap_paddr(struct apfs_root *root,
+				  struct apfs_path *path, u64 oid, u64 xid,
+				  u64 *paddr)
 {
 	struct apfs_key key = {};
-	struct apfs_path *path;
 	struct apfs_omap_item omap_item;
 	u32 offset;
 	int ret;
@@ -4583,28 +5072,51 @@ apfs_find_omap_paddr(struct apfs_root *root, u64 oid, u64 xid, u64 *paddr)
 	key.id = oid;
 	key.offset = xid;
 
-	path = apfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
 	ret = apfs_search_slot(NULL, root, &key, path, 0, 0);
 	if (ret == 0)
 		goto found;
 	if (ret < 0)
-		goto out;
+		return ret;
 
 	ret = apfs_previous_item(root, path, oid, 0);
 	if (ret > 0)
 		ret = -ENOENT;
 	if (ret)
-		goto out;
+		return ret;
 found:
 	offset = apfs_item_offset_nr(path->nodes[0], path->slots[0]);
 	read_extent_buffer(path->nodes[0], &omap_item, offset,
 			   sizeof(omap_item));
 	*paddr = apfs_omap_paddr(&omap_item) << root->fs_info->block_size_bits;
-out:
-	apfs_free_path(path);
+	return 0;
+}
+
+int
+apfs_find_omap_paddr(struct apfs_root *root, u64 oid, u64 xid, u64 *paddr)
+{
+	struct apfs_omap_cache *cache = &root->fs_info->nx_info->omap_cache;
+	APFS_DEFINE_PATH(path);
+	u64 start_ns = 0;
+	int ret;
+
+	if (trace_apfs_omap_lookup_enabled())
+		start_ns = ktime_get_ns();
+
+	apfs_stat_inc(root->fs_info, APFS_STAT_OMAP_LOOKUPS);
+	if (apfs_omap_cache_lookup(cache, root->node->start, oid, xid, paddr)) {
+		apfs_stat_inc(root->fs_info, APFS_STAT_OMAP_HITS);
+		trace_apfs_omap_lookup(root, oid, xid, *paddr, true, 0,
+				       start_ns);
+		return 0;
+	}
+
+	ret = __apfs_find_omap_paddr(root, path, oid, xid, paddr);
+	if (!ret)
+		apfs_omap_cache_insert(cache, root->node->start, oid, xid,
+				       *paddr);
+	apfs_release_path(path);
+	trace_apfs_omap_lookup(root, oid, xid, ret ? 0 : *paddr, false, ret,
+			       start_ns);
 	if (ret)
 		apfs_err(root->fs_info,
 			 "failed to find oid %llu xid %llu in omap root %llu",
@@ -4613,6 +5125,183 @@ out:
 	return ret;
 }
 
+/*
+ * Look up the mapping of @oid at @xid in omap leaf @leaf only.
+ *
+ * Returns 0 and sets @paddr if the leaf decides the translation, -ENOENT if
+ * the leaf proves there is none, and 1 if the answer may live in a
+ * neighbouring leaf.
+ */
+static int omap_leaf_lookup(struct extent_buffer *leaf, u64 oid, u64 xid,
+			    u64 *paddr)
+{
+	struct apfs_key key = {};
+	struct apfs_key found_key = {};
+	struct apfs_omap_item omap_item;
+	u32 nritems = apfs_header_nritems(leaf);
+	int slot;
+	int ret;
+
+	if (nritems == 0)
+		return 1;
+
+	key.id = oid;
+	key.offset = xid;
+	ret = apfs_bin_search(leaf, &key, &slot);
+	if (ret < 0)
+		return ret;
+	if (ret > 0) {
+		if (slot == 0 || slot == nritems)
+			return 1;
+		slot--;
+		apfs_item_key_to_cpu(leaf, &found_key, slot);
+		if (found_key.id != oid)
+			return -ENOENT;
+	}
+
+	read_extent_buffer(leaf, &omap_item, apfs_item_offset_nr(leaf, slot),
+			   sizeof(omap_item));
+	*paddr = apfs_omap_paddr(&omap_item) << leaf->fs_info->block_size_bits;
+	return 0;
+}
+
+struct apfs_child_oid {
+	u64 oid;
+	int slot;
+};
+
+static int apfs_child_oid_cmp(const void *a, const void *b)
+{
+	const struct apfs_child_oid *c1 = a;
+	const struct apfs_child_oid *c2 = b;
+
+	if (c1->oid != c2->oid)
+		return c1->oid < c2->oid ? -1 : 1;
+	return 0;
+}
+
+static const u64 *find_child_paddrs(const struct extent_buffer *eb, u64 xid)
+{
+	struct apfs_child_paddrs *table;
+
+	for (table = smp_load_acquire(&eb->child_paddrs); table;
+	     table = table->next)
+		if (table->xid == xid)
+			return table->paddrs;
+	return NULL;
+}
+
+/*
+ * Translate every child pointer of the virtual index node @eb through the
+ * omap of @fs_info at its xid and attach the result to @eb.
+ *
+ * Children are resolved in oid order, so consecutive lookups mostly land in
+ * the omap leaf the previous one ended on and are answered by a binary search
+ * of that leaf instead of a descent from the omap root. Each child counts as
+ * an omap lookup, and as an omap leaf hit when that leaf answered it.
+ *
+ * @eb may be shared by mounts of several snapshots of the volume, so the
+ * table is looked up and published per xid.
+ *
+ * Returns the table, or NULL if @eb has no virtual children or the table
+ * couldn't be built. Callers then fall back to apfs_node_child_bytenr().
+ */
+const u64 *apfs_node_child_paddrs(struct apfs_fs_info *fs_info,
+				  struct extent_buffer *eb)
+{
+	struct apfs_root *omap_root = fs_info->omap_root;
+	struct apfs_child_oid *children = NULL;
+	struct apfs_child_paddrs *table = NULL;
+	struct apfs_path *path = NULL;
+	struct apfs_obj_header obj;
+	const u64 *paddrs;
+	u64 xid;
+	u32 nritems;
+	int ret;
+	int i;
+
+	if (apfs_header_level(eb) == 0 || !omap_root || !fs_info->__super_copy)
+		return NULL;
+
+	xid = apfs_volume_super_xid(fs_info->__super_copy);
+	paddrs = find_child_paddrs(eb, xid);
+	if (paddrs)
+		return paddrs;
+
+	read_extent_buffer(eb, &obj, 0, sizeof(obj));
+	if (apfs_obj_stg_type(&obj) != APFS_STG_VIRTUAL)
+		return NULL;
+
+	nritems = apfs_header_nritems(eb);
+	if (nritems == 0)
+		return NULL;
+
+	children = kvmalloc_array(nritems, sizeof(*children), GFP_NOFS);
+	table = kvmalloc(struct_size(table, paddrs, nritems), GFP_NOFS);
+	path = apfs_alloc_path();
+	if (!children || !table || !path)
+		goto fail;
+
+	/* readonly mount, nobody modifies the omap under us */
+	path->skip_locking = 1;
+
+	for (i = 0; i < nritems; i++) {
+		__le64 oid;
+
+		read_extent_buffer(eb, &oid, apfs_item_offset_nr(eb, i),
+				   sizeof(oid));
+		children[i].oid = le64_to_cpu(oid);
+		children[i].slot = i;
+	}
+	sort(children, nritems, sizeof(*children), apfs_child_oid_cmp, NULL);
+
+	for (i = 0; i < nritems; i++) {
+		u64 oid = children[i].oid;
+		u64 start_ns = ktime_get_ns();
+		u64 paddr;
+
+		apfs_stat_inc(fs_info, APFS_STAT_OMAP_LOOKUPS);
+		ret = 1;
+		if (path->nodes[0])
+			ret = omap_leaf_lookup(path->nodes[0], oid, xid, &paddr);
+		if (ret > 0) {
+			apfs_release_path(path);
+			ret = __apfs_find_omap_paddr(omap_root, path, oid, xid,
+						     &paddr);
+		} else if (!ret) {
+			apfs_stat_inc(fs_info, APFS_STAT_OMAP_LEAF_HITS);
+		}
+		apfs_lat_record(fs_info, APFS_LAT_OMAP, start_ns);
+		if (ret)
+			goto fail;
+		table->paddrs[children[i].slot] = paddr;
+	}
+
+	apfs_free_path(path);
+	kvfree(children);
+
+	table->xid = xid;
+	for (;;) {
+		struct apfs_child_paddrs *head = READ_ONCE(eb->child_paddrs);
+
+		/* another mount at the same xid may have beaten us to it */
+		paddrs = find_child_paddrs(eb, xid);
+		if (paddrs) {
+			kvfree(table);
+			return paddrs;
+		}
+		table->next = head;
+		if (cmpxchg(&eb->child_paddrs, head, table) == head)
+			return table->paddrs;
+	}
+
+fail:
+	apfs_free_path(path);
+	kvfree(children);
+	kvfree(table);
+	return NULL;
+}
+
 int
 apfs_read_generic(struct block_device *bdev, u64 bytenr, unsigned long len,
 		  void *res)
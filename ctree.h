@@ -33,6 +33,7 @@
 #include "async-thread.h"
 #include "block-rsv.h"
 #include "locking.h"
+#include "fletcher.h"
 
 #include "linux/ftrace.h"
 
@@ -2643,6 +2644,11 @@ enum {
 	APFS_FS_STATE_DEV_REPLACING,
 	/* The apfs_fs_info created for self-tests */
 	APFS_FS_STATE_DUMMY_FS_INFO,
+	/*
+	 * Filesystem can never start a transaction, so read-only tree searches
+	 * run without tree locks
+	 */
+	APFS_FS_STATE_NO_TRANS,
 };
 
 #define APFS_BACKREF_REV_MAX		256
@@ -2898,6 +2904,18 @@ struct apfs_path {
 	 * header (ie. sizeof(struct apfs_item) is not included).
 	 */
 	unsigned int search_for_extension:1;
+	/*
+	 * Cursor mode for readonly searches: the path keeps its nodes between
+	 * searches and the next apfs_search_slot() starts from the last leaf.
+	 * Requires skip_locking.
+	 */
+	unsigned int finger:1;
+
+	/*
+	 * Block read_block_for_search() read and counted as a cache miss before
+	 * returning -EAGAIN, so the retried search doesn't count it as a hit.
+	 */
+	u64 reread_bytenr;
 };
 #define APFS_MAX_EXTENT_ITEM_SIZE(r) ((APFS_LEAF_DATA_SIZE(r->fs_info) >> 4) - \
 					sizeof(struct apfs_item))
@@ -3089,6 +3107,12 @@ enum {
 	/* Indicate whether there are any tree modification log users */
 	APFS_FS_TREE_MOD_LOG_USERS,
 
+	/*
+	 * Fully validate every tree block read, even if it already passed
+	 * once since mount. See apfs_tree_block_verified().
+	 */
+	APFS_FS_VERIFY_ALWAYS,
+
 #if BITS_PER_LONG == 32
 	/* Indicate if we have error/warn message printed on 32bit systems */
 	APFS_FS_32BIT_ERROR,
@@ -3109,6 +3133,126 @@ enum apfs_exclusive_operation {
 	APFS_EXCLOP_SWAP_ACTIVATE,
 };
 
+/*
+ * Container wide cache of omap translations.
+ *
+ * Every volume and snapshot mounted from one container shares it. An entry
+ * maps (omap tree, oid, xid) to the physical bytenr apfs_find_omap_paddr()
+ * resolved. Mounts are readonly so entries never go stale, they are only
+ * replaced when another translation hashes into the same slot.
+ */
+#define APFS_OMAP_CACHE_BITS	12
+
+struct apfs_omap_cache_entry {
+	/* bytenr of the omap tree root the translation came from */
+	u64 omap;
+	u64 oid;
+	u64 xid;
+	u64 paddr;
+	struct rcu_head rcu;
+};
+
+struct apfs_omap_cache {
+	struct apfs_omap_cache_entry __rcu **slots;
+	/* serializes slot replacement, readers only take rcu_read_lock */
+	spinlock_t lock;
+	struct percpu_counter hits;
+	struct percpu_counter misses;
+};
+
+/* One ephemeral oid -> bytenr mapping of the mounted checkpoint */
+struct apfs_ephemeral_map {
+	u64 oid;
+	u64 paddr;
+};
+
+/*
+ * Fs-tree key with its fixed-width part folded into two words, so that
+ * ordering by (hi, lo) matches apfs_comp_fs_keys() up to the name compare.
+ * hi is (oid << 4 | type), lo is (hash << 16 | namelen) of a hashed drec,
+ * 0 for other named keys, or the offset.
+ */
+struct apfs_packed_key {
+	u64 hi;
+	u64 lo;
+};
+
+/*
+ * Children of a virtual index node translated through the omap at @xid.
+ * Mounts of different snapshots share the node but not the translation,
+ * so an extent buffer keeps a list of these, one per xid.
+ */
+struct apfs_child_paddrs {
+	struct apfs_child_paddrs *next;
+	u64 xid;
+	u64 paddrs[];
+};
+
+/* Trees the extent buffer cache keeps statistics for */
+enum apfs_eb_tree {
+	APFS_EB_TREE_OMAP,
+	APFS_EB_TREE_FS,
+	APFS_EB_TREE_EXTENTREF,
+	APFS_EB_TREE_SNAP,
+	APFS_EB_TREE_OTHER,
+	APFS_EB_NR_TREES,
+};
+
+struct apfs_eb_tree_stats {
+	atomic64_t cached_bytes;
+	atomic64_t hits;
+	atomic64_t misses;
+	atomic64_t evictions;
+};
+
+/* Operations timed into the latency histograms of each mount */
+enum apfs_lat_op {
+	APFS_LAT_LOOKUP,
+	APFS_LAT_READDIR,
+	APFS_LAT_READPAGE,
+	APFS_LAT_OMAP,
+	APFS_LAT_DECOMPRESS,
+	APFS_LAT_NR_OPS,
+};
+
+/*
+ * Bucket 0 counts calls that took 0ns, bucket i those in [2^(i-1), 2^i) ns
+ * and the last bucket everything slower.
+ */
+#define APFS_LAT_NR_BUCKETS	32
+
+struct apfs_lat_hist {
+	u64 buckets[APFS_LAT_NR_OPS][APFS_LAT_NR_BUCKETS];
+};
+
+/* Monotonic counters of each mount, see /sys/fs/apfs/<uuid>/stats */
+enum apfs_stat {
+	APFS_STAT_META_READS,
+	APFS_STAT_META_READ_BYTES,
+	APFS_STAT_OMAP_LOOKUPS,
+	APFS_STAT_OMAP_HITS,
+	APFS_STAT_OMAP_LEAF_HITS,
+	APFS_STAT_SEARCHES,
+	APFS_STAT_NODE_VISITS,
+	APFS_STAT_ZLIB_CHUNKS,
+	APFS_STAT_ZLIB_BYTES,
+	APFS_STAT_LZVN_CHUNKS,
+	APFS_STAT_LZVN_BYTES,
+	APFS_STAT_LZFSE_CHUNKS,
+	APFS_STAT_LZFSE_BYTES,
+	APFS_STAT_INLINE_READS,
+	APFS_STAT_EM_HITS,
+	APFS_STAT_CHUNK_CACHE_HITS,
+	APFS_STAT_CHUNK_CACHE_MISSES,
+	APFS_STAT_CHUNK_FILL_PAGES,
+	APFS_STAT_ZERO_COPY_CHUNKS,
+	APFS_NR_STATS,
+};
+
+struct apfs_stats {
+	u64 counters[APFS_NR_STATS];
+};
+
 struct apfs_nx_info {
 	struct apfs_nx_superblock *super_copy;
 	struct apfs_fs_info *vol; //dummy
@@ -3127,6 +3271,16 @@ struct apfs_nx_info {
 	struct super_block *sb;
 	struct apfs_device *device;
 
+	struct apfs_omap_cache omap_cache;
+
+	/* checkpoint mappings sorted by oid, built once at mount */
+	struct apfs_ephemeral_map *eph_map;
+	u32 eph_map_count;
+
+	/* per-volume extent buffer caches, see apfs_get_eb_cache() */
+	struct mutex eb_cache_lock;
+	struct list_head eb_caches;
+
 	refcount_t refs;
 };
 
@@ -3320,6 +3474,7 @@ struct apfs_fs_info {
 	struct apfs_workqueue *flush_workers;
 	struct apfs_workqueue *endio_workers;
 	struct apfs_workqueue *endio_meta_workers;
+	struct apfs_workqueue *decompress_workers;
 	struct apfs_workqueue *endio_raid56_workers;
 	struct apfs_workqueue *rmw_workers;
 	struct apfs_workqueue *endio_meta_write_workers;
@@ -3418,6 +3573,8 @@ struct apfs_fs_info {
 	struct apfs_workqueue *scrub_workers;
 	struct apfs_workqueue *scrub_wr_completion_workers;
 	struct apfs_workqueue *scrub_parity_workers;
+	/* running metadata scrub, see apfs_scrub_metadata() */
+	struct apfs_meta_scrub *meta_scrub;
 
 	struct apfs_discard_ctl discard_ctl;
 
@@ -3568,6 +3725,57 @@ struct apfs_fs_info {
 	u32 block_size_bits;
 
 	bool normalization_insensitive;
+
+	/*
+	 * Extent buffers of this mount live in the per-volume cache shared by
+	 * all mounts of the volume, NULL for the caches themselves.
+	 */
+	struct apfs_fs_info *eb_cache;
+	struct list_head eb_cache_list;
+	refcount_t eb_cache_refs;
+
+	/*
+	 * Tree blocks that passed checksum and tree-checker since mount, so a
+	 * block evicted under memory pressure isn't validated again when read
+	 * back. Each value is a bitmap of APFS_VERIFIED_PER_ENTRY consecutive
+	 * blocks.
+	 */
+	struct xarray verified_blocks;
+	atomic_long_t nr_verified_blocks;
+
+	/*
+	 * Extent buffers in the buffer radix tree, coldest first. The budget
+	 * is the largest metadata_cache_mb= of the mounts sharing the cache,
+	 * 0 for none. See evict_extent_buffers().
+	 */
+	spinlock_t eb_lru_lock;
+	struct list_head eb_lru;
+	unsigned long eb_lru_nr;
+	u64 eb_lru_bytes;
+	u64 eb_cache_limit;
+	struct work_struct eb_evict_work;
+	struct shrinker eb_shrinker;
+	struct apfs_eb_tree_stats eb_stats[APFS_EB_NR_TREES];
+	/* requested by this mount's metadata_cache_mb= option, in bytes */
+	u64 metadata_cache_limit;
+	/* /sys/fs/apfs/<uuid>/metadata_cache */
+	struct kobject *metadata_cache_kobj;
+
+	/* per-cpu, summed by /sys/fs/apfs/<uuid>/latency */
+	struct apfs_lat_hist __percpu *lat_hist;
+	struct kobject *latency_kobj;
+	/* per-cpu, summed by /sys/fs/apfs/<uuid>/stats */
+	struct apfs_stats __percpu *stats;
+
+	/* /sys/fs/apfs/<uuid>, see apfs_sysfs_add_volume() */
+	struct kobject vol_kobj;
+	struct completion vol_kobj_unregister;
+
+	/* levels to read at mount, set by the warm= option */
+	u32 warm_levels;
+	/* blocks the warm-up put in the cache and how long it took */
+	u64 warm_blocks;
+	u64 warm_usecs;
 };
 
 static inline struct apfs_fs_info *apfs_sb(struct super_block *sb)
@@ -3585,6 +3793,37 @@ static inline struct apfs_nx_info *APFS_NX(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+/* The fs_info owning the extent buffers read on behalf of @fs_info */
+static inline struct apfs_fs_info *apfs_eb_owner(struct apfs_fs_info *fs_info)
+{
+	return fs_info->eb_cache ? fs_info->eb_cache : fs_info;
+}
+
+/* Account an @op of @fs_info that started at @start_ns, see apfs_lat_hist */
+static inline void apfs_lat_record(struct apfs_fs_info *fs_info,
+				   enum apfs_lat_op op, u64 start_ns)
+{
+	u64 delta = ktime_get_ns() - start_ns;
+	unsigned int bucket = min_t(unsigned int, fls64(delta),
+				    APFS_LAT_NR_BUCKETS - 1);
+
+	if (fs_info->lat_hist)
+		this_cpu_inc(fs_info->lat_hist->buckets[op][bucket]);
+}
+
+static inline void apfs_stat_add(struct apfs_fs_info *fs_info,
+				 enum apfs_stat stat, u64 val)
+{
+	if (fs_info->stats)
+		this_cpu_add(fs_info->stats->counters[stat], val);
+}
+
+static inline void apfs_stat_inc(struct apfs_fs_info *fs_info,
+				 enum apfs_stat stat)
+{
+	apfs_stat_add(fs_info, stat, 1);
+}
+
 /*
  * The state of apfs root
  */
@@ -3900,6 +4139,9 @@ struct apfs_drop_extents_args {
 
 struct apfs_file_private {
 	void *filldir_buf;
+	/* readdir cursor, positioned at the entry of offset readdir_pos */
+	struct apfs_path *readdir_path;
+	loff_t readdir_pos;
 };
 
 
@@ -4573,6 +4815,7 @@ apfs_header_free_vallist_len(const struct extent_buffer *eb)
 }
 
 static inline u16 apfs_header_toc_end(const struct extent_buffer *eb);
+static inline u32 apfs_header_subtype(const struct extent_buffer *eb);
 static inline bool
 apfs_is_root_node(const struct extent_buffer *eb)
 {
@@ -4585,8 +4828,12 @@ apfs_is_leaf_node(const struct extent_buffer *eb)
 	return apfs_disk_node_flags(eb, 0) & APFS_NODE_LEAF;
 }
 
+/*
+ * Decode the toc entry @nr of @eb into the offsets and lengths of its key and
+ * value in the node. Nothing is checked here, see apfs_check_node_toc().
+ */
 static inline void
-apfs_item_kv_loc(const struct extent_buffer *eb, int nr, struct apfs_kv *res)
+__apfs_item_kv_loc(const struct extent_buffer *eb, int nr, struct apfs_kv *res)
 {
 
 	unsigned int offset;
@@ -4615,8 +4862,11 @@ apfs_item_kv_loc(const struct extent_buffer *eb, int nr, struct apfs_kv *res)
 
 		if (!apfs_is_leaf_node(eb))
 			res->v.len = APFS_FIXED_VAL_SIZE;
+		else if (apfs_header_subtype(eb) ==
+			 APFS_OBJ_TYPE_SPACEMAN_FREE_QUEUE)
+			/* the length of the free extent */
+			res->v.len = sizeof(__le64);
 		else
-			/* for now, it's only omap nodes */
 			res->v.len = sizeof(struct apfs_omap_item);
 
 		res->k.len = APFS_FIXED_KEY_SIZE;
@@ -4634,7 +4884,20 @@ apfs_item_kv_loc(const struct extent_buffer *eb, int nr, struct apfs_kv *res)
 	 */
 	if (apfs_is_root_node(eb))
 		value_end = eb->len - sizeof(struct apfs_root_info);
+
+	/* a ghost has no value at all, point it at the end of the area */
+	if (res->v.off == APFS_BTOFF_INVALID) {
+		res->v.off = value_end;
+		res->v.len = 0;
+		return;
+	}
 	res->v.off = value_end - res->v.off;
+}
+
+static inline void
+apfs_item_kv_loc(const struct extent_buffer *eb, int nr, struct apfs_kv *res)
+{
+	__apfs_item_kv_loc(eb, nr, res);
 
 	BUG_ON(res->k.off > eb->len);
 	BUG_ON(res->v.off > eb->len);
@@ -4786,6 +5049,16 @@ apfs_is_fs_node(const struct extent_buffer *eb)
 		apfs_header_subtype(eb) == APFS_OBJ_TYPE_SNAPTREE;
 }
 
+/* Omap and free queue nodes, whose keys are two fixed-size u64 words */
+static inline bool apfs_is_fixed_kv_node(const struct extent_buffer *eb)
+{
+	u32 subtype = apfs_header_subtype(eb);
+
+	return apfs_fixed_kv_size(eb) &&
+		(subtype == APFS_OBJ_TYPE_OMAP ||
+		 subtype == APFS_OBJ_TYPE_SPACEMAN_FREE_QUEUE);
+}
+
 /* struct apfs_disk_key */
 APFS_SETGET_STACK_FUNCS(disk_key_objectid, struct apfs_disk_key, objectid, 64);
 APFS_SETGET_STACK_FUNCS(disk_key_offset, struct apfs_disk_key, offset, 64);
@@ -5140,6 +5413,35 @@ static inline void apfs_disk_key_to_cpu(const struct extent_buffer *eb,
 	__apfs_disk_key_to_cpu(eb, disk, cpu, false);
 }
 
+static inline bool apfs_fs_key_has_name(u8 type)
+{
+	return type == APFS_TYPE_DIR_REC || type == APFS_TYPE_XATTR ||
+		type == APFS_TYPE_SNAP_NAME;
+}
+
+static inline void apfs_pack_fs_key(const struct apfs_key *key, bool hashed,
+				    struct apfs_packed_key *packed)
+{
+	packed->hi = (key->oid << 4) | key->type;
+
+	if (key->type == APFS_TYPE_DIR_REC && hashed)
+		packed->lo = ((u64)key->hash << 16) | key->namelen;
+	else if (apfs_fs_key_has_name(key->type))
+		packed->lo = 0;
+	else
+		packed->lo = key->offset;
+}
+
+static inline int apfs_comp_packed_keys(const struct apfs_packed_key *k1,
+					const struct apfs_packed_key *k2)
+{
+	if (k1->hi != k2->hi)
+		return k1->hi < k2->hi ? -1 : 1;
+	if (k1->lo != k2->lo)
+		return k1->lo < k2->lo ? -1 : 1;
+	return 0;
+}
+
 static inline void apfs_cpu_key_to_disk(const struct extent_buffer *eb,
 					struct apfs_disk_key *disk,
 					const struct apfs_key *cpu)
@@ -5911,6 +6213,9 @@ int apfs_find_next_key(struct apfs_root *root, struct apfs_path *path,
 int apfs_search_forward(struct apfs_root *root, struct apfs_key *min_key,
 			 struct apfs_path *path,
 			 u64 min_trans);
+struct extent_buffer *apfs_read_node_child(struct apfs_fs_info *fs_info,
+					    struct extent_buffer *parent,
+					    int slot);
 struct extent_buffer *apfs_read_node_slot(struct extent_buffer *parent,
 					   int slot);
 
@@ -5954,6 +6259,15 @@ int apfs_realloc_node(struct apfs_trans_handle *trans,
 void apfs_release_path(struct apfs_path *p);
 struct apfs_path *apfs_alloc_path(void);
 void apfs_free_path(struct apfs_path *p);
+void apfs_path_pool_drain(void);
+
+/*
+ * Declare a zeroed path on the stack for short lookups. Drop it with
+ * apfs_release_path(), never apfs_free_path().
+ */
+#define APFS_DEFINE_PATH(name)						\
+	struct apfs_path __##name##_stack = {};				\
+	struct apfs_path *name = &__##name##_stack
 
 int apfs_del_items(struct apfs_trans_handle *trans, struct apfs_root *root,
 		   struct apfs_path *path, int slot, int nr);
@@ -6034,6 +6348,11 @@ static inline int apfs_need_cleaner_sleep(struct apfs_fs_info *fs_info)
 		apfs_fs_closing(fs_info);
 }
 
+static inline bool apfs_fs_no_trans(const struct apfs_fs_info *fs_info)
+{
+	return test_bit(APFS_FS_STATE_NO_TRANS, &fs_info->fs_state);
+}
+
 static inline void apfs_set_sb_rdonly(struct super_block *sb)
 {
 	sb->s_flags |= SB_RDONLY;
@@ -6540,6 +6859,12 @@ int apfs_scrub_cancel(struct apfs_fs_info *info);
 int apfs_scrub_cancel_dev(struct apfs_device *dev);
 int apfs_scrub_progress(struct apfs_fs_info *fs_info, u64 devid,
 			 struct apfs_scrub_progress *progress);
+
+/* apfs_scrub.c */
+int apfs_scrub_metadata(struct apfs_fs_info *fs_info, u64 start, u64 end,
+			struct apfs_scrub_progress *progress);
+int apfs_scrub_metadata_progress(struct apfs_fs_info *fs_info,
+				 struct apfs_scrub_progress *progress);
 static inline void apfs_init_full_stripe_locks_tree(
 			struct apfs_full_stripe_locks_tree *locks_root)
 {
@@ -6619,33 +6944,6 @@ static inline bool apfs_is_zoned(const struct apfs_fs_info *fs_info)
 #define SetPageOrdered(page)		SetPagePrivate2(page)
 #define ClearPageOrdered(page)		ClearPagePrivate2(page)
 
-/*
- * Note that this is not a generic implementation of fletcher64, as it assumes
- * a message length that doesn't overflow sum1 and sum2.  This constraint is ok
- * for apfs, though, since the block size is limited to 2^16.  For a more
- * generic optimized implementation, see Nakassis (1988).
- */
-static u64 apfs_fletcher64(const void *addr, size_t len)
-{
-	const __le32 *buff = addr;
-	u64 sum1 = 0;
-	u64 sum2 = 0;
-	u64 c1, c2;
-	int i;
-
-	for (i = 0; i < len / sizeof(u32); i++) {
-		sum1 += le32_to_cpu(buff[i]);
-		sum2 += sum1;
-	}
-
-	c1 = sum1 + sum2;
-	c1 = 0xFFFFFFFF - c1 % (u64)0xFFFFFFFF;
-	c2 = sum1 + c1;
-	c2 = 0xFFFFFFFF - c2 % (u64)0xFFFFFFFF;
-
-	return (c2 << 32) | c1;
-}
-
 static inline u64
 apfs_generate_csum(const void *addr, size_t len)
 {
@@ -6847,6 +7145,10 @@ apfs_compressed_extent_item_to_extent_map(struct apfs_inode *inode,
 				     const struct apfs_path *path,
 				     struct page *page,
 				     u64 start, u64 len);
+struct extent_map *apfs_chunk_to_extent_map(struct apfs_inode *inode,
+					    const struct apfs_path *path,
+					    u64 start);
+void apfs_free_chunk_index(struct apfs_inode *inode);
 
 bool apfs_inode_data_in_dstream(struct apfs_inode *inode);
 
@@ -117,18 +117,16 @@ struct apfs_drec_item *apfs_lookup_dir_rec(struct apfs_trans_handle *trans,
 	struct apfs_key key = {};
 	int ins_len = mod < 0 ? -1 : 0;
 	int cow = mod != 0;
-	char *kname = NULL;
+	u64 start_ns = 0;
+
+	if (trace_apfs_lookup_dir_rec_enabled())
+		start_ns = ktime_get_ns();
 
 	key.oid = dir;
 	key.type = APFS_TYPE_DIR_REC;
+	/* namelen counts the NUL the caller's name may lack, see apfs_comp_names() */
 	key.namelen = name_len + 1;
-
-	kname = kmalloc(name_len + 1, GFP_NOFS);
-	if (kname == NULL)
-		return ERR_PTR(-ENOMEM);
-	memcpy(kname, name, name_len);
-	kname[name_len] = 0;
-	key.name = kname;
+	key.name = name;
 
 	if (root->fs_info->normalization_insensitive) {
 		key.hash = apfs_name_hash(name, name_len,
@@ -137,16 +135,9 @@ struct apfs_drec_item *apfs_lookup_dir_rec(struct apfs_trans_handle *trans,
 		WARN_ON(1);// TODO...
 	}
 
-	trace_printk("apfs lookup dir namelen hash %u %d %.*s in dir %llu\n",
-		     key.hash, name_len, name_len, name, dir);
 	apfs_release_path(path);
 	ret = apfs_search_slot(trans, root, &key, path, ins_len, cow);
-
-	kfree(kname);
-	key.name = NULL;
-
-	trace_printk("apfs lookup dir done ret %d start %llu slots %d\n", ret,
-	       path->nodes[0]->start, path->slots[0]);
+	trace_apfs_lookup_dir_rec(root, &key, path, ret, start_ns);
 	if (ret < 0)
 		return ERR_PTR(ret);
 	if (ret > 0)
@@ -318,6 +309,7 @@ struct apfs_xattr_item *apfs_lookup_xattr_item(struct apfs_trans_handle *trans,
 	key.oid = dir;
 	key.type = APFS_TYPE_XATTR;
 	key.name = name;
+	key.namelen = strlen(name) + 1;
 
 	ret = apfs_search_slot(trans, root, &key, path, ins_len, cow);
 	if (ret < 0)
@@ -399,9 +391,6 @@ struct apfs_drec_item *apfs_match_dir_rec_name(struct apfs_fs_info *fs_info,
 		apfs_item_key_to_cpu(leaf, &key, slot);
 		if (key.oid != oid || key.type != APFS_TYPE_DIR_REC)
 			goto out;
-		trace_printk("key namelen %d name %.*s arg namelen %d name %.*s\n",
-			key.namelen, key.namelen, key.name,
-			name_len, name_len, name);
 		if (key.namelen - 1 != name_len) {
 			path->slots[0]++;
 			continue;
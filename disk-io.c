@@ -17,6 +17,8 @@
 #include <linux/error-injection.h>
 #include <linux/crc32c.h>
 #include <linux/sched/mm.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
 #include <asm/unaligned.h>
 #include <crypto/hash.h>
 #include "ctree.h"
@@ -404,7 +406,7 @@ static int csum_one_extent_buffer(struct extent_buffer *eb)
 		ret = apfs_check_leaf_full(eb);
 
 	if (ret < 0) {
-		apfs_print_tree(eb, 0);
+		apfs_print_tree(fs_info, eb, 0);
 		apfs_err(fs_info,
 			"block=%llu write time tree block corruption detected",
 			eb->start);
@@ -498,6 +500,66 @@ static int check_tree_block_fsid(struct extent_buffer *eb)
 	return 0;
 }
 
+/* xarray values hold BITS_PER_LONG - 1 bits */
+#define APFS_VERIFIED_PER_ENTRY		(BITS_PER_LONG - 1)
+
+/*
+ * Volumes are mounted readonly, so a tree block that was fully validated
+ * once can't change on disk until unmount.  Remember it by physical block
+ * number and skip checksum and tree-checker when it is read again.
+ */
+static bool apfs_tree_block_verified(struct apfs_fs_info *fs_info, u64 bytenr)
+{
+	u64 blocknr = bytenr >> fs_info->sectorsize_bits;
+	unsigned long index;
+	u32 bit;
+	void *entry;
+
+	if (!apfs_fs_no_trans(fs_info) ||
+	    test_bit(APFS_FS_VERIFY_ALWAYS, &fs_info->flags))
+		return false;
+
+	index = div_u64_rem(blocknr, APFS_VERIFIED_PER_ENTRY, &bit);
+	entry = xa_load(&fs_info->verified_blocks, index);
+	return xa_is_value(entry) && (xa_to_value(entry) & BIT(bit));
+}
+
+static void apfs_set_tree_block_verified(struct apfs_fs_info *fs_info,
+					 u64 bytenr)
+{
+	u64 blocknr = bytenr >> fs_info->sectorsize_bits;
+	unsigned long index;
+	unsigned long bits;
+	unsigned long flags;
+	u32 bit;
+	void *entry;
+
+	if (!apfs_fs_no_trans(fs_info) ||
+	    test_bit(APFS_FS_VERIFY_ALWAYS, &fs_info->flags))
+		return;
+
+	index = div_u64_rem(blocknr, APFS_VERIFIED_PER_ENTRY, &bit);
+	xa_lock_irqsave(&fs_info->verified_blocks, flags);
+	entry = xa_load(&fs_info->verified_blocks, index);
+	bits = xa_is_value(entry) ? xa_to_value(entry) : 0;
+	/* failing to remember a block only costs a later re-validation */
+	if (!(bits & BIT(bit)) &&
+	    !xa_is_err(__xa_store(&fs_info->verified_blocks, index,
+				  xa_mk_value(bits | BIT(bit)), GFP_ATOMIC)))
+		atomic_long_inc(&fs_info->nr_verified_blocks);
+	xa_unlock_irqrestore(&fs_info->verified_blocks, flags);
+}
+
+/*
+ * Forget every verified block, the next read of each block is validated in
+ * full again.
+ */
+void apfs_clear_verified_blocks(struct apfs_fs_info *fs_info)
+{
+	xa_destroy(&fs_info->verified_blocks);
+	atomic_long_set(&fs_info->nr_verified_blocks, 0);
+}
+
 /* Do basic extent buffer checks at read time */
 static int validate_extent_buffer(struct extent_buffer *eb)
 {
@@ -516,6 +578,11 @@ static int validate_extent_buffer(struct extent_buffer *eb)
 		goto out;
 	}
 
+	if (apfs_tree_block_verified(fs_info, eb->start)) {
+		set_extent_buffer_uptodate(eb);
+		apfs_eb_cache_account(eb);
+		goto out;
+	}
 
 	csum_tree_block(eb, result);
 	header_csum = page_address(eb->pages[0]) +
@@ -545,12 +612,15 @@ static int validate_extent_buffer(struct extent_buffer *eb)
 	if (found_level > 0 && apfs_check_node(eb))
 		ret = -EIO;
 
-	if (!ret)
+	if (!ret) {
 		set_extent_buffer_uptodate(eb);
-	else
+		apfs_set_tree_block_verified(fs_info, eb->start);
+		apfs_eb_cache_account(eb);
+	} else {
 		apfs_err(fs_info,
 			  "block=%llu read time tree block corruption detected",
 			  eb->start);
+	}
 out:
 	return ret;
 }
@@ -679,6 +749,8 @@ static void end_workqueue_bio(struct bio *bio)
 	} else {
 		if (end_io_wq->metadata == APFS_WQ_ENDIO_RAID56)
 			wq = fs_info->endio_raid56_workers;
+		else if (end_io_wq->metadata == APFS_WQ_ENDIO_DECOMPRESS)
+			wq = fs_info->decompress_workers;
 		else if (end_io_wq->metadata)
 			wq = fs_info->endio_meta_workers;
 		else
@@ -1031,6 +1103,7 @@ struct extent_buffer *read_tree_block(struct apfs_fs_info *fs_info, u64 bytenr,
 				      int level, struct apfs_key *first_key)
 {
 	struct extent_buffer *buf = NULL;
+	bool cached;
 	int ret;
 
 	buf = apfs_find_create_tree_block(fs_info, bytenr, owner_root, level);
@@ -1040,6 +1113,7 @@ struct extent_buffer *read_tree_block(struct apfs_fs_info *fs_info, u64 bytenr,
 		return buf;
 	}
 
+	cached = extent_buffer_uptodate(buf);
 	ret = btree_read_extent_buffer_pages(buf, parent_transid,
 					     level, first_key);
 	if (ret) {
@@ -1048,6 +1122,11 @@ struct extent_buffer *read_tree_block(struct apfs_fs_info *fs_info, u64 bytenr,
 		free_extent_buffer_stale(buf);
 		return ERR_PTR(ret);
 	}
+	apfs_eb_cache_lookup(buf, cached);
+	if (!cached) {
+		apfs_stat_inc(fs_info, APFS_STAT_META_READS);
+		apfs_stat_add(fs_info, APFS_STAT_META_READ_BYTES, buf->len);
+	}
 	return buf;
 
 }
@@ -1580,13 +1659,17 @@ __apfs_free_fs_info(struct apfs_fs_info *fs_info, bool dummy, bool free_self)
 	if (fs_info == NULL)
 		return ;
 
+	apfs_chunk_cache_drop_fs(fs_info);
 	percpu_counter_destroy(&fs_info->dirty_metadata_bytes);
 	percpu_counter_destroy(&fs_info->delalloc_bytes);
 	percpu_counter_destroy(&fs_info->ordered_bytes);
 	percpu_counter_destroy(&fs_info->dev_replace.bio_counter);
+	free_percpu(fs_info->lat_hist);
+	free_percpu(fs_info->stats);
 	apfs_free_csum_hash(fs_info);
 	apfs_free_stripe_hash_table(fs_info);
 	apfs_free_ref_cache(fs_info);
+	xa_destroy(&fs_info->verified_blocks);
 	kfree(fs_info->balance_ctl);
 	kfree(fs_info->delayed_root);
 	apfs_put_root(fs_info->extent_root);
@@ -1641,6 +1724,8 @@ void apfs_free_nx_info(struct apfs_nx_info *nx_info)
 
 	apfs_close_device(nx_info->device);
 
+	apfs_omap_cache_free(&nx_info->omap_cache);
+	kvfree(nx_info->eph_map);
 	kfree(nx_info->super_copy);
 
 	kvfree(nx_info);
@@ -2137,6 +2222,8 @@ static void apfs_stop_all_workers(struct apfs_fs_info *fs_info)
 	apfs_destroy_workqueue(fs_info->fixup_workers);
 	apfs_destroy_workqueue(fs_info->delalloc_workers);
 	apfs_destroy_workqueue(fs_info->workers);
+	/* completes the original bios through endio_workers */
+	apfs_destroy_workqueue(fs_info->decompress_workers);
 	apfs_destroy_workqueue(fs_info->endio_workers);
 	apfs_destroy_workqueue(fs_info->endio_raid56_workers);
 	apfs_destroy_workqueue(fs_info->rmw_workers);
@@ -2338,6 +2425,13 @@ static int apfs_init_workqueues(struct apfs_fs_info *fs_info)
 	fs_info->endio_meta_workers =
 		apfs_alloc_workqueue(fs_info, "endio-meta", flags,
 				      max_active, 4);
+	/*
+	 * Compressed reads complete here, one work per chunk.  Decompression
+	 * is cpu bound, so let every cpu take a chunk of a large readahead.
+	 */
+	fs_info->decompress_workers =
+		apfs_alloc_workqueue(fs_info, "decompress", flags,
+				      num_online_cpus(), 4);
 	fs_info->endio_meta_write_workers =
 		apfs_alloc_workqueue(fs_info, "endio-meta-write", flags,
 				      max_active, 2);
@@ -2366,6 +2460,7 @@ static int apfs_init_workqueues(struct apfs_fs_info *fs_info)
 	if (!(fs_info->workers && fs_info->delalloc_workers &&
 	      fs_info->flush_workers &&
 	      fs_info->endio_workers && fs_info->endio_meta_workers &&
+	      fs_info->decompress_workers &&
 	      fs_info->endio_meta_write_workers &&
 	      fs_info->endio_write_workers && fs_info->endio_raid56_workers &&
 	      fs_info->endio_freespace_worker && fs_info->rmw_workers &&
@@ -2861,16 +2956,23 @@ static int __cold init_tree_roots(struct apfs_fs_info *fs_info)
 	return ret;
 }
 
-void apfs_init_nx_info(struct apfs_nx_info *nx_info)
+int apfs_init_nx_info(struct apfs_nx_info *nx_info)
 {
 	spin_lock_init(&nx_info->vol_lock);
+	mutex_init(&nx_info->eb_cache_lock);
+	INIT_LIST_HEAD(&nx_info->eb_caches);
 	refcount_set(&nx_info->refs, 1);
+
+	return apfs_omap_cache_init(&nx_info->omap_cache);
 }
 
 void apfs_init_fs_info(struct apfs_fs_info *fs_info)
 {
 	INIT_RADIX_TREE(&fs_info->fs_roots_radix, GFP_ATOMIC);
 	INIT_RADIX_TREE(&fs_info->buffer_radix, GFP_ATOMIC);
+	xa_init_flags(&fs_info->verified_blocks, XA_FLAGS_LOCK_IRQ);
+	spin_lock_init(&fs_info->eb_lru_lock);
+	INIT_LIST_HEAD(&fs_info->eb_lru);
 	INIT_LIST_HEAD(&fs_info->trans_list);
 	INIT_LIST_HEAD(&fs_info->dead_roots);
 	INIT_LIST_HEAD(&fs_info->delayed_iputs);
@@ -3029,6 +3131,11 @@ static int init_mount_fs_info(struct apfs_fs_info *fs_info,
 	if (ret)
 		return ret;
 
+	fs_info->lat_hist = alloc_percpu(struct apfs_lat_hist);
+	fs_info->stats = alloc_percpu(struct apfs_stats);
+	if (!fs_info->lat_hist || !fs_info->stats)
+		return -ENOMEM;
+
 	fs_info->delayed_root = kmalloc(sizeof(struct apfs_delayed_root),
 					GFP_KERNEL);
 	if (!fs_info->delayed_root)
@@ -3280,6 +3387,7 @@ static noinline int __cold apfs_setup_dummy_fs_info(struct super_block *sb,
 
 	fs_info = nx_info->vol;
 	apfs_init_fs_info(fs_info);
+	set_bit(APFS_FS_STATE_NO_TRANS, &fs_info->fs_state);
 
 	ret = init_mount_fs_info(fs_info, nx_info, nx_info->sb);
 	if (ret) {
@@ -3328,6 +3436,117 @@ fail:
 	return ret;
 }
 
+static void __cold __close_ctree(struct apfs_fs_info *fs_info);
+
+/*
+ * Attach @fs_info to the extent buffer cache shared by all mounts of its
+ * volume, live or xid= snapshots, creating the cache on the first mount.
+ *
+ * Like nx_info->vol, the cache is a dummy fs_info owned by the container. It
+ * holds the btree inode and buffer radix, plus a copy of the volume super
+ * and the omap root so that extent buffers stay usable after the mount that
+ * read them is gone. Roots, searches and the xid dependent translation of
+ * virtual children stay with each mount.
+ */
+static int apfs_get_eb_cache(struct apfs_fs_info *fs_info)
+{
+	struct apfs_nx_info *nx_info = fs_info->nx_info;
+	struct apfs_fs_info *cache;
+	int ret = 0;
+
+	mutex_lock(&nx_info->eb_cache_lock);
+	list_for_each_entry(cache, &nx_info->eb_caches, eb_cache_list) {
+		if (cache->index == fs_info->index) {
+			refcount_inc(&cache->eb_cache_refs);
+			goto out;
+		}
+	}
+
+	cache = kvzalloc(sizeof(struct apfs_fs_info), GFP_KERNEL);
+	if (!cache) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+	apfs_init_fs_info(cache);
+	set_bit(APFS_FS_STATE_NO_TRANS, &cache->fs_state);
+	cache->index = fs_info->index;
+	cache->normalization_insensitive = fs_info->normalization_insensitive;
+	cache->__super_copy = kmemdup(fs_info->__super_copy,
+				      sizeof(struct apfs_vol_superblock),
+				      GFP_KERNEL);
+	if (!cache->__super_copy) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = init_mount_fs_info(cache, nx_info, nx_info->sb);
+	if (ret)
+		goto fail;
+
+	cache->omap_root = apfs_alloc_root(cache, APFS_OBJ_TYPE_OMAP,
+					   GFP_KERNEL);
+	if (!cache->omap_root) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	cache->btree_inode = new_inode(nx_info->sb);
+	if (!cache->btree_inode) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	mapping_set_gfp_mask(cache->btree_inode->i_mapping, GFP_NOFS);
+	apfs_init_btree_inode(cache);
+
+	ret = apfs_setup_omap_root(cache);
+	if (ret)
+		goto fail;
+
+	ret = apfs_eb_cache_init(cache);
+	if (ret)
+		goto fail;
+
+	refcount_set(&cache->eb_cache_refs, 1);
+	list_add(&cache->eb_cache_list, &nx_info->eb_caches);
+out:
+	/* the largest budget of the mounts sharing the cache applies */
+	if (fs_info->metadata_cache_limit > cache->eb_cache_limit)
+		WRITE_ONCE(cache->eb_cache_limit,
+			   fs_info->metadata_cache_limit);
+	fs_info->eb_cache = cache;
+out_unlock:
+	mutex_unlock(&nx_info->eb_cache_lock);
+	return ret;
+
+fail:
+	mutex_unlock(&nx_info->eb_cache_lock);
+	__close_ctree(cache);
+	apfs_free_dummy_fs_info(cache);
+	return ret;
+}
+
+static void apfs_put_eb_cache(struct apfs_fs_info *fs_info)
+{
+	struct apfs_fs_info *cache = fs_info->eb_cache;
+	struct apfs_nx_info *nx_info = fs_info->nx_info;
+
+	if (!cache)
+		return;
+
+	fs_info->eb_cache = NULL;
+	mutex_lock(&nx_info->eb_cache_lock);
+	if (!refcount_dec_and_test(&cache->eb_cache_refs)) {
+		mutex_unlock(&nx_info->eb_cache_lock);
+		return;
+	}
+	list_del(&cache->eb_cache_list);
+	mutex_unlock(&nx_info->eb_cache_lock);
+
+	apfs_eb_cache_exit(cache);
+	__close_ctree(cache);
+	apfs_free_dummy_fs_info(cache);
+}
+
 struct apfs_vol_superblock *
 apfs_read_volume_super(struct apfs_nx_info *nx_info, int index);
 
@@ -3433,27 +3652,29 @@ int __cold open_ctree(struct super_block *sb, struct apfs_device *device,
 		goto open_fs_info;
 
 	nx_info = kvzalloc(sizeof(*nx_info), GFP_KERNEL);
+	if (!nx_info) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 	nx_info->super_copy = kzalloc(sizeof(struct apfs_nx_superblock),
 				      GFP_KERNEL);
-	if (!nx_info || !nx_info->super_copy) {
+	if (!nx_info->super_copy) {
 		ret = -ENOMEM;
-		kvfree(nx_info);
-		kfree(nx_info->super_copy);
-		goto fail;
+		goto fail_free_nx_info;
 	}
 
 	nx_info->device = device;
 	device->nx_info = nx_info;
 
-	apfs_init_nx_info(nx_info);
+	ret = apfs_init_nx_info(nx_info);
+	if (ret)
+		goto fail_free_nx_info;
 
 	invalidate_bdev(device->bdev);
 	disk_nx_super = apfs_read_nx_super(device->bdev);
-	if (IS_ERR(disk_super)) {
+	if (IS_ERR(disk_nx_super)) {
 		ret = PTR_ERR(disk_nx_super);
-		kvfree(nx_info);
-		kfree(nx_info->super_copy);
-		goto fail;
+		goto fail_free_omap_cache;
 	}
 
 	memcpy(nx_info->super_copy, disk_nx_super, sizeof(*nx_info->super_copy));
@@ -3464,12 +3685,13 @@ int __cold open_ctree(struct super_block *sb, struct apfs_device *device,
 	nx_info->block_size_bits = blksize_bits(nx_info->block_size);
 	nx_info->generation = apfs_nx_super_xid(nx_info->super_copy);
 
+	ret = apfs_build_ephemeral_index(nx_info);
+	if (ret)
+		goto fail_free_omap_cache;
+
 	ret = apfs_setup_dummy_fs_info(sb, nx_info);
-	if (ret) {
-		kvfree(nx_info);
-		kfree(nx_info->super_copy);
-		goto fail;
-	}
+	if (ret)
+		goto fail_free_omap_cache;
 
 open_fs_info:
 	nx_info = device->nx_info;
@@ -3529,6 +3751,10 @@ open_fs_info:
 	mapping_set_gfp_mask(fs_info->btree_inode->i_mapping, GFP_NOFS);
 	apfs_init_btree_inode(fs_info);
 
+	ret = apfs_get_eb_cache(fs_info);
+	if (ret)
+		goto fail_init_btree_inode;
+
 	ret = apfs_setup_omap_root(fs_info);
 	if (ret)
 		goto fail_init_btree_inode;
@@ -3586,6 +3812,15 @@ open_fs_info:
 
 	return 0;
 
+fail_free_omap_cache:
+	apfs_omap_cache_free(&nx_info->omap_cache);
+	kvfree(nx_info->eph_map);
+fail_free_nx_info:
+	device->nx_info = NULL;
+	kfree(nx_info->super_copy);
+	kvfree(nx_info);
+	goto fail;
+
 fail_setup_omap_root:
 fail_init_btree_inode:
 fail_alloc_omap_root:
@@ -3735,6 +3970,253 @@ apfs_read_volume_super(struct apfs_nx_info *nx_info, int index)
 					  APFS_SUPER_INFO_SIZE);
 }
 
+/* largest single read issued by the mount-time warm-up */
+#define APFS_WARM_MAX_IO	SZ_1M
+
+static int apfs_bytenr_cmp(const void *a, const void *b)
+{
+	u64 b1 = *(const u64 *)a;
+	u64 b2 = *(const u64 *)b;
+
+	if (b1 != b2)
+		return b1 < b2 ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Hand the copy of tree block @bytenr in the finished read @bp, which
+ * started at @start, to the extent buffer cache, unless the block got
+ * there first.
+ */
+static void warm_fill_tree_block(struct apfs_fs_info *fs_info,
+				 struct apfs_buf *bp, u64 start, u64 bytenr,
+				 u64 owner_root, int level)
+{
+	struct extent_buffer *eb;
+	int num_pages;
+	int i;
+
+	eb = apfs_find_create_tree_block(fs_info, bytenr, owner_root, level);
+	if (IS_ERR(eb))
+		return;
+
+	num_pages = num_extent_pages(eb);
+	for (i = 0; i < num_pages; i++)
+		lock_page(eb->pages[i]);
+
+	if (!extent_buffer_uptodate(eb)) {
+		for (i = 0; i < num_pages; i++)
+			apfs_buf_copy(bp, page_address(eb->pages[i]),
+				      bytenr - start + (i << PAGE_SHIFT),
+				      PAGE_SIZE);
+		/* a block failing here is read and reported again on use */
+		if (!validate_extent_buffer(eb))
+			fs_info->warm_blocks++;
+	}
+
+	for (i = 0; i < num_pages; i++)
+		unlock_page(eb->pages[i]);
+	free_extent_buffer(eb);
+}
+
+/*
+ * Read the tree blocks at @bytenrs, sorted, that aren't cached yet.
+ * Neighbouring blocks are merged into one apfs_buf read of up to
+ * APFS_WARM_MAX_IO, and all reads are in flight before the first is
+ * waited for.
+ */
+static int warm_read_tree_blocks(struct apfs_fs_info *fs_info,
+				 const u64 *bytenrs, int nr, u64 owner_root,
+				 int level)
+{
+	const u32 nodesize = fs_info->nodesize;
+	struct apfs_buf **bufs;
+	int nr_bufs = 0;
+	int ret = 0;
+	int i = 0;
+	int j;
+
+	bufs = kcalloc(nr, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	while (i < nr) {
+		struct extent_buffer *eb;
+		struct apfs_buf *bp;
+		u64 start = bytenrs[i];
+		int n = 1;
+
+		eb = find_extent_buffer(fs_info, start);
+		if (eb) {
+			bool cached = extent_buffer_uptodate(eb);
+
+			free_extent_buffer(eb);
+			if (cached) {
+				i++;
+				continue;
+			}
+		}
+
+		while (i + n < nr && bytenrs[i + n] == start + n * nodesize &&
+		       (n + 1) * nodesize <= APFS_WARM_MAX_IO)
+			n++;
+		i += n;
+
+		bp = apfs_buf_alloc();
+		if (!bp) {
+			ret = -ENOMEM;
+			break;
+		}
+		apfs_buf_init(fs_info, bp, ABF_READ, start, n * nodesize);
+		ret = apfs_buf_alloc_pages(bp, ABF_READ);
+		if (ret) {
+			kfree(bp);
+			break;
+		}
+		apfs_buf_submit(bp, false);
+		bufs[nr_bufs++] = bp;
+	}
+
+	for (i = 0; i < nr_bufs; i++) {
+		struct apfs_buf *bp = bufs[i];
+		u64 start = bp->bno << 9;
+
+		if (!apfs_buf_iowait(bp)) {
+			for (j = 0; j < bp->len / nodesize; j++)
+				warm_fill_tree_block(fs_info, bp, start,
+						     start + j * nodesize,
+						     owner_root, level);
+		}
+		apfs_buf_free(bp);
+	}
+	kfree(bufs);
+	return ret;
+}
+
+/*
+ * Pull the @levels levels below the root of @root into the extent buffer
+ * cache. Each level is read with a few large reads in disk order, and only
+ * then walked through read_tree_block() to verify the blocks and find the
+ * next level, which now hits the cache.
+ */
+static int warm_tree(struct apfs_root *root, u32 levels)
+{
+	struct apfs_fs_info *fs_info = root->fs_info;
+	struct extent_buffer **nodes;
+	struct extent_buffer **children = NULL;
+	u64 *bytenrs = NULL;
+	u64 owner_root = apfs_header_owner(root->node);
+	int nr_nodes = 1;
+	int nr;
+	int ret = 0;
+	int i;
+	int j;
+
+	nodes = kmalloc_array(1, sizeof(*nodes), GFP_KERNEL);
+	if (!nodes)
+		return -ENOMEM;
+	atomic_inc(&root->node->refs);
+	nodes[0] = root->node;
+
+	while (levels-- > 0 && apfs_header_level(nodes[0]) > 0) {
+		int level = apfs_header_level(nodes[0]) - 1;
+
+		nr = 0;
+		for (i = 0; i < nr_nodes; i++)
+			nr += apfs_header_nritems(nodes[i]);
+
+		bytenrs = kvmalloc_array(nr, sizeof(*bytenrs), GFP_KERNEL);
+		children = kvmalloc_array(nr, sizeof(*children), GFP_KERNEL);
+		if (!bytenrs || !children) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		nr = 0;
+		for (i = 0; i < nr_nodes; i++) {
+			/* translate virtual children in one omap pass */
+			apfs_node_child_paddrs(fs_info, nodes[i]);
+			for (j = 0; j < apfs_header_nritems(nodes[i]); j++) {
+				u64 bytenr = apfs_node_child_bytenr(fs_info,
+								    nodes[i], j);
+
+				/* untranslatable, the walk below reports it */
+				if (bytenr)
+					bytenrs[nr++] = bytenr;
+			}
+		}
+		sort(bytenrs, nr, sizeof(*bytenrs), apfs_bytenr_cmp, NULL);
+		ret = warm_read_tree_blocks(fs_info, bytenrs, nr, owner_root,
+					    level);
+		kvfree(bytenrs);
+		bytenrs = NULL;
+		if (ret)
+			break;
+
+		nr = 0;
+		for (i = 0; i < nr_nodes && !ret; i++) {
+			for (j = 0; j < apfs_header_nritems(nodes[i]); j++) {
+				struct extent_buffer *eb;
+
+				eb = apfs_read_node_child(fs_info, nodes[i], j);
+				if (IS_ERR(eb)) {
+					ret = PTR_ERR(eb);
+					break;
+				}
+				children[nr++] = eb;
+			}
+		}
+
+		for (i = 0; i < nr_nodes; i++)
+			free_extent_buffer(nodes[i]);
+		kvfree(nodes);
+		nodes = children;
+		nr_nodes = nr;
+		children = NULL;
+		if (ret || nr_nodes == 0)
+			break;
+	}
+
+	for (i = 0; i < nr_nodes; i++)
+		free_extent_buffer(nodes[i]);
+	kvfree(nodes);
+	kvfree(children);
+	kvfree(bytenrs);
+	return ret;
+}
+
+/*
+ * Mount-time warm-up for the warm= option: read the top levels of the omap
+ * and of the fs tree in bulk so that the first lookups after mount don't
+ * stall on one dependent single-block read per level. The omap goes first
+ * because translating the virtual fs tree children goes through it.
+ *
+ * Failures only cost the warm-up, every block is read again on demand.
+ */
+void apfs_warm_metadata(struct apfs_fs_info *fs_info)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	if (!fs_info->warm_levels)
+		return;
+
+	/* subpage extent buffers track uptodate per range, don't bother */
+	if (fs_info->sectorsize < PAGE_SIZE)
+		return;
+
+	ret = warm_tree(fs_info->omap_root, fs_info->warm_levels);
+	if (!ret)
+		ret = warm_tree(fs_info->root_root, fs_info->warm_levels);
+
+	fs_info->warm_usecs = ktime_us_delta(ktime_get(), start);
+	if (ret)
+		apfs_warn(fs_info, "metadata warm-up stopped early: %d", ret);
+	else
+		apfs_info(fs_info, "warmed %llu metadata blocks in %llu us",
+			  fs_info->warm_blocks, fs_info->warm_usecs);
+}
+
 struct apfs_super_block *apfs_read_dev_super(struct block_device *bdev)
 {
 	struct apfs_super_block *super, *latest = NULL;
@@ -4310,7 +4792,9 @@ void __cold close_ctree(struct apfs_fs_info *fs_info)
 {
 	struct apfs_nx_info *nx_info = fs_info->nx_info;
 
+	apfs_sysfs_remove_volume(fs_info);
 	__close_ctree(fs_info);
+	apfs_put_eb_cache(fs_info);
 	/*
 	 * the real fs_info holds 1, and nx_info itself holds one.
 	 */
@@ -4910,20 +5394,6 @@ out:
 	return ret;
 }
 
-/* return 0 if not found */
-static inline u64
-__apfs_find_ephemeral_paddr(struct apfs_checkpoint_map_phys *cpm, u64 oid)
-{
-	int i;
-
-	for (i = 0; i < cpm->count; ++i) {
-		if (cpm->map[i].oid == oid)
-			return cpm->map[i].paddr;
-	}
-
-	return 0;
-}
-
 int
 apfs_read_checkpoint_map(struct apfs_device *device, u64 bytenr,
 			 struct apfs_checkpoint_map_phys *cmp)
@@ -4932,55 +5402,152 @@ apfs_read_checkpoint_map(struct apfs_device *device, u64 bytenr,
 				 cmp);
 }
 
+static int apfs_ephemeral_map_cmp(const void *a, const void *b)
+{
+	const struct apfs_ephemeral_map *m1 = a;
+	const struct apfs_ephemeral_map *m2 = b;
+
+	if (m1->oid != m2->oid)
+		return m1->oid < m2->oid ? -1 : 1;
+	return 0;
+}
+
 /*
- * return <0 on fatal error
- * return == 0 if found
- * return > 0 means not found
+ * Parse every checkpoint mapping block of the mounted checkpoint into a
+ * sorted in-memory index, so resolving an ephemeral oid needs no I/O.
  */
-int
-apfs_find_ephemeral_paddr(struct apfs_nx_info *info, u64 oid, u64 *paddr_res)
-{
-	int i = 0;
-	u64 paddr;
-	int ret;
-	u64 desc_base = apfs_nx_super_xp_desc_base(info->super_copy);
-	u64 desc_blocks = apfs_nx_super_xp_desc_blocks(info->super_copy);
-	u64 desc_index = apfs_nx_super_xp_desc_index(info->super_copy);
-	u64 desc_len = apfs_nx_super_xp_desc_len(info->super_copy);
+int apfs_build_ephemeral_index(struct apfs_nx_info *info)
+{
+	struct apfs_nx_superblock *sb = info->super_copy;
+	u64 desc_base = apfs_nx_super_xp_desc_base(sb);
+	u64 desc_blocks = apfs_nx_super_xp_desc_blocks(sb);
+	u64 desc_index = apfs_nx_super_xp_desc_index(sb);
+	u64 desc_len = apfs_nx_super_xp_desc_len(sb);
+	struct apfs_checkpoint_map_phys *cpm;
+	struct apfs_ephemeral_map *map = NULL;
+	u32 nr = 0;
+	u32 max_per_block;
+	u64 start_ns = ktime_get_ns();
+	int ret = 0;
+	int i;
 
+	if (desc_base == 0 || desc_len == 0 || desc_blocks == 0) {
+		apfs_err(NULL, "invalid checkpoint descriptor area");
+		return -EUCLEAN;
+	}
 
-	BUG_ON(desc_base == 0 || desc_len == 0);
+	cpm = kmalloc(info->block_size, GFP_KERNEL);
+	if (!cpm)
+		return -ENOMEM;
+
+	max_per_block = (info->block_size - sizeof(*cpm)) /
+		sizeof(struct apfs_checkpoint_mapping);
+
+	/* the last block of the checkpoint is the container superblock */
+	map = kvmalloc_array((desc_len - 1) * max_per_block, sizeof(*map),
+			     GFP_KERNEL);
+	if (!map) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	for (i = 0; i < desc_len - 1; ++i) {
-		struct apfs_checkpoint_map_phys cpm;
 		u64 cpm_paddr = (desc_base + (desc_index + i) % desc_blocks) *
 			info->block_size;
+		u32 count;
+		int j;
 
-		ret = apfs_read_checkpoint_map(info->device, cpm_paddr, &cpm);
+		ret = apfs_read_generic(info->device->bdev, cpm_paddr,
+					info->block_size, cpm);
 		if (ret)
-			return ret;
-		paddr = __apfs_find_ephemeral_paddr(&cpm, oid);
-		if (paddr != 0) {
-			ret = 0;
-			*paddr_res = paddr;
+			goto out;
+
+		if ((apfs_stack_obj_type(&cpm->o) & APFS_OBJ_TYPE_MASK) !=
+		    APFS_OBJ_TYPE_CHECKPOINT_MAP)
+			continue;
+
+		count = apfs_checkpoint_map_count(cpm);
+		if (count > max_per_block) {
+			apfs_err(NULL,
+		"checkpoint map at %llu has too many mappings: %u > %u",
+				 cpm_paddr, count, max_per_block);
+			ret = -EUCLEAN;
+			goto out;
+		}
+
+		for (j = 0; j < count; j++) {
+			map[nr].oid = le64_to_cpu(cpm->map[j].oid);
+			map[nr].paddr = le64_to_cpu(cpm->map[j].paddr) <<
+				info->block_size_bits;
+			nr++;
 		}
 
+		if (apfs_checkpoint_map_flags(cpm) & APFS_CHECKPOINT_MAP_LAST)
+			break;
 	}
 
-	/* not found */
-	return -ENOENT;
+	sort(map, nr, sizeof(*map), apfs_ephemeral_map_cmp, NULL);
+
+	info->eph_map = map;
+	info->eph_map_count = nr;
+	map = NULL;
+
+	apfs_info(NULL, "loaded %u ephemeral object mappings in %llu us", nr,
+		  div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC));
+out:
+	kvfree(map);
+	kfree(cpm);
+	return ret;
 }
 
-u64 apfs_node_blockptr(const struct extent_buffer *eb, int nr)
+/*
+ * return <0 on fatal error
+ * return == 0 if found
+ * return > 0 means not found
+ */
+int
+apfs_find_ephemeral_paddr(struct apfs_nx_info *info, u64 oid, u64 *paddr_res)
+{
+	struct apfs_ephemeral_map key = { .oid = oid };
+	struct apfs_ephemeral_map *found;
+
+	found = bsearch(&key, info->eph_map, info->eph_map_count,
+			sizeof(key), apfs_ephemeral_map_cmp);
+	if (!found)
+		return -ENOENT;
+
+	*paddr_res = found->paddr;
+	return 0;
+}
+
+/*
+ * Bytenr of child @nr of index node @eb as seen by the mount @fs_info.
+ *
+ * Virtual children are translated through the omap of @fs_info at its xid;
+ * @eb may be shared with mounts of other snapshots of the volume.
+ */
+u64 apfs_node_child_bytenr(struct apfs_fs_info *fs_info,
+			   const struct extent_buffer *eb, int nr)
 {
 	u64 item_offset = apfs_item_offset_nr(eb, nr);
 	__le64 __oid;
 	u64 oid;
 	enum apfs_storage stg;
 	struct apfs_obj_header obj;
+	struct apfs_child_paddrs *table;
+	u64 xid = 0;
 	u64 paddr;
+	u64 start_ns;
 	int ret;
 
+	if (fs_info->__super_copy) {
+		xid = apfs_volume_super_xid(fs_info->__super_copy);
+		for (table = smp_load_acquire(&eb->child_paddrs); table;
+		     table = table->next)
+			if (table->xid == xid)
+				return table->paddrs[nr];
+	}
+
 	read_extent_buffer(eb, &__oid, item_offset, sizeof(__oid));
 	oid = __le64_to_cpu(__oid);
 
@@ -4988,19 +5555,25 @@ u64 apfs_node_blockptr(const struct extent_buffer *eb, int nr)
 	stg = apfs_obj_stg_type(&obj);
 
 	if (stg == APFS_STG_PHYSICAL) {
-		paddr = oid << eb->fs_info->block_size_bits;
+		paddr = oid << fs_info->block_size_bits;
 		return paddr;
 	}
 
+	start_ns = ktime_get_ns();
 	if (stg == APFS_STG_EPHEMERAL)
-		ret = apfs_find_ephemeral_paddr(eb->fs_info->nx_info, oid,
-						&paddr);
+		ret = apfs_find_ephemeral_paddr(fs_info->nx_info, oid, &paddr);
 	else
-		ret = apfs_find_omap_paddr(eb->fs_info->omap_root, oid,
-			     apfs_volume_super_xid(eb->fs_info->__super_copy), &paddr);
+		ret = apfs_find_omap_paddr(fs_info->omap_root, oid, xid,
+					   &paddr);
+	apfs_lat_record(fs_info, APFS_LAT_OMAP, start_ns);
 
 	if (ret)
 		paddr = 0;
 
 	return paddr;
 }
+
+u64 apfs_node_blockptr(const struct extent_buffer *eb, int nr)
+{
+	return apfs_node_child_bytenr(eb->fs_info, eb, nr);
+}
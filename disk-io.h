@@ -26,6 +26,7 @@ enum apfs_wq_endio_type {
 	APFS_WQ_ENDIO_METADATA,
 	APFS_WQ_ENDIO_FREE_SPACE,
 	APFS_WQ_ENDIO_RAID56,
+	APFS_WQ_ENDIO_DECOMPRESS,
 };
 
 static inline u64 apfs_nx_offset(void)
@@ -46,7 +47,7 @@ struct apfs_fs_devices;
 
 void apfs_check_leaked_roots(struct apfs_fs_info *fs_info);
 void apfs_init_fs_info(struct apfs_fs_info *fs_info);
-void apfs_init_nx_info(struct apfs_nx_info *nx_info);
+int apfs_init_nx_info(struct apfs_nx_info *nx_info);
 int apfs_verify_level_key(struct extent_buffer *eb, int level,
 			   struct apfs_key *first_key, u64 parent_transid);
 struct extent_buffer *read_tree_block(struct apfs_fs_info *fs_info, u64 bytenr,
@@ -161,11 +162,20 @@ static inline void apfs_set_buffer_lockdep_class(u64 objectid,
 #endif
 
 
+int apfs_omap_cache_init(struct apfs_omap_cache *cache);
+void apfs_omap_cache_free(struct apfs_omap_cache *cache);
 int apfs_find_omap_paddr(struct apfs_root *root, u64 oid, u64 xid, u64 *paddr);
 u64 apfs_node_blockptr(const struct extent_buffer *eb, int nr);
+u64 apfs_node_child_bytenr(struct apfs_fs_info *fs_info,
+			   const struct extent_buffer *eb, int nr);
+const u64 *apfs_node_child_paddrs(struct apfs_fs_info *fs_info,
+				  struct extent_buffer *eb);
 int apfs_read_checkpoint_map(struct apfs_device *device, u64 bytenr,
 			     struct apfs_checkpoint_map_phys *cmp);
 struct apfs_vol_superblock *
 apfs_read_dev_volume_super(struct apfs_fs_info *fs_info, u64 bytenr, u64 size);
+int apfs_build_ephemeral_index(struct apfs_nx_info *info);
+void apfs_warm_metadata(struct apfs_fs_info *fs_info);
+void apfs_clear_verified_blocks(struct apfs_fs_info *fs_info);
 int apfs_find_ephemeral_paddr(struct apfs_nx_info *info, u64 oid, u64 *paddr_res);
 #endif
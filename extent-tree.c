@@ -4962,7 +4962,7 @@ static noinline void reada_walk_down(struct apfs_trans_handle *trans,
 				continue;
 		}
 reada:
-		apfs_readahead_node_child(eb, slot);
+		apfs_readahead_node_child(fs_info, eb, slot);
 		nread++;
 	}
 	wc->reada_slot = slot;
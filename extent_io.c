@@ -13,6 +13,7 @@
 #include <linux/pagevec.h>
 #include <linux/prefetch.h>
 #include <linux/cleancache.h>
+#include <linux/shrinker.h>
 #include "misc.h"
 #include "extent_io.h"
 #include "extent-io-tree.h"
@@ -3314,8 +3315,6 @@ static int submit_extent_page(unsigned int opf,
 
 	bio = apfs_bio_alloc(disk_bytenr);
 	bio_add_page(bio, page, io_size, pg_offset);
-	trace_printk("apfs alloc bio disk_bytenr %llu io size %lu pg_offset %lu\n",
-		disk_bytenr, io_size, pg_offset);
 	bio->bi_end_io = end_io_func;
 	bio->bi_private = tree;
 	bio->bi_write_hint = page->mapping->host->i_write_hint;
@@ -3474,9 +3473,6 @@ int apfs_do_readpage(struct page *page, struct extent_map **em_cached,
 	unsigned long this_bio_flag = 0;
 	struct extent_io_tree *tree = &APFS_I(inode)->io_tree;
 
-	trace_printk("read ino %lu start %lu\n", page->mapping->host->i_ino,
-		     page->index << PAGE_SHIFT);
-
 	ret = set_page_extent_mapped(page);
 	if (ret < 0) {
 		unlock_extent(tree, start, end);
@@ -3529,9 +3525,6 @@ int apfs_do_readpage(struct page *page, struct extent_map **em_cached,
 			end_page_read(page, false, cur, end + 1 - cur);
 			break;
 		}
-		trace_printk("get extent map ino %lu start %llu em start %llu len %llu block_start %llu block_len %llu\n",
-			     inode->i_ino, cur, em->block_start, em->len,
-			     em->block_start, em->block_len);
 		extent_offset = cur - em->start;
 		BUG_ON(extent_map_end(em) <= cur);
 		BUG_ON(end < cur);
@@ -5561,6 +5554,15 @@ out_free_ulist:
 
 static void __free_extent_buffer(struct extent_buffer *eb)
 {
+	struct apfs_child_paddrs *table = eb->child_paddrs;
+
+	while (table) {
+		struct apfs_child_paddrs *next = table->next;
+
+		kvfree(table);
+		table = next;
+	}
+	kvfree(eb->key_table);
 	kmem_cache_free(extent_buffer_cache, eb);
 }
 
@@ -5703,6 +5705,8 @@ __alloc_extent_buffer(struct apfs_fs_info *fs_info, u64 start,
 	apfs_leak_debug_add(&fs_info->eb_leak_lock, &eb->leak_list,
 			     &fs_info->allocated_ebs);
 	INIT_LIST_HEAD(&eb->release_list);
+	INIT_LIST_HEAD(&eb->lru);
+	eb->cache_tree = APFS_EB_TREE_OTHER;
 
 	spin_lock_init(&eb->refs_lock);
 	atomic_set(&eb->refs, 1);
@@ -5777,7 +5781,8 @@ struct extent_buffer *__alloc_dummy_extent_buffer(struct apfs_fs_info *fs_info,
 			goto err;
 	}
 	set_extent_buffer_uptodate(eb);
-	apfs_set_header_nritems(eb, 0);
+	/* apfs_set_header_nritems() is not implemented for a readonly tree */
+	memzero_extent_buffer(eb, 0, sizeof(struct apfs_node_header));
 	set_bit(EXTENT_BUFFER_UNMAPPED, &eb->bflags);
 
 	return eb;
@@ -5832,12 +5837,94 @@ static void check_buffer_tree_ref(struct extent_buffer *eb)
 	spin_unlock(&eb->refs_lock);
 }
 
+/*
+ * Put @eb, just inserted in the buffer radix tree, at the hot end of the LRU
+ * and kick the eviction if that takes the cache over its budget.
+ */
+static void eb_lru_add(struct extent_buffer *eb)
+{
+	struct apfs_fs_info *fs_info = eb->fs_info;
+	u64 limit = READ_ONCE(fs_info->eb_cache_limit);
+	u64 bytes;
+
+	spin_lock(&fs_info->eb_lru_lock);
+	list_add_tail(&eb->lru, &fs_info->eb_lru);
+	fs_info->eb_lru_nr++;
+	fs_info->eb_lru_bytes += eb->len;
+	bytes = fs_info->eb_lru_bytes;
+	spin_unlock(&fs_info->eb_lru_lock);
+
+	if (limit && bytes > limit)
+		queue_work(system_unbound_wq, &fs_info->eb_evict_work);
+}
+
+static void eb_lru_del(struct extent_buffer *eb)
+{
+	struct apfs_fs_info *fs_info = eb->fs_info;
+
+	spin_lock(&fs_info->eb_lru_lock);
+	if (!list_empty(&eb->lru)) {
+		list_del_init(&eb->lru);
+		fs_info->eb_lru_nr--;
+		fs_info->eb_lru_bytes -= eb->len;
+	}
+	spin_unlock(&fs_info->eb_lru_lock);
+}
+
+/* @eb is about to be released to reclaim its pages */
+static void eb_note_eviction(struct extent_buffer *eb)
+{
+	atomic64_inc(&eb->fs_info->eb_stats[eb->cache_tree].evictions);
+}
+
+static enum apfs_eb_tree eb_tree_type(const struct extent_buffer *eb)
+{
+	switch (apfs_header_subtype(eb)) {
+	case APFS_OBJ_TYPE_OMAP:
+		return APFS_EB_TREE_OMAP;
+	case APFS_OBJ_TYPE_FSTREE:
+		return APFS_EB_TREE_FS;
+	case APFS_OBJ_TYPE_REFTREE:
+		return APFS_EB_TREE_EXTENTREF;
+	case APFS_OBJ_TYPE_SNAPTREE:
+		return APFS_EB_TREE_SNAP;
+	default:
+		return APFS_EB_TREE_OTHER;
+	}
+}
+
+/*
+ * Count the just read and validated @eb in the cached bytes of its tree.
+ */
+void apfs_eb_cache_account(struct extent_buffer *eb)
+{
+	if (test_and_set_bit(EXTENT_BUFFER_CACHE_ACCOUNTED, &eb->bflags))
+		return;
+
+	eb->cache_tree = eb_tree_type(eb);
+	atomic64_add(eb->len, &eb->fs_info->eb_stats[eb->cache_tree].cached_bytes);
+}
+
+/* Count a tree block lookup, @hit if it didn't need a read */
+void apfs_eb_cache_lookup(struct extent_buffer *eb, bool hit)
+{
+	struct apfs_eb_tree_stats *stats = &eb->fs_info->eb_stats[eb->cache_tree];
+
+	if (hit)
+		atomic64_inc(&stats->hits);
+	else
+		atomic64_inc(&stats->misses);
+}
+
 static void mark_extent_buffer_accessed(struct extent_buffer *eb,
 		struct page *accessed)
 {
 	int num_pages, i;
 
 	check_buffer_tree_ref(eb);
+	/* the LRU scan gives @eb another round instead of evicting it */
+	if (!test_bit(EXTENT_BUFFER_LRU_REF, &eb->bflags))
+		set_bit(EXTENT_BUFFER_LRU_REF, &eb->bflags);
 
 	num_pages = num_extent_pages(eb);
 	for (i = 0; i < num_pages; i++) {
@@ -5853,6 +5940,7 @@ struct extent_buffer *find_extent_buffer(struct apfs_fs_info *fs_info,
 {
 	struct extent_buffer *eb;
 
+	fs_info = apfs_eb_owner(fs_info);
 	eb = find_extent_buffer_nolock(fs_info, start);
 	if (!eb)
 		return NULL;
@@ -5954,17 +6042,21 @@ static struct extent_buffer *grab_extent_buffer(
 struct extent_buffer *alloc_extent_buffer(struct apfs_fs_info *fs_info,
 					  u64 start, u64 owner_root, int level)
 {
-	unsigned long len = fs_info->nodesize;
+	unsigned long len;
 	int num_pages;
 	int i;
 	unsigned long index = start >> PAGE_SHIFT;
 	struct extent_buffer *eb;
 	struct extent_buffer *exists = NULL;
 	struct page *p;
-	struct address_space *mapping = fs_info->btree_inode->i_mapping;
+	struct address_space *mapping;
 	int uptodate = 1;
 	int ret;
 
+	fs_info = apfs_eb_owner(fs_info);
+	len = fs_info->nodesize;
+	mapping = fs_info->btree_inode->i_mapping;
+
 	if (!IS_ALIGNED(start, fs_info->sectorsize)) {
 		apfs_err(fs_info, "bad tree block start %llu", start);
 		return ERR_PTR(-EINVAL);
@@ -6089,6 +6181,7 @@ again:
 	/* add one reference for the tree */
 	check_buffer_tree_ref(eb);
 	set_bit(EXTENT_BUFFER_IN_TREE, &eb->bflags);
+	eb_lru_add(eb);
 
 	/*
 	 * Now it's safe to unlock the pages because any calls to
@@ -6130,6 +6223,7 @@ static int release_extent_buffer(struct extent_buffer *eb)
 
 			spin_unlock(&eb->refs_lock);
 
+			eb_lru_del(eb);
 			spin_lock(&fs_info->buffer_lock);
 			radix_tree_delete(&fs_info->buffer_radix,
 					  eb->start >> fs_info->sectorsize_bits);
@@ -6137,6 +6231,9 @@ static int release_extent_buffer(struct extent_buffer *eb)
 		} else {
 			spin_unlock(&eb->refs_lock);
 		}
+		if (test_bit(EXTENT_BUFFER_CACHE_ACCOUNTED, &eb->bflags))
+			atomic64_sub(eb->len,
+			&eb->fs_info->eb_stats[eb->cache_tree].cached_bytes);
 
 		apfs_leak_debug_del(&eb->fs_info->eb_leak_lock, &eb->leak_list);
 		/* Should be safe to release our pages at this point */
@@ -7125,6 +7222,7 @@ static int try_release_subpage_extent_buffer(struct page *page)
 			spin_unlock(&eb->refs_lock);
 			break;
 		}
+		eb_note_eviction(eb);
 
 		/*
 		 * Here we don't care about the return value, we will always
@@ -7188,10 +7286,139 @@ int try_release_extent_buffer(struct page *page)
 		spin_unlock(&eb->refs_lock);
 		return 0;
 	}
+	eb_note_eviction(eb);
 
 	return release_extent_buffer(eb);
 }
 
+#define APFS_EB_EVICT_BATCH	32
+
+/*
+ * Scan up to @nr_to_scan extent buffers from the cold end of the LRU of
+ * @fs_info and evict the ones only the buffer tree holds. An extent buffer
+ * marked by mark_extent_buffer_accessed() since the previous scan is moved
+ * to the hot end instead, which keeps the LRU order without taking the LRU
+ * lock on every access.
+ *
+ * Eviction goes through invalidate_mapping_pages(), so btree_releasepage()
+ * still decides under the page lock whether the extent buffer can go, and
+ * the pages are freed along with it.
+ *
+ * Returns the number of extent buffers evicted.
+ */
+static unsigned long evict_extent_buffers(struct apfs_fs_info *fs_info,
+					  unsigned long nr_to_scan)
+{
+	struct address_space *mapping = fs_info->btree_inode->i_mapping;
+	u64 batch[APFS_EB_EVICT_BATCH];
+	unsigned long freed = 0;
+
+	/* going round the list twice would only find the same buffers */
+	nr_to_scan = min(nr_to_scan, READ_ONCE(fs_info->eb_lru_nr));
+
+	while (nr_to_scan) {
+		int nr = 0;
+		int i;
+
+		spin_lock(&fs_info->eb_lru_lock);
+		while (nr_to_scan && nr < APFS_EB_EVICT_BATCH &&
+		       !list_empty(&fs_info->eb_lru)) {
+			struct extent_buffer *eb;
+
+			nr_to_scan--;
+			eb = list_first_entry(&fs_info->eb_lru,
+					      struct extent_buffer, lru);
+			list_move_tail(&eb->lru, &fs_info->eb_lru);
+			if (test_and_clear_bit(EXTENT_BUFFER_LRU_REF,
+					       &eb->bflags))
+				continue;
+			if (atomic_read(&eb->refs) != 1 ||
+			    extent_buffer_under_io(eb))
+				continue;
+			batch[nr++] = eb->start;
+		}
+		spin_unlock(&fs_info->eb_lru_lock);
+
+		if (!nr)
+			break;
+
+		for (i = 0; i < nr; i++) {
+			pgoff_t first = batch[i] >> PAGE_SHIFT;
+			pgoff_t last = (batch[i] + fs_info->nodesize - 1) >>
+				PAGE_SHIFT;
+
+			if (invalidate_mapping_pages(mapping, first, last))
+				freed++;
+		}
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/* Bring the cache back under eb_cache_limit, kicked by eb_lru_add() */
+static void eb_evict_worker(struct work_struct *work)
+{
+	struct apfs_fs_info *fs_info = container_of(work, struct apfs_fs_info,
+						    eb_evict_work);
+	u64 limit = READ_ONCE(fs_info->eb_cache_limit);
+	int idle = 0;
+
+	while (limit && READ_ONCE(fs_info->eb_lru_bytes) > limit) {
+		u64 over = READ_ONCE(fs_info->eb_lru_bytes) - limit;
+		unsigned long nr = div_u64(over, fs_info->nodesize) + 1;
+
+		/* the first pass may only strip the accessed bits */
+		if (evict_extent_buffers(fs_info, nr))
+			idle = 0;
+		else if (++idle > 1)
+			break;
+	}
+}
+
+static unsigned long eb_shrink_count(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	struct apfs_fs_info *fs_info = container_of(shrink,
+				struct apfs_fs_info, eb_shrinker);
+
+	return READ_ONCE(fs_info->eb_lru_nr) ?: SHRINK_EMPTY;
+}
+
+static unsigned long eb_shrink_scan(struct shrinker *shrink,
+				    struct shrink_control *sc)
+{
+	struct apfs_fs_info *fs_info = container_of(shrink,
+				struct apfs_fs_info, eb_shrinker);
+
+	/* same rule as the superblock shrinker */
+	if (!(sc->gfp_mask & __GFP_FS))
+		return SHRINK_STOP;
+
+	return evict_extent_buffers(fs_info, sc->nr_to_scan);
+}
+
+/*
+ * Start budget eviction and the shrinker for the extent buffer cache
+ * @fs_info, see apfs_get_eb_cache().
+ */
+int apfs_eb_cache_init(struct apfs_fs_info *fs_info)
+{
+	INIT_WORK(&fs_info->eb_evict_work, eb_evict_worker);
+	fs_info->eb_shrinker.count_objects = eb_shrink_count;
+	fs_info->eb_shrinker.scan_objects = eb_shrink_scan;
+	fs_info->eb_shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&fs_info->eb_shrinker);
+}
+
+/* Must run before the cache's btree inode goes away */
+void apfs_eb_cache_exit(struct apfs_fs_info *fs_info)
+{
+	unregister_shrinker(&fs_info->eb_shrinker);
+	cancel_work_sync(&fs_info->eb_evict_work);
+}
+
 /*
  * apfs_readahead_tree_block - attempt to readahead a child block
  * @fs_info:	the fs_info
@@ -7228,16 +7455,18 @@ void apfs_readahead_tree_block(struct apfs_fs_info *fs_info,
 
 /*
  * apfs_readahead_node_child - readahead a node's child block
+ * @fs_info:	the mount doing the read, whose omap translates the child
  * @node:	parent node we're reading from
  * @slot:	slot in the parent node for the child we want to read
  *
  * A helper for apfs_readahead_tree_block, we simply read the bytenr pointed at
  * the slot in the node provided.
  */
-void apfs_readahead_node_child(struct extent_buffer *node, int slot)
+void apfs_readahead_node_child(struct apfs_fs_info *fs_info,
+			       struct extent_buffer *node, int slot)
 {
-	apfs_readahead_tree_block(node->fs_info,
-				   apfs_node_blockptr(node, slot),
+	apfs_readahead_tree_block(fs_info,
+				   apfs_node_child_bytenr(fs_info, node, slot),
 				   apfs_header_owner(node),
 				   apfs_node_ptr_generation(node, slot),
 				   apfs_header_level(node) - 1);
@@ -7262,7 +7491,6 @@ int apfs_read_extent_page_map(struct apfs_inode *inode,
 				 true);
 
 	if (bio_ctrl.bio) {
-		trace_printk("bio len %u\n", bio_ctrl.bio->bi_iter.bi_size);
 		ret2 = submit_one_bio(bio_ctrl.bio, 0, bio_ctrl.bio_flags);
 		if (ret2 < 0)
 			return ret2;
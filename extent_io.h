@@ -34,6 +34,10 @@ enum {
 	/* write IO error */
 	EXTENT_BUFFER_WRITE_ERR,
 	EXTENT_BUFFER_NO_CHECK,
+	/* accessed since the last LRU scan, see evict_extent_buffers() */
+	EXTENT_BUFFER_LRU_REF,
+	/* counted in the cached bytes of eb->cache_tree */
+	EXTENT_BUFFER_CACHE_ACCOUNTED,
 };
 
 /* these are flags for __process_pages_contig */
@@ -69,6 +73,8 @@ struct apfs_root;
 struct apfs_inode;
 struct apfs_io_bio;
 struct apfs_fs_info;
+struct apfs_packed_key;
+struct apfs_child_paddrs;
 struct io_failure_record;
 struct extent_io_tree;
 
@@ -98,6 +104,18 @@ struct extent_buffer {
 
 	struct page *pages[INLINE_EXTENT_BUFFER_PAGES];
 	struct list_head release_list;
+	/*
+	 * Omap-resolved bytenr of each child of a virtual index node, indexed
+	 * by slot, one table per xid. Built on first descent, see
+	 * apfs_node_child_paddrs().
+	 */
+	struct apfs_child_paddrs *child_paddrs;
+	/* Packed keys of an fs-tree node, see apfs_node_key_table() */
+	struct apfs_packed_key *key_table;
+	/* On fs_info->eb_lru while in the buffer radix tree */
+	struct list_head lru;
+	/* enum apfs_eb_tree, set once the contents are read */
+	u8 cache_tree;
 #ifdef CONFIG_APFS_DEBUG
 	struct list_head leak_list;
 #endif
@@ -208,6 +226,10 @@ struct extent_buffer *find_extent_buffer(struct apfs_fs_info *fs_info,
 					 u64 start);
 void free_extent_buffer(struct extent_buffer *eb);
 void free_extent_buffer_stale(struct extent_buffer *eb);
+void apfs_eb_cache_account(struct extent_buffer *eb);
+void apfs_eb_cache_lookup(struct extent_buffer *eb, bool hit);
+int apfs_eb_cache_init(struct apfs_fs_info *fs_info);
+void apfs_eb_cache_exit(struct apfs_fs_info *fs_info);
 #define WAIT_NONE	0
 #define WAIT_COMPLETE	1
 #define WAIT_PAGE_LOCK	2
@@ -216,7 +238,8 @@ int read_extent_buffer_pages(struct extent_buffer *eb, int wait,
 void wait_on_extent_buffer_writeback(struct extent_buffer *eb);
 void apfs_readahead_tree_block(struct apfs_fs_info *fs_info,
 				u64 bytenr, u64 owner_root, u64 gen, int level);
-void apfs_readahead_node_child(struct extent_buffer *node, int slot);
+void apfs_readahead_node_child(struct apfs_fs_info *fs_info,
+			       struct extent_buffer *node, int slot);
 
 static inline int num_extent_pages(const struct extent_buffer *eb)
 {
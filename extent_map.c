@@ -557,7 +557,7 @@ static noinline int merge_extent_mapping(struct extent_map_tree *em_tree,
 	u64 start_diff;
 
 	if (map_start < em->start || map_start >= extent_map_end(em)) {
-		trace_printk("APFS: merage em failed: map start %llu em->start %llu em map_end %llu existing start %llu end %llu",
+		pr_crit("APFS: merge em failed: map start %llu em start %llu em end %llu existing start %llu len %llu\n",
 			map_start, em->start, extent_map_end(em),
 			existing->start, existing->len);
 		BUG();
@@ -655,8 +655,6 @@ int apfs_add_extent_mapping(struct apfs_fs_info *fs_info,
 					  ret, existing->start, existing->len,
 					  orig_start, orig_len);
 			}
-			trace_printk("merge extent mapping existing [%llu %llu] and [%llu %llu]", existing->start, existing->len,
-			       orig_start, orig_len);
 			free_extent_map(existing);
 		}
 	}
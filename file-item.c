@@ -235,7 +235,6 @@ int apfs_lookup_file_extent(struct apfs_trans_handle *trans,
 			     struct apfs_path *path, u64 objectid,
 			     u64 offset, int mod)
 {
-	int ret;
 	struct apfs_key file_key = {};
 	int ins_len = mod < 0 ? -1 : 0;
 	int cow = mod != 0;
@@ -243,11 +242,7 @@ int apfs_lookup_file_extent(struct apfs_trans_handle *trans,
 	file_key.oid = objectid;
 	file_key.offset = offset;
 	file_key.type = APFS_TYPE_FILE_EXTENT;
-	ret = apfs_search_slot(trans, root, &file_key, path, ins_len, cow);
-	trace_printk("search file extent objectid %llu oid %llu type %u offset %llu eb %llu slot %d ret %d\n",
-		     file_key.objectid, file_key.oid, file_key.type, file_key.offset,
-		     path->nodes[0]->start, path->slots[0], ret);
-	return ret;
+	return apfs_search_slot(trans, root, &file_key, path, ins_len, cow);
 }
 
 /*
@@ -1185,268 +1180,265 @@ out:
 }
 
 /*
- * This function reads first block size from the extent, parses
- * offset maps and inserts extent maps into inode extent tree
- *
- * TODO: If start is located in first block, cache it.
- *
+ * Where the chunks of a resource fork compressed file live on disk.  The
+ * fork's table is parsed on first access and kept until the inode is
+ * evicted, so mapping a chunk needs neither a tree search nor a table read.
+ * Chunk @nr starts at @bytenr + chunks[nr].off and is chunks[nr].len bytes.
  */
-
-static struct extent_map *
-lzfse_extent_item_to_extent_map(struct apfs_inode *inode,
-				const struct apfs_path *path,
-				u64 start, u64 len)
-{
-	struct apfs_fs_info *fs_info = inode->root->fs_info;
-	struct apfs_file_extent_val *fi;
+struct apfs_chunk_index {
 	u64 bytenr;
-	int ret;
-	struct page *page = NULL;
-	u32 *entry;
+	u32 nr_chunks;
+	struct {
+		u32 off;
+		u32 len;
+	} chunks[];
+};
+
+/* Copy @len bytes at disk @bytenr to @dst through the block device cache */
+static int read_disk_bytes(struct apfs_fs_info *fs_info, u64 bytenr,
+			   void *dst, size_t len)
+{
 	struct address_space *mapping = fs_info->device->bdev->bd_inode->i_mapping;
-	struct extent_map *em;
-	struct apfs_key key = {};
-	u32 entry_nr;
-	u64 entry_bytenr;
-	struct extent_map_tree *em_tree = &inode->extent_tree;
 
-	em = alloc_extent_map();
-	if (em == NULL) {
-		ret = -ENOMEM;
-		goto out;
+	while (len) {
+		size_t offset = offset_in_page(bytenr);
+		size_t cur = min_t(size_t, len, PAGE_SIZE - offset);
+		struct page *page;
+
+		page = read_cache_page_gfp(mapping, bytenr >> PAGE_SHIFT,
+					   GFP_NOFS);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		memcpy_from_page(dst, page, offset, cur);
+		put_page(page);
+
+		dst += cur;
+		bytenr += cur;
+		len -= cur;
 	}
+	return 0;
+}
 
-	fi = apfs_item_ptr(path->nodes[0], path->slots[0],
-			   struct apfs_file_extent_val);
-	apfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+/*
+ * LZFSE and LZVN forks start with nr_chunks + 1 little endian offsets, chunk
+ * i spans [offsets[i], offsets[i + 1]) from the start of the fork.
+ */
+static int parse_lzfse_chunk_index(struct apfs_fs_info *fs_info,
+				   struct apfs_chunk_index *index)
+{
+	__le32 *offsets;
+	u32 i;
+	int ret;
 
-	ASSERT(key.oid == inode->cid);
-	ASSERT(key.type == APFS_TYPE_FILE_EXTENT);
-	ASSERT(key.offset == 0);
+	offsets = kvmalloc_array(index->nr_chunks + 1, sizeof(*offsets),
+				 GFP_NOFS);
+	if (!offsets)
+		return -ENOMEM;
 
-	bytenr = apfs_file_extent_bno(path->nodes[0], fi)
-		<< fs_info->block_size_bits;
-	entry_nr = DIV_ROUND_DOWN_ULL(start - key.offset, APFS_MAX_UNCOMPRESSED);
-	entry_bytenr = bytenr + entry_nr * sizeof(*entry);
-
-	trace_printk("base bytenr %llu entry bytenr %llu entrynr %u\n",
-			bytenr, entry_bytenr, entry_nr);
-	entry = apfs_read_cache_page_unaligned(mapping, entry_bytenr, &page);
-	if (IS_ERR(entry))  {
-		ret = PTR_ERR(entry);
+	ret = read_disk_bytes(fs_info, index->bytenr, offsets,
+			      (index->nr_chunks + 1) * sizeof(*offsets));
+	if (ret)
 		goto out;
-	}
-
-	set_bit(EXTENT_FLAG_COMPRESSED, &em->flags);
-	em->compress_type = inode->prop_compress;
-	em->block_start = bytenr + *entry;
-	em->start = ALIGN_DOWN(start, APFS_MAX_UNCOMPRESSED);
-	em->orig_start = key.offset + ALIGN_DOWN(start, APFS_MAX_UNCOMPRESSED);
-	em->offset = *entry;
 
-	em->len = APFS_MAX_COMPRESSED;
+	for (i = 0; i < index->nr_chunks; i++) {
+		u32 off = le32_to_cpu(offsets[i]);
+		u32 end = le32_to_cpu(offsets[i + 1]);
 
-	if ((entry_bytenr % PAGE_SIZE) + sizeof(*entry) >= PAGE_SIZE) {
-		kunmap(page);
-		put_page(page);
-		page = NULL;
-		entry_nr++;
-		entry = apfs_read_cache_page_unaligned(mapping,
-			       bytenr + entry_nr * sizeof(*entry), &page);
-		if (IS_ERR(entry))  {
-			ret = PTR_ERR(entry);
+		if (end < off) {
+			ret = -EUCLEAN;
 			goto out;
 		}
-	} else {
-		entry++;
+		index->chunks[i].off = off;
+		index->chunks[i].len = end - off;
 	}
+out:
+	kvfree(offsets);
+	return ret;
+}
 
-	em->block_len = *entry - em->offset;
-	kunmap(page);
-	put_page(page);
-	page = NULL;
-
-	BUG_ON(em->block_len >= APFS_MAX_COMPRESSED + 4096);
-	/* do not forget the last em */
-	if (em->orig_start == ALIGN_DOWN(i_size_read(&inode->vfs_inode), APFS_MAX_UNCOMPRESSED))
-	    em->len = i_size_read(&inode->vfs_inode) %  APFS_MAX_UNCOMPRESSED;
-	else
-		em->len = APFS_MAX_UNCOMPRESSED;
-
-	write_lock(&em_tree->lock);
+/*
+ * zlib forks are classic resource forks: a header pointing at the data
+ * area, which starts with the fork data and a table of (offset, size) pairs
+ * relative to the data area.
+ */
+static int parse_zlib_chunk_index(struct apfs_fs_info *fs_info,
+				  struct apfs_chunk_index *index)
+{
+	struct apfs_resource_fork_header hdr;
+	struct apfs_resource_fork_entries entries;
+	struct apfs_resource_fork_entry *table;
+	u64 data_offset;
+	u32 i;
+	int ret;
 
-	trace_printk("add extent map em start %llu len %llu orig_start %llu block start %llu block len %llu em offset %llu\n",
-			em->start, em->len, em->orig_start, em->block_start, em->block_len,
-			em->offset);
+	ret = read_disk_bytes(fs_info, index->bytenr, &hdr, sizeof(hdr));
+	if (ret)
+		return ret;
 
-	ret = apfs_add_extent_mapping(fs_info, em_tree, &em,
-				      em->start, em->len);
-	BUG_ON(ret);
-	write_unlock(&em_tree->lock);
+	/* we do not care about the fork_data at all */
+	data_offset = apfs_resource_fork_data_offset(&hdr) +
+		sizeof(struct apfs_resource_fork_data);
+	ret = read_disk_bytes(fs_info, index->bytenr + data_offset, &entries,
+			      sizeof(entries));
+	if (ret)
+		return ret;
+	if (apfs_resource_fork_entries_count(&entries) < index->nr_chunks)
+		return -EUCLEAN;
+
+	table = kvmalloc_array(index->nr_chunks, sizeof(*table), GFP_NOFS);
+	if (!table)
+		return -ENOMEM;
 
-	return em;
+	ret = read_disk_bytes(fs_info,
+			      index->bytenr + data_offset + sizeof(entries),
+			      table, index->nr_chunks * sizeof(*table));
+	if (ret)
+		goto out;
 
-out:
-	free_extent_map(em);
-	if (page) {
-		kunmap(page);
-		put_page(page);
+	for (i = 0; i < index->nr_chunks; i++) {
+		index->chunks[i].off = data_offset +
+			apfs_resource_fork_entry_off(&table[i]);
+		index->chunks[i].len = apfs_resource_fork_entry_size(&table[i]);
 	}
-	apfs_err(fs_info,
-		 "failed to map extent inode %llu: %d\n", apfs_ino(inode), ret);
-	return ERR_PTR(ret);
+out:
+	kvfree(table);
+	return ret;
 }
 
 /*
- * This function reads first block size from the extent, parses
- * offset maps and inserts extent maps into inode extent tree
- *
- * TODO: If start is located in first block, cache it.
- *
+ * Return the chunk index of @inode, parsing it from the fork the file extent
+ * item at @path points to if nobody has yet.
  */
-static noinline struct extent_map *
-zlib_extent_item_to_extent_map(struct apfs_inode *inode,
-			       const struct apfs_path *path,
-			       u64 start, u64 len)
-
+static struct apfs_chunk_index *
+apfs_get_chunk_index(struct apfs_inode *inode, const struct apfs_path *path)
 {
 	struct apfs_fs_info *fs_info = inode->root->fs_info;
+	struct apfs_chunk_index *index;
+	struct apfs_chunk_index *old;
 	struct apfs_file_extent_val *fi;
-	u64 bytenr;
+	u64 fork_len;
+	u64 nr_chunks;
+	u32 i;
 	int ret;
-	struct page *page = NULL;
-	u32 nr_ems;
-	struct address_space *mapping = fs_info->device->bdev->bd_inode->i_mapping;
-	struct extent_map *em;
-	struct apfs_key key = { };
-	struct extent_map_tree *em_tree = &inode->extent_tree;
-	struct apfs_resource_fork_header hdr;
-	struct apfs_resource_fork_data fork_data;
-	struct apfs_resource_fork_entries entries;
-	u64 data_offset;
-	u64 disk_bytenr;
-	u32 first_entry_offset;
-	u32 pg_offset;
-	u32 entry_nr;
-	void *kaddr;
-	struct apfs_resource_fork_entry *entry;
 
-	ASSERT(len <= APFS_MAX_UNCOMPRESSED);
-
-	em = alloc_extent_map();
-	if (em == NULL) {
-		ret = -ENOMEM;
-		goto out;
-	}
+	index = smp_load_acquire(&inode->chunk_index);
+	if (index)
+		return index;
 
 	fi = apfs_item_ptr(path->nodes[0], path->slots[0],
 			   struct apfs_file_extent_val);
-	apfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
-
-	ASSERT(key.oid == inode->cid);
-	ASSERT(key.type == APFS_TYPE_FILE_EXTENT);
-	ASSERT(key.offset == 0);
+	fork_len = apfs_file_extent_len(path->nodes[0], fi);
 
-	bytenr = apfs_file_extent_bno(path->nodes[0], fi)
-		<< fs_info->block_size_bits;
+	/*
+	 * i_size can't be trusted to size the table: each chunk takes at least
+	 * a 32 bit offset in the fork, so a fork this long can't hold more.
+	 */
+	nr_chunks = DIV_ROUND_UP_ULL(i_size_read(&inode->vfs_inode),
+				     APFS_MAX_UNCOMPRESSED);
+	if (nr_chunks > U32_MAX - 1 ||
+	    (nr_chunks + 1) * sizeof(__le32) > fork_len)
+		return ERR_PTR(-EUCLEAN);
+
+	index = kvmalloc(struct_size(index, chunks, nr_chunks), GFP_NOFS);
+	if (!index)
+		return ERR_PTR(-ENOMEM);
+
+	index->bytenr = apfs_file_extent_bno(path->nodes[0], fi) <<
+		fs_info->block_size_bits;
+	index->nr_chunks = nr_chunks;
+
+	if (inode->prop_compress == APFS_COMPRESS_ZLIB_RSRC)
+		ret = parse_zlib_chunk_index(fs_info, index);
+	else
+		ret = parse_lzfse_chunk_index(fs_info, index);
 
-	kaddr = apfs_read_cache_page_unaligned(mapping, bytenr, &page);
-	if (IS_ERR(kaddr))  {
-		ret = PTR_ERR(kaddr);
-		goto out;
+	for (i = 0; !ret && i < index->nr_chunks; i++) {
+		if (index->chunks[i].len >= APFS_MAX_UNCOMPRESSED + SZ_4K ||
+		    (u64)index->chunks[i].off + index->chunks[i].len > fork_len)
+			ret = -EUCLEAN;
+	}
+	if (ret) {
+		kvfree(index);
+		return ERR_PTR(ret);
 	}
-	memcpy(&hdr, kaddr, sizeof(hdr));
-
-	data_offset = apfs_resource_fork_data_offset(&hdr);
-
-	/* we do not care about the fork_data at all */
-	data_offset += sizeof(fork_data);
-	bytenr = bytenr + data_offset;
-
-//	if (data_offset >= PAGE_SIZE ||
-//	    data_offset + sizeof(entries) > PAGE_SIZE) {
-		kunmap(page);
-		put_page(page);
-		page = NULL;
-		kaddr = apfs_read_cache_page_unaligned(mapping, bytenr, &page);
-		if (IS_ERR(kaddr))  {
-			ret = PTR_ERR(kaddr);
-			goto out;
-		}
-//	}
-
-	ASSERT(data_offset % PAGE_SIZE + sizeof(entries) <= PAGE_SIZE);
-	memcpy(&entries, kaddr, sizeof(entries));
-
-	kunmap(page);
-	put_page(page);
-	page = NULL;
-
-	nr_ems = apfs_resource_fork_entries_count(&entries);
 
-	first_entry_offset = data_offset + sizeof(entries);
-	entry_nr = DIV_ROUND_DOWN_ULL(start - key.offset, APFS_MAX_UNCOMPRESSED);
+	/* readers may race to parse the same table, the first one wins */
+	old = cmpxchg(&inode->chunk_index, NULL, index);
+	if (old) {
+		kvfree(index);
+		return old;
+	}
+	return index;
+}
 
-	ASSERT(entry_nr < nr_ems);
+void apfs_free_chunk_index(struct apfs_inode *inode)
+{
+	kvfree(inode->chunk_index);
+	inode->chunk_index = NULL;
+}
 
-	disk_bytenr = bytenr + sizeof(struct apfs_resource_fork_entries) +
-		entry_nr * sizeof(*entry);
+/*
+ * Map the chunk of @inode holding file offset @start and insert it into the
+ * inode's extent map tree. @path points to the file extent item of the
+ * fork and may be NULL once the chunk index is parsed.
+ */
+struct extent_map *apfs_chunk_to_extent_map(struct apfs_inode *inode,
+					    const struct apfs_path *path,
+					    u64 start)
+{
+	struct apfs_fs_info *fs_info = inode->root->fs_info;
+	struct extent_map_tree *em_tree = &inode->extent_tree;
+	struct apfs_chunk_index *index;
+	struct extent_map *em;
+	u64 i_size = i_size_read(&inode->vfs_inode);
+	u64 nr = div_u64(start, APFS_MAX_UNCOMPRESSED);
+	int ret;
 
-	page = read_cache_page_gfp(mapping,  disk_bytenr >> PAGE_SHIFT,
-				   GFP_NOFS);
+	if (path)
+		index = apfs_get_chunk_index(inode, path);
+	else
+		index = smp_load_acquire(&inode->chunk_index);
+	if (!index)
+		return NULL;
+	if (IS_ERR(index))
+		return ERR_CAST(index);
 
-	if (IS_ERR(page))  {
-		ret = PTR_ERR(page);
-		goto out;
+	if (nr >= index->nr_chunks) {
+		ret = -EUCLEAN;
+		goto fail;
 	}
 
-	pg_offset = (first_entry_offset + entry_nr * sizeof(*entry)) % PAGE_SIZE;
-
-	entry = kmap(page) + pg_offset;
+	em = alloc_extent_map();
+	if (!em) {
+		ret = -ENOMEM;
+		goto fail;
+	}
 
 	set_bit(EXTENT_FLAG_COMPRESSED, &em->flags);
 	em->compress_type = inode->prop_compress;
-	em->block_len = apfs_resource_fork_entry_size(entry);
-	em->start = key.offset + ALIGN_DOWN(start, APFS_MAX_UNCOMPRESSED);
-	em->orig_start = key.offset + ALIGN_DOWN(start, APFS_MAX_UNCOMPRESSED);
-	em->offset = apfs_resource_fork_entry_off(entry) + data_offset;
-	em->block_start = bytenr + apfs_resource_fork_entry_off(entry);
-
-	kunmap(page);
-	put_page(page);
-	page = NULL;
-
-	if (em->block_len >= APFS_MAX_UNCOMPRESSED + 4096) {
-		apfs_err(fs_info, "invalid extent map em start %llu len %llu orig_start %llu block start %llu block len %llu offset %llu\n",
-			 em->start, em->len, em->orig_start, em->block_start,
-			 em->block_len,
-			 em->offset - data_offset);
-		ret = -EUCLEAN;
-		goto out;
-	 }
-
+	em->start = nr * APFS_MAX_UNCOMPRESSED;
+	em->orig_start = em->start;
+	em->offset = index->chunks[nr].off;
+	em->block_start = index->bytenr + index->chunks[nr].off;
+	em->block_len = index->chunks[nr].len;
 	/* do not forget the last em */
-	if (em->orig_start == ALIGN_DOWN(i_size_read(&inode->vfs_inode), APFS_MAX_UNCOMPRESSED))
-	    em->len = i_size_read(&inode->vfs_inode) %  APFS_MAX_UNCOMPRESSED;
-	else
-		em->len = APFS_MAX_COMPRESSED;
+	em->len = min_t(u64, i_size - em->start, APFS_MAX_UNCOMPRESSED);
 
-	write_lock(&em_tree->lock);
-
-	trace_printk("add extent map em start %llu len %llu orig_start %llu block start %llu block len %llu offset %llu\n",
-		     em->start, em->len, em->orig_start, em->block_start,
-		     em->block_len, em->offset - data_offset);
+	trace_apfs_map_compressed_extent(inode, em);
 
-	ret = apfs_add_extent_mapping(fs_info, em_tree, &em,
-				      em->start, em->len);
-	BUG_ON(ret);
+	write_lock(&em_tree->lock);
+	ret = apfs_add_extent_mapping(fs_info, em_tree, &em, em->start,
+				      em->len);
 	write_unlock(&em_tree->lock);
+	if (ret) {
+		free_extent_map(em);
+		goto fail;
+	}
 
 	return em;
-
-out:
-	free_extent_map(em);
-	trace_printk("failed to map extent inode %llu: %d\n", apfs_ino(inode), ret);
+fail:
+	apfs_err_rl(fs_info, "failed to map chunk %llu of inode %llu: %d",
+		    nr, apfs_ino(inode), ret);
 	return ERR_PTR(ret);
 }
 
@@ -1510,12 +1502,9 @@ dstream_extent_item_to_extent_map(struct apfs_inode *inode,
 		goto out;
 	 }
 
-	write_lock(&em_tree->lock);
-
-	trace_printk("add extent map em start %llu len %llu orig_start %llu block start %llu block len %llu offset %llu\n",
-		     em->start, em->len, em->orig_start, em->block_start,
-		     em->block_len, em->offset - data_offset);
+	trace_apfs_map_compressed_extent(inode, em);
 
+	write_lock(&em_tree->lock);
 	ret = apfs_add_extent_mapping(fs_info, em_tree, &em,
 				      em->start, em->len);
 	BUG_ON(ret);
@@ -1525,7 +1514,8 @@ dstream_extent_item_to_extent_map(struct apfs_inode *inode,
 
 out:
 	free_extent_map(em);
-	trace_printk("failed to map extent inode %llu: %d\n", apfs_ino(inode), ret);
+	apfs_err_rl(fs_info, "failed to map extent inode %llu: %d",
+		    apfs_ino(inode), ret);
 	return ERR_PTR(ret);
 }
 
@@ -1545,10 +1535,9 @@ apfs_compressed_extent_item_to_extent_map(struct apfs_inode *inode,
 
 	switch (type) {
 	case APFS_COMPRESS_ZLIB_RSRC:
-		return zlib_extent_item_to_extent_map(inode, path, start, len);
 	case APFS_COMPRESS_LZFSE_RSRC:
 	case APFS_COMPRESS_LZVN_RSRC:
-		return lzfse_extent_item_to_extent_map(inode, path, start, len);
+		return apfs_chunk_to_extent_map(inode, path, start);
 	default:
 			BUG();
 	}
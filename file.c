@@ -2000,6 +2000,8 @@ int apfs_release_file(struct inode *inode, struct file *filp)
 
 	if (private && private->filldir_buf)
 		kfree(private->filldir_buf);
+	if (private)
+		apfs_free_path(private->readdir_path);
 	kfree(private);
 	filp->private_data = NULL;
 
@@ -0,0 +1,353 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include <linux/preempt.h>
+#include <asm/simd.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+#include "fletcher.h"
+
+/*
+ * Every metadata block and every checkpoint object is checksummed with
+ * fletcher64, so on cold tree walks the checksum is a visible share of cpu.
+ *
+ * The sums are plain u64 additions, so they can be split into lanes: lane k
+ * of an L lane implementation sums words k, k + L, k + 2L, ... into a[k], and
+ * the running sum of a[k] into b[k].  For n words (a multiple of L) that
+ * gives
+ *
+ *   sum1 = sum(a[k])
+ *   sum2 = sum((n - i) * w[i]) = L * sum(b[k]) - sum(k * a[k])
+ *
+ * which is exact modulo 2^64, just like the scalar loop.
+ *
+ * Like raid6, the fastest implementation valid on this cpu is picked at
+ * module load by a short benchmark.
+ */
+
+#define APFS_FLETCHER_BENCH_SIZE	SZ_4K
+#define APFS_FLETCHER_TIME_JIFFIES_LG2	2
+
+static void fletcher64_combine(const u64 *a, const u64 *b, unsigned int lanes,
+			       u64 *sum1, u64 *sum2)
+{
+	u64 s1 = 0;
+	u64 s2 = 0;
+	u64 skew = 0;
+	unsigned int k;
+
+	for (k = 0; k < lanes; k++) {
+		s1 += a[k];
+		s2 += b[k];
+		skew += k * a[k];
+	}
+	*sum1 = s1;
+	*sum2 = lanes * s2 - skew;
+}
+
+static void fletcher64_scalar_blocks(const __le32 *p, size_t nwords,
+				     u64 *sum1, u64 *sum2)
+{
+	u64 s1 = 0;
+	u64 s2 = 0;
+	size_t i;
+
+	for (i = 0; i < nwords; i++) {
+		s1 += le32_to_cpu(p[i]);
+		s2 += s1;
+	}
+	*sum1 = s1;
+	*sum2 = s2;
+}
+
+static bool fletcher64_always_valid(void)
+{
+	return true;
+}
+
+static const struct apfs_fletcher64_ops apfs_fletcher64_scalar = {
+	.name = "scalar",
+	.valid = fletcher64_always_valid,
+	.blocks = fletcher64_scalar_blocks,
+	.stride = 1,
+};
+
+/*
+ * Four independent lanes in plain C.  This breaks the sum1 -> sum2
+ * dependency chain on any cpu, and is the shape a compiler vectorizes where
+ * vector registers are allowed.
+ */
+static void fletcher64_lanes4_blocks(const __le32 *p, size_t nwords,
+				     u64 *sum1, u64 *sum2)
+{
+	u64 a[4] = {};
+	u64 b[4] = {};
+	size_t i;
+
+	for (i = 0; i < nwords; i += 4) {
+		a[0] += le32_to_cpu(p[i]);
+		a[1] += le32_to_cpu(p[i + 1]);
+		a[2] += le32_to_cpu(p[i + 2]);
+		a[3] += le32_to_cpu(p[i + 3]);
+		b[0] += a[0];
+		b[1] += a[1];
+		b[2] += a[2];
+		b[3] += a[3];
+	}
+	fletcher64_combine(a, b, 4, sum1, sum2);
+}
+
+static const struct apfs_fletcher64_ops apfs_fletcher64_lanes4 = {
+	.name = "lanes4",
+	.valid = fletcher64_always_valid,
+	.blocks = fletcher64_lanes4_blocks,
+	.stride = 4,
+};
+
+#ifdef CONFIG_X86_64
+
+static bool fletcher64_sse2_valid(void)
+{
+	return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+/*
+ * Four lanes in two xmm registers: xmm0/xmm2 hold a/b of words 0-1, xmm1/xmm3
+ * of words 2-3.  xmm7 stays zero for widening the words to u64.
+ */
+static void fletcher64_sse2_blocks(const __le32 *p, size_t nwords,
+				   u64 *sum1, u64 *sum2)
+{
+	u64 a[4];
+	u64 b[4];
+	size_t i;
+
+	kernel_fpu_begin();
+
+	asm volatile("pxor %xmm0,%xmm0");
+	asm volatile("pxor %xmm1,%xmm1");
+	asm volatile("pxor %xmm2,%xmm2");
+	asm volatile("pxor %xmm3,%xmm3");
+	asm volatile("pxor %xmm7,%xmm7");
+
+	for (i = 0; i < nwords; i += 4) {
+		asm volatile("movdqu %0,%%xmm4"
+			     : : "m" (*(const u8 (*)[16])(p + i)));
+		asm volatile("movdqa %xmm4,%xmm5");
+		asm volatile("punpckldq %xmm7,%xmm4");
+		asm volatile("punpckhdq %xmm7,%xmm5");
+		asm volatile("paddq %xmm4,%xmm0");
+		asm volatile("paddq %xmm5,%xmm1");
+		asm volatile("paddq %xmm0,%xmm2");
+		asm volatile("paddq %xmm1,%xmm3");
+	}
+
+	asm volatile("movdqu %%xmm0,%0" : "=m" (*(u8 (*)[16])&a[0]));
+	asm volatile("movdqu %%xmm1,%0" : "=m" (*(u8 (*)[16])&a[2]));
+	asm volatile("movdqu %%xmm2,%0" : "=m" (*(u8 (*)[16])&b[0]));
+	asm volatile("movdqu %%xmm3,%0" : "=m" (*(u8 (*)[16])&b[2]));
+
+	kernel_fpu_end();
+
+	fletcher64_combine(a, b, 4, sum1, sum2);
+}
+
+static const struct apfs_fletcher64_ops apfs_fletcher64_sse2 = {
+	.name = "sse2",
+	.valid = fletcher64_sse2_valid,
+	.blocks = fletcher64_sse2_blocks,
+	.stride = 4,
+	.simd = true,
+};
+
+static bool fletcher64_avx2_valid(void)
+{
+	return boot_cpu_has(X86_FEATURE_AVX2) && boot_cpu_has(X86_FEATURE_AVX);
+}
+
+/*
+ * Eight lanes in two ymm registers: ymm0/ymm2 hold a/b of words 0-3,
+ * ymm1/ymm3 of words 4-7.  vpmovzxdq widens the words on load.
+ */
+static void fletcher64_avx2_blocks(const __le32 *p, size_t nwords,
+				   u64 *sum1, u64 *sum2)
+{
+	u64 a[8];
+	u64 b[8];
+	size_t i;
+
+	kernel_fpu_begin();
+
+	asm volatile("vpxor %ymm0,%ymm0,%ymm0");
+	asm volatile("vpxor %ymm1,%ymm1,%ymm1");
+	asm volatile("vpxor %ymm2,%ymm2,%ymm2");
+	asm volatile("vpxor %ymm3,%ymm3,%ymm3");
+
+	for (i = 0; i < nwords; i += 8) {
+		asm volatile("vpmovzxdq %0,%%ymm4"
+			     : : "m" (*(const u8 (*)[16])(p + i)));
+		asm volatile("vpmovzxdq %0,%%ymm5"
+			     : : "m" (*(const u8 (*)[16])(p + i + 4)));
+		asm volatile("vpaddq %ymm4,%ymm0,%ymm0");
+		asm volatile("vpaddq %ymm5,%ymm1,%ymm1");
+		asm volatile("vpaddq %ymm0,%ymm2,%ymm2");
+		asm volatile("vpaddq %ymm1,%ymm3,%ymm3");
+	}
+
+	asm volatile("vmovdqu %%ymm0,%0" : "=m" (*(u8 (*)[32])&a[0]));
+	asm volatile("vmovdqu %%ymm1,%0" : "=m" (*(u8 (*)[32])&a[4]));
+	asm volatile("vmovdqu %%ymm2,%0" : "=m" (*(u8 (*)[32])&b[0]));
+	asm volatile("vmovdqu %%ymm3,%0" : "=m" (*(u8 (*)[32])&b[4]));
+
+	kernel_fpu_end();
+
+	fletcher64_combine(a, b, 8, sum1, sum2);
+}
+
+static const struct apfs_fletcher64_ops apfs_fletcher64_avx2 = {
+	.name = "avx2",
+	.valid = fletcher64_avx2_valid,
+	.blocks = fletcher64_avx2_blocks,
+	.stride = 8,
+	.simd = true,
+};
+
+#endif /* CONFIG_X86_64 */
+
+const struct apfs_fletcher64_ops *const apfs_fletcher64_algos[] = {
+#ifdef CONFIG_X86_64
+	&apfs_fletcher64_avx2,
+	&apfs_fletcher64_sse2,
+#endif
+	&apfs_fletcher64_lanes4,
+	&apfs_fletcher64_scalar,
+	NULL
+};
+
+static const struct apfs_fletcher64_ops *fletcher64_ops __read_mostly =
+	&apfs_fletcher64_scalar;
+
+/*
+ * Note that this is not a generic implementation of fletcher64, as it assumes
+ * a message length that doesn't overflow sum1 and sum2.  This constraint is ok
+ * for apfs, though, since the block size is limited to 2^16.  For a more
+ * generic optimized implementation, see Nakassis (1988).
+ */
+u64 apfs_fletcher64_ops_sum(const struct apfs_fletcher64_ops *ops,
+			    const void *addr, size_t len)
+{
+	const __le32 *buff = addr;
+	size_t nwords = len / sizeof(u32);
+	size_t nvec;
+	size_t i;
+	u64 sum1 = 0;
+	u64 sum2 = 0;
+	u64 c1, c2;
+
+	/* vector registers are off limits in some contexts, e.g. hardirq */
+	if (ops->simd && !may_use_simd())
+		ops = &apfs_fletcher64_scalar;
+
+	nvec = rounddown(nwords, ops->stride);
+	if (nvec)
+		ops->blocks(buff, nvec, &sum1, &sum2);
+	for (i = nvec; i < nwords; i++) {
+		sum1 += le32_to_cpu(buff[i]);
+		sum2 += sum1;
+	}
+
+	c1 = sum1 + sum2;
+	c1 = 0xFFFFFFFF - c1 % (u64)0xFFFFFFFF;
+	c2 = sum1 + c1;
+	c2 = 0xFFFFFFFF - c2 % (u64)0xFFFFFFFF;
+
+	return (c2 << 32) | c1;
+}
+
+u64 apfs_fletcher64(const void *addr, size_t len)
+{
+	return apfs_fletcher64_ops_sum(fletcher64_ops, addr, len);
+}
+
+const struct apfs_fletcher64_ops *apfs_fletcher64_active(void)
+{
+	return fletcher64_ops;
+}
+
+/*
+ * Check @ops against the scalar loop on @buf, on the full buffer and on a
+ * length that leaves a tail for every stride.
+ */
+static bool fletcher64_check(const struct apfs_fletcher64_ops *ops,
+			     const void *buf, size_t len)
+{
+	size_t odd = len - 3 * sizeof(u32);
+
+	return apfs_fletcher64_ops_sum(ops, buf, len) ==
+	       apfs_fletcher64_ops_sum(&apfs_fletcher64_scalar, buf, len) &&
+	       apfs_fletcher64_ops_sum(ops, buf, odd) ==
+	       apfs_fletcher64_ops_sum(&apfs_fletcher64_scalar, buf, odd);
+}
+
+void __init apfs_fletcher64_init(void)
+{
+	const struct apfs_fletcher64_ops *const *algo;
+	const struct apfs_fletcher64_ops *best = NULL;
+	unsigned long best_perf = 0;
+	unsigned long j0, j1;
+	void *buf;
+
+	buf = kmalloc(APFS_FLETCHER_BENCH_SIZE, GFP_KERNEL);
+	if (!buf) {
+		pr_warn("APFS: fletcher64: no memory for benchmark, using %s\n",
+			fletcher64_ops->name);
+		return;
+	}
+	get_random_bytes(buf, APFS_FLETCHER_BENCH_SIZE);
+
+	for (algo = apfs_fletcher64_algos; *algo; algo++) {
+		unsigned long perf = 0;
+
+		if (!(*algo)->valid())
+			continue;
+		if (!fletcher64_check(*algo, buf, APFS_FLETCHER_BENCH_SIZE)) {
+			pr_warn("APFS: fletcher64: %s gives wrong results, skipped\n",
+				(*algo)->name);
+			continue;
+		}
+
+		preempt_disable();
+		j0 = jiffies;
+		while ((j1 = jiffies) == j0)
+			cpu_relax();
+		while (time_before(jiffies,
+				   j1 + (1 << APFS_FLETCHER_TIME_JIFFIES_LG2))) {
+			apfs_fletcher64_ops_sum(*algo, buf,
+						APFS_FLETCHER_BENCH_SIZE);
+			perf++;
+		}
+		preempt_enable();
+
+		pr_debug("APFS: fletcher64: %-8s %5lu MB/s\n", (*algo)->name,
+			 (perf * APFS_FLETCHER_BENCH_SIZE * HZ) >>
+			 (20 + APFS_FLETCHER_TIME_JIFFIES_LG2));
+		if (!best || perf > best_perf) {
+			best = *algo;
+			best_perf = perf;
+		}
+	}
+
+	if (best) {
+		fletcher64_ops = best;
+		pr_info("APFS: fletcher64: using %s (%lu MB/s)\n", best->name,
+			(best_perf * APFS_FLETCHER_BENCH_SIZE * HZ) >>
+			(20 + APFS_FLETCHER_TIME_JIFFIES_LG2));
+	}
+	kfree(buf);
+}
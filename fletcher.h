@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef APFS_FLETCHER_H
+#define APFS_FLETCHER_H
+
+#include <linux/init.h>
+#include <linux/types.h>
+
+/*
+ * One fletcher64 implementation.
+ *
+ * @blocks sums @nwords little endian 32bit words starting at @p into @sum1
+ * and @sum2 (which start at zero).  @nwords is always a multiple of @stride,
+ * the caller takes care of the tail.
+ */
+struct apfs_fletcher64_ops {
+	const char *name;
+	bool (*valid)(void);
+	void (*blocks)(const __le32 *p, size_t nwords, u64 *sum1, u64 *sum2);
+	unsigned int stride;
+	/* @blocks uses FPU/vector registers, not usable from every context */
+	bool simd;
+};
+
+/* NULL terminated, in order of preference */
+extern const struct apfs_fletcher64_ops *const apfs_fletcher64_algos[];
+
+u64 apfs_fletcher64_ops_sum(const struct apfs_fletcher64_ops *ops,
+			    const void *addr, size_t len);
+u64 apfs_fletcher64(const void *addr, size_t len);
+const struct apfs_fletcher64_ops *apfs_fletcher64_active(void);
+void __init apfs_fletcher64_init(void);
+
+#endif
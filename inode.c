@@ -3536,6 +3536,7 @@ static noinline int inode_has_posix_acl(struct apfs_root *root, u64 ino,
 	key.oid = ino;
 	key.type = APFS_TYPE_XATTR;
 	key.name = XATTR_NAME_POSIX_ACL_ACCESS;
+	key.namelen = sizeof(XATTR_NAME_POSIX_ACL_ACCESS);
 
 	ret = apfs_search_slot(NULL, root, &key, path, 0, 0);
 	if (ret < 0)
@@ -3544,6 +3545,7 @@ static noinline int inode_has_posix_acl(struct apfs_root *root, u64 ino,
 		goto out;
 
 	key.name = XATTR_NAME_POSIX_ACL_DEFAULT;
+	key.namelen = sizeof(XATTR_NAME_POSIX_ACL_DEFAULT);
 
 	apfs_release_path(path);
 	ret = apfs_search_slot(NULL, root, &key, path, 0, 0);
@@ -3559,8 +3561,6 @@ static u64 apfs_inode_dstream_size(struct extent_buffer *eb, int slot)
 	struct apfs_dstream_item *di;
 	unsigned long offset;
 
-	trace_printk("inode eb %llu slot %d slot has dstream size %d?\n",
-		     eb->start, slot, apfs_item_has_xfields_nr(eb, slot));
 	if (!apfs_item_has_xfields_nr(eb, slot))
 		return 0;
 
@@ -3568,15 +3568,12 @@ static u64 apfs_inode_dstream_size(struct extent_buffer *eb, int slot)
 	xb = apfs_item_offset_ptr(eb, offset, struct apfs_xfield_blob);
 
 	ax = apfs_find_xfield(eb, xb, APFS_EXT_DSTREAM, 0, &offset);
-	trace_printk("node %llu slot %d xb %lu inode dstream size:", eb->start, slot,
-	       offset);
 	if (PTR_ERR(ax) == -ENOENT)
 		return 0;
 	if(IS_ERR(ax) || apfs_xfield_size(eb, ax) < sizeof(*di))
 		BUG();
 
 	di = (struct apfs_dstream_item *)((char *)xb + offset);
-	trace_printk("offset: %lu, %llu\n", offset, apfs_dstream_size(eb, di));
 	return apfs_dstream_size(eb, di);
 }
 
@@ -5484,14 +5481,10 @@ static int apfs_inode_by_name(struct inode *dir, struct dentry *dentry,
 	const char *name = dentry->d_name.name;
 	int namelen = dentry->d_name.len;
 	struct apfs_drec_item *di;
-	struct apfs_path *path;
+	APFS_DEFINE_PATH(path);
 	struct apfs_root *root = APFS_I(dir)->root;
 	int ret = 0;
 
-	path = apfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
 	di = apfs_lookup_dir_rec(NULL, root, path, apfs_ino(APFS_I(dir)),
 				 name, namelen, 0);
 	if (IS_ERR_OR_NULL(di)) {
@@ -5505,7 +5498,7 @@ static int apfs_inode_by_name(struct inode *dir, struct dentry *dentry,
 
 	*type = apfs_drec_type(path->nodes[0], di);
 out:
-	apfs_free_path(path);
+	apfs_release_path(path);
 	return ret;
 }
 
@@ -5623,7 +5616,6 @@ struct inode *apfs_iget_path(struct super_block *s, u64 ino,
 {
 	struct inode *inode;
 
-	trace_printk("iget path %llu\n", ino);
 	inode = apfs_iget_locked(s, ino, root);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
@@ -5633,7 +5625,6 @@ struct inode *apfs_iget_path(struct super_block *s, u64 ino,
 
 		ret = apfs_read_locked_inode(inode);
 		if (!ret) {
-			trace_printk("inode tree add %llu\n", ino);
 			inode_tree_add(inode);
 			unlock_new_inode(inode);
 		} else {
@@ -5747,8 +5738,10 @@ static int apfs_dentry_delete(const struct dentry *dentry)
 static struct dentry *apfs_lookup(struct inode *dir, struct dentry *dentry,
 				   unsigned int flags)
 {
+	u64 start_ns = ktime_get_ns();
 	struct inode *inode = apfs_lookup_dentry(dir, dentry);
 
+	apfs_lat_record(apfs_sb(dir->i_sb), APFS_LAT_LOOKUP, start_ns);
 	if (inode == ERR_PTR(-ENOENT))
 		inode = NULL;
 	return d_splice_alias(inode, dentry);
@@ -5793,9 +5786,6 @@ static int apfs_filldir(void *addr, int entries, struct dir_context *ctx)
 		char *name = (char *)(entry + 1);
 
 		ctx->pos = get_unaligned(&entry->offset);
-		trace_printk("fill ino %llu %.*s dir %lld\n",
-			     get_unaligned(&entry->ino),
-			     get_unaligned(&entry->name_len), name, ctx->pos);
 		if (!dir_emit(ctx, name, get_unaligned(&entry->name_len),
 					 get_unaligned(&entry->ino),
 					 get_unaligned(&entry->type)))
@@ -5807,6 +5797,29 @@ static int apfs_filldir(void *addr, int entries, struct dir_context *ctx)
 	return 0;
 }
 
+/*
+ * Move the readdir cursor saved at offset @cursor_pos back to offset @pos.
+ * Only steps within the cursor's leaf. Returns true if the cursor now points
+ * at a record of directory @dir.
+ */
+static bool apfs_readdir_cursor_seek(struct apfs_path *path, u64 dir,
+				     loff_t cursor_pos, loff_t pos)
+{
+	struct apfs_key key = {};
+	struct extent_buffer *leaf = path->nodes[0];
+	loff_t back = cursor_pos - pos;
+
+	if (!leaf || back < 0 || back > path->slots[0])
+		return false;
+
+	path->slots[0] -= back;
+	if (path->slots[0] >= apfs_header_nritems(leaf))
+		return false;
+
+	apfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+	return key.oid == dir && key.type == APFS_TYPE_DIR_REC;
+}
+
 /*
  * There is not something like DIR_IDNEX in apfs. So we have to record total
  * dir record number.
@@ -5831,8 +5844,10 @@ static int apfs_real_readdir(struct file *file, struct dir_context *ctx)
 	int entries = 0;
 	int total_len = 0;
 	loff_t index;
+	bool resume;
 	loff_t pos;
 	char *name = NULL;
+	u64 start_ns;
 
 	if (!dir_emit_dots(file, ctx))
 		return 0;
@@ -5844,9 +5859,19 @@ static int apfs_real_readdir(struct file *file, struct dir_context *ctx)
 	if (index >= apfs_root_info_key_count(root->node, root_info))
 		return 0;
 
+	start_ns = ktime_get_ns();
 	name = kmalloc(APFS_NAME_LEN, GFP_NOFS);
 
-	path = apfs_alloc_path();
+	/* a cursor left where the previous call stopped saves the rescan */
+	path = private->readdir_path;
+	private->readdir_path = NULL;
+	resume = path && apfs_readdir_cursor_seek(path,
+				apfs_ino(APFS_I(inode)), private->readdir_pos,
+				ctx->pos);
+	if (!resume) {
+		apfs_free_path(path);
+		path = apfs_alloc_path();
+	}
 	if (!path || !name) {
 		kfree(name);
 		apfs_free_path(path);
@@ -5855,6 +5880,9 @@ static int apfs_real_readdir(struct file *file, struct dir_context *ctx)
 
 	addr = private->filldir_buf;
 	path->reada = READA_FORWARD;
+	/* readonly mount, the path holds no locks while we fill */
+	path->skip_locking = 1;
+	path->finger = 1;
 
 	INIT_LIST_HEAD(&ins_list);
 	INIT_LIST_HEAD(&del_list);
@@ -5863,6 +5891,11 @@ static int apfs_real_readdir(struct file *file, struct dir_context *ctx)
 	key.type = APFS_TYPE_DIR_REC;
 	key.offset = 0;
 
+	if (resume) {
+		index = 0;
+		goto loop;
+	}
+
 again:
 	key.name = name;
 
@@ -5870,6 +5903,7 @@ again:
 	if (ret < 0)
 		goto err;
 
+loop:
 	while (1) {
 		struct dir_entry *entry;
 		struct apfs_key dkey = {};
@@ -5914,7 +5948,7 @@ again:
 
 		if ((total_len + sizeof(struct dir_entry) + name_len) >=
 		    PAGE_SIZE) {
-			apfs_release_path(path);
+			/* the search below resumes in this leaf via the finger */
 			ret = apfs_filldir(private->filldir_buf, entries, ctx);
 			if (ret)
 				goto nopos;
@@ -5925,6 +5959,8 @@ again:
 
 			key.objectid = dkey.objectid;
 			key.offset = dkey.offset;
+			key.namelen = dkey.namelen;
+			key.hash = dkey.hash;
 			strncpy(name, dkey.name, APFS_NAME_LEN);
 			key.name = name;
 			goto again;
@@ -5936,13 +5972,15 @@ again:
 		memcpy(name_ptr, dkey.name, name_len);
 		put_unaligned(apfs_drec_type(leaf, di), &entry->type);
 		put_unaligned(apfs_drec_ino(leaf, di), &entry->ino);
+		trace_apfs_readdir_entry(inode, pos, apfs_drec_ino(leaf, di),
+					 apfs_drec_type(leaf, di), name_ptr,
+					 name_len);
 		put_unaligned(pos++, &entry->offset);
 		entries++;
 		addr += sizeof(struct dir_entry) + name_len;
 		total_len += sizeof(struct dir_entry) + name_len;
 		path->slots[0]++;
 	}
-	apfs_release_path(path);
 
 	ret = apfs_filldir(private->filldir_buf, entries, ctx);
 	if (ret)
@@ -5973,9 +6011,14 @@ again:
 
 nopos:
 	ret = 0;
+	/* path points at the entry of offset pos */
+	private->readdir_path = path;
+	private->readdir_pos = pos;
+	path = NULL;
 err:
 	kfree(name);
 	apfs_free_path(path);
+	apfs_lat_record(root->fs_info, APFS_LAT_READDIR, start_ns);
 	return ret;
 }
 
@@ -6722,10 +6765,13 @@ static noinline int uncompress_inline(struct apfs_path *path,
 	unsigned long ptr;
 	int compress_type;
 	size_t max_size;
-	u8 *cdata;
+	u64 start_ns = 0;
 
 	WARN_ON(pg_offset != 0);
 
+	if (trace_apfs_decompress_inline_enabled())
+		start_ns = ktime_get_ns();
+
 	ptr = (unsigned long)xi + sizeof(*xi);
 	hdr = apfs_item_offset_ptr(path->nodes[0], ptr,
 				   struct apfs_compress_header);
@@ -6741,11 +6787,12 @@ static noinline int uncompress_inline(struct apfs_path *path,
 	ptr = (unsigned long)hdr + sizeof(*hdr);
 	read_extent_buffer(leaf, tmp, ptr, compressed_size);
 
-	cdata = tmp;
-	trace_printk("cdata 0x%x\n", *cdata);
 	max_size = min_t(unsigned long, PAGE_SIZE, uncompressed_size);
 	ret = apfs_decompress(compress_type, tmp, page,
 			      extent_offset, compressed_size, max_size);
+	trace_apfs_decompress_inline(page->mapping->host, extent_offset,
+				     compress_type, compressed_size, max_size,
+				     ret, start_ns);
 
 	/*
 	 * decompression code contains a memset to fill in any space between the end
@@ -6789,7 +6836,7 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	struct extent_io_tree *io_tree = &inode->io_tree;
 	int ret = 0;
 	u64 extent_end = 0;
-	struct apfs_path *path = NULL;
+	APFS_DEFINE_PATH(path);
 	struct apfs_root *root = inode->root;
 	struct extent_buffer *leaf;
 	struct extent_map *em = NULL;
@@ -6803,19 +6850,19 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	size_t size;
 	unsigned long offset;
 
-	trace_printk("get extent inlined %llu start %llu len%llu\n", apfs_ino(inode),
-		start, len);
 	read_lock(&em_tree->lock);
 	em = lookup_extent_mapping(em_tree, start, len);
 	read_unlock(&em_tree->lock);
 
 	if (em) {
-		if (em->start > start || em->start + em->len <= start)
+		if (em->start > start || em->start + em->len <= start) {
 			free_extent_map(em);
-		else if (em->block_start == EXTENT_MAP_INLINE && page)
+		} else if (em->block_start == EXTENT_MAP_INLINE && page) {
 			free_extent_map(em);
-		else
+		} else {
+			apfs_stat_inc(inode->root->fs_info, APFS_STAT_EM_HITS);
 			goto out;
+		}
 	}
 
 	em = alloc_extent_map();
@@ -6828,12 +6875,6 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	em->len = (u64)-1;
 	em->block_len = (u64)-1;
 
-	path = apfs_alloc_path();
-	if (!path) {
-		ret = -ENOMEM;
-		goto out;
-	}
-
 	/* Chances are we'll be called again, so go ahead and do readahead */
 	path->reada = READA_FORWARD;
 
@@ -6847,8 +6888,6 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 		goto out;
 	}
 
-	trace_printk("get xattr item eb %llu slot %d\n", path->nodes[0]->start,
-	       path->slots[0]);
 	leaf = path->nodes[0];
 	len = apfs_xattr_item_len(leaf, xi);
 	if (!apfs_xattr_data_embedded(leaf, xi) ||
@@ -6897,16 +6936,13 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	ptr = offset;
 
 	if (!PageUptodate(page)) {
+		apfs_stat_inc(fs_info, APFS_STAT_INLINE_READS);
 		if (em->compress_type != APFS_COMPRESS_PLAIN_ATTR) {
-			trace_printk("get %llu extent compressed type %d inline data pg_offset %lu\n",
-			       apfs_ino(inode), em->compress_type, pg_offset);
 			ret = uncompress_inline(path, page, pg_offset,
 						extent_offset, xi);
 			if (ret)
 				goto out;
 		} else {
-			trace_printk("get %llu extent inline data %llu %lu pg_offset %lu\n",
-			       apfs_ino(inode), leaf->start, ptr, pg_offset);
 			map = kmap_local_page(page);
 			read_extent_buffer(leaf, map + pg_offset, ptr,
 					   copy_size);
@@ -6922,8 +6958,6 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	set_extent_uptodate(io_tree, em->start,
 			    extent_map_end(em) - 1, NULL, GFP_NOFS);
 
-	trace_printk("get inlined extent start %llu len %llu at bytenr %llu\n",
-		     start, extent_end, em->block_start);
 	ret = 0;
 	if (em->start > start || extent_map_end(em) <= start) {
 		apfs_err(fs_info,
@@ -6937,14 +6971,12 @@ apfs_get_extent_inlined(struct apfs_inode *inode,
 	ret = apfs_add_extent_mapping(fs_info, em_tree, &em, start, len);
 	write_unlock(&em_tree->lock);
 out:
-	apfs_free_path(path);
+	apfs_release_path(path);
 
 	trace_apfs_get_extent(root, inode, em);
 
 	if (ret) {
 		free_extent_map(em);
-		trace_printk("failed to get extent map start %llu %llu\n",
-			start, len);
 		return ERR_PTR(ret);
 	}
 	return em;
@@ -6968,6 +7000,44 @@ out:
  *
  * Return: ERR_PTR on error, non-NULL extent_map on success.
  */
+static struct apfs_path *apfs_get_extent_cursor(struct apfs_inode *inode)
+{
+	struct apfs_path *path;
+
+	path = xchg(&inode->extent_cursor, NULL);
+	if (path)
+		return path;
+
+	path = apfs_alloc_path();
+	if (!path)
+		return NULL;
+	/* readonly mount, nobody modifies the tree under the cursor */
+	path->skip_locking = 1;
+	path->finger = 1;
+	return path;
+}
+
+/*
+ * A parked cursor holds references on its leaf and index nodes, so
+ * evict_extent_buffers() can't reclaim them until the inode is evicted.
+ * Don't park one while the extent buffer cache is over its budget.
+ */
+static void apfs_put_extent_cursor(struct apfs_inode *inode,
+				   struct apfs_path *path)
+{
+	struct apfs_fs_info *eb_fs = apfs_eb_owner(inode->root->fs_info);
+	u64 limit = READ_ONCE(eb_fs->eb_cache_limit);
+
+	if (!path)
+		return;
+	if (limit && READ_ONCE(eb_fs->eb_lru_bytes) > limit) {
+		apfs_free_path(path);
+		return;
+	}
+	path = cmpxchg(&inode->extent_cursor, NULL, path);
+	apfs_free_path(path);
+}
+
 static struct extent_map *
 apfs_get_extent_regular(struct apfs_inode *inode, struct page *page, size_t pg_offset,
 			  u64 start, u64 len)
@@ -6988,12 +7058,14 @@ apfs_get_extent_regular(struct apfs_inode *inode, struct page *page, size_t pg_o
 	read_unlock(&em_tree->lock);
 
 	if (em) {
-		if (em->start > start || em->start + em->len <= start)
+		if (em->start > start || em->start + em->len <= start) {
 			free_extent_map(em);
-		else if (em->block_start == EXTENT_MAP_INLINE && page)
+		} else if (em->block_start == EXTENT_MAP_INLINE && page) {
 			free_extent_map(em);
-		else
+		} else {
+			apfs_stat_inc(inode->root->fs_info, APFS_STAT_EM_HITS);
 			goto out;
+		}
 	}
 
 	em = alloc_extent_map();
@@ -7006,7 +7078,7 @@ apfs_get_extent_regular(struct apfs_inode *inode, struct page *page, size_t pg_o
 	em->len = (u64)-1;
 	em->block_len = (u64)-1;
 
-	path = apfs_alloc_path();
+	path = apfs_get_extent_cursor(inode);
 	if (!path) {
 		ret = -ENOMEM;
 		goto out;
@@ -7090,7 +7162,6 @@ not_found:
 	em->block_start = EXTENT_MAP_HOLE;
 insert:
 	ret = 0;
-	apfs_release_path(path);
 	if (em->start > start || extent_map_end(em) <= start) {
 		apfs_err(fs_info,
 			  "bad extent! em: [%llu %llu] passed [%llu %llu]",
@@ -7104,13 +7175,14 @@ insert:
 	write_unlock(&em_tree->lock);
 
 out:
-	apfs_free_path(path);
+	if (ret)
+		apfs_free_path(path);
+	else
+		apfs_put_extent_cursor(inode, path);
 	trace_apfs_get_extent(root, inode, em);
 
 	if (ret) {
 		free_extent_map(em);
-		trace_printk("failed to get extent map start %llu %llu\n",
-			     start, len);
 		return ERR_PTR(ret);
 	}
 	return em;
@@ -7141,7 +7213,7 @@ apfs_get_compressed_extent(struct apfs_inode *inode, struct page *page,
 {
 	int ret = 0;
 	u64 objectid = apfs_ino(inode);
-	struct apfs_path *path = NULL;
+	APFS_DEFINE_PATH(path);
 	struct apfs_root *root = inode->root;
 	struct extent_map *em = NULL;
 	struct extent_map_tree *em_tree = &inode->extent_tree;
@@ -7151,18 +7223,26 @@ apfs_get_compressed_extent(struct apfs_inode *inode, struct page *page,
 	read_unlock(&em_tree->lock);
 
 	if (em) {
-		if (em->start > start || em->start + em->len <= start)
+		if (em->start > start || em->start + em->len <= start) {
 			free_extent_map(em);
-		else if (em->block_start == EXTENT_MAP_INLINE && page)
+		} else if (em->block_start == EXTENT_MAP_INLINE && page) {
 			free_extent_map(em);
-		else
+		} else {
+			apfs_stat_inc(inode->root->fs_info, APFS_STAT_EM_HITS);
 			goto out;
+		}
 	}
 
-	path = apfs_alloc_path();
-	if (!path) {
-		ret = -ENOMEM;
-		goto out;
+	/* once the chunk table is parsed, no search is needed */
+	if (!apfs_inode_data_in_dstream(inode)) {
+		em = apfs_chunk_to_extent_map(inode, NULL, start);
+		if (IS_ERR(em)) {
+			ret = PTR_ERR(em);
+			em = NULL;
+			goto out;
+		}
+		if (em)
+			goto out;
 	}
 
 	objectid = inode->cid;
@@ -7183,17 +7263,16 @@ apfs_get_compressed_extent(struct apfs_inode *inode, struct page *page,
 							start, len);
 	if (IS_ERR(em)) {
 		ret = PTR_ERR(em);
+		em = NULL;
 		goto out;
 	}
 
 	ret = 0;
 out:
-	apfs_free_path(path);
+	apfs_release_path(path);
 	trace_apfs_get_extent(root, inode, em);
 
 	if (ret) {
-		trace_printk("failed to get extent map start %llu %llu\n",
-			     start, len);
 		em = ERR_PTR(ret);
 	}
 	return em;
@@ -8379,6 +8458,7 @@ int apfs_readpage(struct file *file, struct page *page)
 	u64 start = page_offset(page);
 	u64 end = start + PAGE_SIZE - 1;
 	struct apfs_bio_ctrl bio_ctrl = { 0 };
+	u64 start_ns = ktime_get_ns();
 	int ret;
 
 	apfs_lock_and_flush_ordered_range(inode, start, end, NULL);
@@ -8386,6 +8466,7 @@ int apfs_readpage(struct file *file, struct page *page)
 	ret = apfs_do_readpage(page, NULL, &bio_ctrl, 0, NULL);
 	if (bio_ctrl.bio)
 		ret = submit_one_bio(bio_ctrl.bio, 0, bio_ctrl.bio_flags);
+	apfs_lat_record(inode->root->fs_info, APFS_LAT_READPAGE, start_ns);
 	return ret;
 }
 
@@ -8422,7 +8503,28 @@ static int apfs_writepages(struct address_space *mapping,
 
 static void apfs_readahead(struct readahead_control *rac)
 {
+	struct inode *inode = rac->mapping->host;
+	u64 start_ns = ktime_get_ns();
+
+	/*
+	 * A compressed chunk is decoded as a whole, cover whole chunks so one
+	 * read of the chunk serves all of its pages.
+	 */
+	if (apfs_inode_is_compressed(APFS_I(inode))) {
+		loff_t isize = round_up(i_size_read(inode), PAGE_SIZE);
+		loff_t start = round_down(readahead_pos(rac),
+					  APFS_MAX_UNCOMPRESSED);
+		loff_t end = round_up(readahead_pos(rac) +
+				      readahead_length(rac),
+				      APFS_MAX_UNCOMPRESSED);
+
+		end = min(end, isize);
+		if (end > start)
+			readahead_expand(rac, start, end - start);
+	}
+
 	extent_readahead(rac);
+	apfs_lat_record(apfs_sb(inode->i_sb), APFS_LAT_READPAGE, start_ns);
 }
 
 static int __apfs_releasepage(struct page *page, gfp_t gfp_flags)
@@ -9008,6 +9110,8 @@ struct inode *apfs_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	ei->root = NULL;
+	ei->extent_cursor = NULL;
+	ei->chunk_index = NULL;
 	ei->generation = 0;
 	ei->last_trans = 0;
 	ei->last_sub_trans = 0;
@@ -9087,6 +9191,10 @@ void apfs_destroy_inode(struct inode *vfs_inode)
 	WARN_ON(inode->csum_bytes);
 	WARN_ON(inode->defrag_bytes);
 
+	apfs_free_path(inode->extent_cursor);
+	inode->extent_cursor = NULL;
+	apfs_free_chunk_index(inode);
+
 	/*
 	 * This can happen where we create an inode, but somebody else also
 	 * created the same inode and we need to destroy the one we already
@@ -9114,7 +9222,6 @@ void apfs_destroy_inode(struct inode *vfs_inode)
 	//apfs_drop_extent_cache(inode, 0, (u64)-1, 0);
 	//apfs_inode_clear_file_extent_range(inode, 0, (u64)-1);
 	apfs_put_root(inode->root);
-	trace_printk("apfs destroy inode %lu\n", vfs_inode->i_ino);
 }
 
 int apfs_drop_inode(struct inode *inode)
@@ -9143,6 +9250,7 @@ void __cold apfs_destroy_cachep(void)
 	rcu_barrier();
 	kmem_cache_destroy(apfs_inode_cachep);
 	kmem_cache_destroy(apfs_trans_handle_cachep);
+	apfs_path_pool_drain();
 	kmem_cache_destroy(apfs_path_cachep);
 	kmem_cache_destroy(apfs_free_space_cachep);
 	kmem_cache_destroy(apfs_free_space_bitmap_cachep);
@@ -9936,7 +10044,7 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 {
 	struct apfs_root *root = APFS_I(inode)->root;
 	struct apfs_key key = {};
-	struct apfs_path *path = NULL;
+	APFS_DEFINE_PATH(path);
 	struct apfs_xattr_item *xi;
 	u16 namelen;
 	char *name;
@@ -9944,15 +10052,11 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 
 	if (!dentry)
 		return ERR_PTR(-ECHILD);
-	path = apfs_alloc_path();
-	if (!path) {
-		ret = -ENOMEM;
-		goto fail;
-	}
 
 	key.oid = apfs_ino(APFS_I(inode));
 	key.type = APFS_TYPE_XATTR;
 	key.name = APFS_SYMLINK_EA_NAME;
+	key.namelen = sizeof(APFS_SYMLINK_EA_NAME);
 
 	ret = apfs_search_slot(NULL, root, &key, path, 0, 0);
 	if (ret > 0)
@@ -9980,12 +10084,12 @@ static const char *apfs_get_link(struct dentry *dentry, struct inode *inode,
 	read_extent_buffer(path->nodes[0], name,
 			   (unsigned long)xi + sizeof(*xi), namelen - 1);
 	name[namelen - 1] = 0;
-	apfs_free_path(path);
+	apfs_release_path(path);
 	set_delayed_call(callback, kfree_link, name);
 
 	return name;
 fail:
-	apfs_free_path(path);
+	apfs_release_path(path);
 	return ERR_PTR(ret);
 }
 
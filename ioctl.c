@@ -3680,24 +3680,20 @@ static long apfs_ioctl_scrub(struct file *file, void __user *arg)
 	if (IS_ERR(sa))
 		return PTR_ERR(sa);
 
-	if (!(sa->flags & APFS_SCRUB_READONLY)) {
-		ret = mnt_want_write_file(file);
-		if (ret)
-			goto out;
-	}
-
-	ret = apfs_scrub_dev(fs_info, sa->devid, sa->start, sa->end,
-			      &sa->progress, sa->flags & APFS_SCRUB_READONLY,
-			      0);
+	/*
+	 * Volumes are readonly and scrub only verifies metadata, it never
+	 * repairs: APFS_SCRUB_READONLY is implied and devid is ignored.
+	 */
+	ret = apfs_scrub_metadata(fs_info, sa->start, sa->end, &sa->progress);
 
 	/*
-	 * Copy scrub args to user space even if apfs_scrub_dev() returned an
-	 * error. This is important as it allows user space to know how much
+	 * Copy scrub args to user space even if apfs_scrub_metadata() returned
+	 * an error. This is important as it allows user space to know how much
 	 * progress scrub has done. For example, if scrub is canceled we get
-	 * -ECANCELED from apfs_scrub_dev() and return that error back to user
-	 * space. Later user space can inspect the progress from the structure
-	 * apfs_ioctl_scrub_args and resume scrub from where it left off
-	 * previously (apfs-progs does this).
+	 * -ECANCELED from apfs_scrub_metadata() and return that error back to
+	 * user space. Later user space can inspect the progress from the
+	 * structure apfs_ioctl_scrub_args and resume scrub from where it left
+	 * off previously (apfs-progs does this).
 	 * If we fail to copy the apfs_ioctl_scrub_args structure to user space
 	 * then return -EFAULT to signal the structure was not copied or it may
 	 * be corrupt and unreliable due to a partial copy.
@@ -3705,9 +3701,6 @@ static long apfs_ioctl_scrub(struct file *file, void __user *arg)
 	if (copy_to_user(arg, sa, sizeof(*sa)))
 		ret = -EFAULT;
 
-	if (!(sa->flags & APFS_SCRUB_READONLY))
-		mnt_drop_write_file(file);
-out:
 	kfree(sa);
 	return ret;
 }
@@ -3733,7 +3726,7 @@ static long apfs_ioctl_scrub_progress(struct apfs_fs_info *fs_info,
 	if (IS_ERR(sa))
 		return PTR_ERR(sa);
 
-	ret = apfs_scrub_progress(fs_info, sa->devid, &sa->progress);
+	ret = apfs_scrub_metadata_progress(fs_info, &sa->progress);
 
 	if (ret == 0 && copy_to_user(arg, sa, sizeof(*sa)))
 		ret = -EFAULT;
@@ -4874,6 +4867,18 @@ static int _apfs_ioctl_send(struct file *file, void __user *argp, bool compat)
 long apfs_ioctl(struct file *file, unsigned int
 		cmd, unsigned long arg)
 {
+	struct apfs_fs_info *fs_info = apfs_sb(file_inode(file)->i_sb);
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case APFS_IOC_SCRUB:
+		return apfs_ioctl_scrub(file, argp);
+	case APFS_IOC_SCRUB_CANCEL:
+		return apfs_ioctl_scrub_cancel(fs_info);
+	case APFS_IOC_SCRUB_PROGRESS:
+		return apfs_ioctl_scrub_progress(fs_info, argp);
+	}
+
 	return -ENOTTY;
 }
 
@@ -53,7 +53,6 @@ struct list_head *lzfse_get_workspace(unsigned int level)
 	struct workspace *workspace = list_entry(ws, struct workspace, list);
 
 	workspace->level = level;
-	trace_printk("lzfse get workspace %p\n", ws);
 
 	return ws;
 }
@@ -103,7 +102,6 @@ struct list_head *lzfse_alloc_workspace(unsigned int level)
 	workspace->scratch_size = workspacesize;
 	INIT_LIST_HEAD(&workspace->list);
 
-	trace_printk("lzfse alloc workspace %p\n", workspace);
 	return &workspace->list;
 fail:
 	lzfse_free_workspace(&workspace->list);
@@ -130,13 +128,21 @@ int lzfse_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 	struct bio *orig_bio = cb->orig_bio;
 	void *compressed_buf = workspace->compressed_buf;
 	void *uncompressed_buf = workspace->decompressed_buf;
+	const u8 *src = compressed_buf;
+	struct apfs_chunk_map map;
+	void *mapped_in;
 	int i;
 	u64 copied;
 	u64 extent_offset = cb->offset;
-	u8 *cdata;
-	u64 prev_offset = 0;
 	u32 pg_offset = extent_offset % PAGE_SIZE;
 
+	/* read the compressed data in place if the pages can be mapped */
+	mapped_in = apfs_map_compressed_pages(cb);
+	if (mapped_in) {
+		src = mapped_in + pg_offset;
+		goto decode;
+	}
+
 	copied = 0;
 	for (i = 0; i < total_pages_in; i++) {
 		u32 len = PAGE_SIZE;
@@ -175,35 +181,47 @@ int lzfse_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 
 	ASSERT(copied == srclen);
 
-	cdata = compressed_buf;
+decode:
+	/* a bio covering the whole chunk is decoded into in place */
+	if (apfs_map_chunk_bio(cb, &map)) {
+		total_out = lzfse_decode_buffer(map.addr,
+				(size_t)map.nr_pages << PAGE_SHIFT,
+				src, srclen, workspace->scratch);
+		if (!apfs_unmap_chunk_bio(cb, &map, total_out))
+			goto out;
+	}
+
+	/* decode straight into the chunk cache's buffer if it wants the chunk */
+	if (cb->chunk)
+		uncompressed_buf = cb->chunk->data;
 
 	total_out = lzfse_decode_buffer(uncompressed_buf, APFS_MAX_UNCOMPRESSED,
-				       compressed_buf, srclen, workspace->scratch);
+				       src, srclen, workspace->scratch);
 	if (total_out == 0 || total_out > APFS_MAX_UNCOMPRESSED) {
 		pr_info("APFS: lzfse decompressed bio failed,total out %lu cb start %llu compressed len %lu",
 			total_out, cb->start, srclen);
-		return -EIO;
+		ret = -EIO;
+		goto out;
 	}
 
-	trace_printk("srclen %zu copied %llu cdata 0x%x out size %lu\n",
-	       srclen, copied, *cdata, total_out);
-
 	ret = apfs_decompress_buf2page(uncompressed_buf, 0, total_out,
 				       disk_start, orig_bio);
 	if (ret < 0) {
-		trace_printk("APFS: lzfse failed to copy data to page total out %lu cb start %llu compressed len %lu prev_offset %llu offset %llu  orig_start %llu len\n",
-			total_out, cb->start, srclen,
-			prev_offset,
-			page_offset(bio_iter_iovec(orig_bio, orig_bio->bi_iter).bv_page),
-			disk_start);
-
-		return -EIO;
+		pr_info("APFS: lzfse failed to copy data to page, total out %lu cb start %llu compressed len %lu",
+			total_out, cb->start, srclen);
+		ret = -EIO;
+		goto out;
 	}
+	ret = 0;
 	zero_fill_bio(orig_bio);
-
-	pr_info("APFS: finish lzfse decompressed bio, cb start %llu compressed len %lu",
-		cb->start, srclen);
-	return 0;
+	apfs_fill_chunk_pages(cb->inode, disk_start, uncompressed_buf,
+			      total_out);
+	if (cb->chunk)
+		cb->chunk->len = total_out;
+out:
+	if (mapped_in)
+		apfs_unmap_compressed_pages(cb, mapped_in);
+	return ret;
 }
 
 int
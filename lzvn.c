@@ -47,7 +47,6 @@ struct list_head *lzvn_get_workspace(unsigned int level)
 	struct workspace *workspace = list_entry(ws, struct workspace, list);
 
 	workspace->level = level;
-	trace_printk("lzvn get workspace %p\n", ws);
 
 	return ws;
 }
@@ -123,13 +122,21 @@ int lzvn_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 	struct bio *orig_bio = cb->orig_bio;
 	void *compressed_buf = workspace->compressed_buf;
 	void *uncompressed_buf = workspace->decompressed_buf;
+	struct apfs_chunk_map map;
+	void *mapped_in;
 	int i;
 	u64 copied;
 	u64 extent_offset = cb->offset;
-	u8 *cdata;
-	u64 prev_offset = 0;
+	u8 *cdata = compressed_buf;
 	u32 pg_offset = extent_offset % PAGE_SIZE;
 
+	/* read the compressed data in place if the pages can be mapped */
+	mapped_in = apfs_map_compressed_pages(cb);
+	if (mapped_in) {
+		cdata = mapped_in + pg_offset;
+		goto decode;
+	}
+
 	copied = 0;
 	for (i = 0; i < total_pages_in; i++) {
 		u32 len = PAGE_SIZE;
@@ -162,48 +169,68 @@ int lzvn_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 		kunmap(pages_in[i]);
 	}
 
-	if (copied != srclen) {
-		trace_printk("APFS: ERROR cb->start %llu compressed len %zu offset %llu copied %llu nr_pages %d",
-			     cb->start, srclen, extent_offset, copied,
-			     cb->nr_pages);
-	}
-
 	ASSERT(copied == srclen);
 
-	cdata = compressed_buf;
+decode:
+	/* a bio covering the whole chunk is decoded into in place */
+	if (apfs_map_chunk_bio(cb, &map)) {
+		size_t dst_size = (size_t)map.nr_pages << PAGE_SHIFT;
+
+		if (*cdata == 0x06) {
+			total_out = min_t(size_t, srclen - 1, dst_size);
+			memcpy(map.addr, cdata + 1, total_out);
+		} else {
+			total_out = lzvn_decode_buffer(map.addr, dst_size,
+						       cdata, srclen,
+						       workspace->scratch);
+		}
+		if (!apfs_unmap_chunk_bio(cb, &map, total_out))
+			goto out;
+	}
+
 	/* uncompressed data */
 	if (*cdata == 0x06) {
-		total_out = APFS_MAX_UNCOMPRESSED;
+		total_out = min_t(size_t, srclen - 1, APFS_MAX_UNCOMPRESSED);
 		uncompressed_buf = cdata + 1;
+		if (cb->chunk) {
+			memcpy(cb->chunk->data, uncompressed_buf, total_out);
+			uncompressed_buf = cb->chunk->data;
+		}
 		goto buf2page;
 	}
 
+	/* decode straight into the chunk cache's buffer if it wants the chunk */
+	if (cb->chunk)
+		uncompressed_buf = cb->chunk->data;
+
 	total_out = lzvn_decode_buffer(uncompressed_buf, APFS_MAX_UNCOMPRESSED,
-				       compressed_buf, srclen, workspace->scratch);
+				       cdata, srclen, workspace->scratch);
 	if (total_out == 0 || total_out > APFS_MAX_UNCOMPRESSED) {
 		pr_info("APFS: lzvn decompressed bio failed,total out %lu cb start %llu compressed len %lu",
 			total_out, cb->start, srclen);
-		trace_printk("APFS: ERROR cb->start %llu compressed len %zu offset %llu copied %llu nr_pages %d cdata 0x%x",
-			     cb->start, srclen, extent_offset, copied,
-			     cb->nr_pages, *(u8 *)compressed_buf);
-		return -EIO;
+		ret = -EIO;
+		goto out;
 	}
 
 buf2page:
 	ret = apfs_decompress_buf2page(uncompressed_buf, 0, total_out,
 				       disk_start, orig_bio);
 	if (ret < 0) {
-		trace_printk("APFS: lzvn failed to copy data to page total out %lu cb start %llu compressed len %lu prev_offset %llu offset %llu  orig_start %llu len\n",
-			total_out, cb->start, srclen,
-			prev_offset,
-			page_offset(bio_iter_iovec(orig_bio, orig_bio->bi_iter).bv_page),
-			disk_start);
-
-		return -EIO;
+		pr_info("APFS: lzvn failed to copy data to page, total out %lu cb start %llu compressed len %lu",
+			total_out, cb->start, srclen);
+		ret = -EIO;
+		goto out;
 	}
+	ret = 0;
 	zero_fill_bio(orig_bio);
-
-	return 0;
+	apfs_fill_chunk_pages(cb->inode, disk_start, uncompressed_buf,
+			      total_out);
+	if (cb->chunk)
+		cb->chunk->len = total_out;
+out:
+	if (mapped_in)
+		apfs_unmap_compressed_pages(cb, mapped_in);
+	return ret;
 }
 
 int
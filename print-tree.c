@@ -65,9 +65,9 @@ void print_fskey_type(u8 type)
 	};
 
 	if (key_to_str[type])
-		trace_printk(KERN_CONT "%s", key_to_str[type]);
+		pr_cont("%s", key_to_str[type]);
 	else
-		trace_printk(KERN_CONT "UNKNOWN.%d", type);
+		pr_cont("UNKNOWN.%d", type);
 }
 
 void apfs_print_key(const struct extent_buffer *eb, const struct apfs_key *key)
@@ -76,35 +76,35 @@ void apfs_print_key(const struct extent_buffer *eb, const struct apfs_key *key)
 	bool is_extref = apfs_header_subtype(eb) == APFS_OBJ_TYPE_REFTREE;
 	bool sensitive = false;
 
-	trace_printk(KERN_CONT"key (%llu", key->id);
+	pr_cont("key (%llu", key->id);
 	if (is_fs) {
-		trace_printk(KERN_CONT"[%llu %u] ", (u64)key->oid, key->type);
+		pr_cont("[%llu %u] ", (u64)key->oid, key->type);
 		print_fskey_type(key->type);
 		sensitive = !apfs_is_normalization_insensitive(eb->fs_info->__super_copy);
 	} else if (is_extref) {
-		trace_printk(KERN_CONT"[%llu %u] ", key->oid * eb->fs_info->block_size,
+		pr_cont("[%llu %u] ", key->oid * eb->fs_info->block_size,
 		       key->type);
 	} else {
-		trace_printk(KERN_CONT"%u", key->type);
+		pr_cont("%u", key->type);
 	}
 
-	trace_printk(KERN_CONT" %llu", key->offset);
+	pr_cont(" %llu", key->offset);
 
 	if (!is_fs || !key->namelen) {
-		trace_printk(KERN_CONT")");
+		pr_cont(")");
 		return;
 	}
 
 	if (!sensitive)
-		trace_printk(KERN_CONT"[hash %d namelen %u]", key->hash, key->namelen);
+		pr_cont("[hash %d namelen %u]", key->hash, key->namelen);
 	else
-		trace_printk(KERN_CONT"[namelen %u]", key->namelen);
+		pr_cont("[namelen %u]", key->namelen);
 
 	if (key->name) {
-		trace_printk(KERN_CONT" %s", key->name);
+		pr_cont(" %s", key->name);
 	}
 
-	trace_printk(KERN_CONT")");
+	pr_cont(")");
 }
 
 static void print_chunk(struct extent_buffer *eb, struct apfs_chunk *chunk)
@@ -304,7 +304,7 @@ void apfs_print_leaf(struct extent_buffer *l)
 		apfs_item_key_to_cpu(l, &key, i);
 
 		type = key.type;
-		trace_printk(KERN_CONT "\titem %d ", i);
+		pr_cont("\titem %d ", i);
 
 		apfs_print_key(l, &key);
 		pr_info(KERN_CONT " itemoff %d itemsize %d\n",
@@ -437,16 +437,15 @@ void apfs_print_leaf(struct extent_buffer *l)
 	}
 }
 
-void apfs_print_tree(struct extent_buffer *c, bool follow)
+void apfs_print_tree(struct apfs_fs_info *fs_info, struct extent_buffer *c,
+		     bool follow)
 {
-	struct apfs_fs_info *fs_info;
 	int i; u32 nr;
 	struct apfs_key key = {};
 	int level;
 
 	if (!c)
 		return;
-	fs_info = c->fs_info;
 	nr = apfs_header_nritems(c);
 	level = apfs_header_level(c);
 
@@ -463,7 +462,7 @@ void apfs_print_tree(struct extent_buffer *c, bool follow)
 		apfs_node_key_to_cpu(c, &key, i);
 		pr_info("\tkey %d (%llu %u %llu) block %llu gen %llu\n",
 		       i, key.objectid, key.type, key.offset,
-		       apfs_node_blockptr(c, i),
+		       apfs_node_child_bytenr(fs_info, c, i),
 		       apfs_node_ptr_generation(c, i));
 	}
 	if (!follow)
@@ -473,7 +472,8 @@ void apfs_print_tree(struct extent_buffer *c, bool follow)
 		struct extent_buffer *next;
 
 		apfs_node_key_to_cpu(c, &first_key, i);
-		next = read_tree_block(fs_info, apfs_node_blockptr(c, i),
+		next = read_tree_block(fs_info,
+				       apfs_node_child_bytenr(fs_info, c, i),
 				       apfs_header_owner(c),
 				       apfs_node_ptr_generation(c, i),
 				       level - 1, &first_key);
@@ -490,7 +490,7 @@ void apfs_print_tree(struct extent_buffer *c, bool follow)
 		if (apfs_header_level(next) !=
 		       level - 1)
 			BUG();
-		apfs_print_tree(next, follow);
+		apfs_print_tree(fs_info, next, follow);
 		free_extent_buffer(next);
 	}
 }
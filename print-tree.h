@@ -10,7 +10,8 @@
 #define APFS_ROOT_NAME_BUF_LEN				48
 
 void apfs_print_leaf(struct extent_buffer *l);
-void apfs_print_tree(struct extent_buffer *c, bool follow);
+void apfs_print_tree(struct apfs_fs_info *fs_info, struct extent_buffer *c,
+		     bool follow);
 const char *apfs_root_name(const struct apfs_key *key, char *buf);
 void apfs_print_key(const struct extent_buffer *eb,
 		    const struct apfs_key *key);
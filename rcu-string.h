@@ -30,13 +30,13 @@ static inline void rcu_string_free(struct rcu_string *str)
 
 #define printk_in_rcu(fmt, ...) do {	\
 	rcu_read_lock();		\
-	trace_printk(fmt, __VA_ARGS__);	\
+	printk(fmt, __VA_ARGS__);	\
 	rcu_read_unlock();		\
 } while (0)
 
 #define printk_ratelimited_in_rcu(fmt, ...) do {	\
 	rcu_read_lock();				\
-	trace_printk_ratelimited(fmt, __VA_ARGS__);		\
+	printk_ratelimited(fmt, __VA_ARGS__);	\
 	rcu_read_unlock();				\
 } while (0)
 
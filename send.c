@@ -6696,7 +6696,8 @@ out:
 	return ret;
 }
 
-static int tree_move_down(struct apfs_path *path, int *level, u64 reada_min_gen)
+static int tree_move_down(struct apfs_fs_info *fs_info, struct apfs_path *path,
+			  int *level, u64 reada_min_gen)
 {
 	struct extent_buffer *eb;
 	struct extent_buffer *parent = path->nodes[*level];
@@ -6720,7 +6721,7 @@ static int tree_move_down(struct apfs_path *path, int *level, u64 reada_min_gen)
 
 	for (slot++; slot < nritems && reada_done < reada_max; slot++) {
 		if (apfs_node_ptr_generation(parent, slot) > reada_min_gen) {
-			apfs_readahead_node_child(parent, slot);
+			apfs_readahead_node_child(fs_info, parent, slot);
 			reada_done += eb->fs_info->nodesize;
 		}
 	}
@@ -6761,7 +6762,7 @@ static int tree_move_next_or_upnext(struct apfs_path *path,
  * Returns 1 if it had to move up and next. 0 is returned if it moved only next
  * or down.
  */
-static int tree_advance(struct apfs_path *path,
+static int tree_advance(struct apfs_fs_info *fs_info, struct apfs_path *path,
 			int *level, int root_level,
 			int allow_down,
 			struct apfs_key *key,
@@ -6772,7 +6773,7 @@ static int tree_advance(struct apfs_path *path,
 	if (*level == 0 || !allow_down) {
 		ret = tree_move_next_or_upnext(path, level, root_level);
 	} else {
-		ret = tree_move_down(path, level, reada_min_gen);
+		ret = tree_move_down(fs_info, path, level, reada_min_gen);
 	}
 	if (ret >= 0) {
 		if (*level == 0)
@@ -6955,7 +6956,7 @@ static int apfs_compare_trees(struct apfs_root *left_root,
 	while (1) {
 		cond_resched();
 		if (advance_left && !left_end_reached) {
-			ret = tree_advance(left_path, &left_level,
+			ret = tree_advance(fs_info, left_path, &left_level,
 					left_root_level,
 					advance_left != ADVANCE_ONLY_NEXT,
 					&left_key, reada_min_gen);
@@ -6966,7 +6967,7 @@ static int apfs_compare_trees(struct apfs_root *left_root,
 			advance_left = 0;
 		}
 		if (advance_right && !right_end_reached) {
-			ret = tree_advance(right_path, &right_level,
+			ret = tree_advance(fs_info, right_path, &right_level,
 					right_root_level,
 					advance_right != ADVANCE_ONLY_NEXT,
 					&right_key, reada_min_gen);
@@ -369,6 +369,8 @@ enum {
 	Opt_subvol_empty,
 	Opt_subvolid,
 	Opt_xid,
+	Opt_warm,
+	Opt_metadata_cache_mb,
 	Opt_thread_pool,
 	Opt_treelog, Opt_notreelog,
 	Opt_user_subvol_rm_allowed,
@@ -404,6 +406,8 @@ static const match_table_t tokens = {
 	{Opt_subvol_empty, "subvol="},
 	{Opt_subvolid, "subvolid=%s"},
 	{Opt_xid, "xid=%s"},
+	{Opt_warm, "warm=%u"},
+	{Opt_metadata_cache_mb, "metadata_cache_mb=%u"},
 
 #ifdef CONFIG_APFS_DEBUG
 	{Opt_fragment_data, "fragment=data"},
@@ -550,6 +554,8 @@ int apfs_parse_options(struct apfs_fs_info *info, char *options,
 		case Opt_subvol:
 		case Opt_subvol_empty:
 		case Opt_subvolid:
+		case Opt_warm:
+		case Opt_metadata_cache_mb:
 		case Opt_device:
 			/*
 			 * These are parsed by apfs_parse_subvol_options or
@@ -1051,13 +1057,16 @@ out:
  * The value is later passed to mount_subvol()
  */
 static int apfs_parse_subvol_options(const char *options, char **subvol_name,
-				     u64 *subvol_objectid, u64 *xid_res)
+				     u64 *subvol_objectid, u64 *xid_res,
+				     u32 *warm_res, u32 *cache_mb_res)
 {
 	substring_t args[MAX_OPT_ARGS];
 	char *opts, *orig, *p;
 	int error = 0;
 	u64 subvolid = (u64)-1;
 	u64 xid = (u64)-1;
+	int warm;
+	int cache_mb;
 
 	if (!options)
 		return 0;
@@ -1092,6 +1101,28 @@ static int apfs_parse_subvol_options(const char *options, char **subvol_name,
 
 			*xid_res = xid;
 			break;
+		case Opt_warm:
+			error = match_int(&args[0], &warm);
+			if (error)
+				goto out;
+			if (warm < 0 || warm >= APFS_MAX_LEVEL) {
+				error = -EINVAL;
+				goto out;
+			}
+
+			*warm_res = warm;
+			break;
+		case Opt_metadata_cache_mb:
+			error = match_int(&args[0], &cache_mb);
+			if (error)
+				goto out;
+			if (cache_mb < 0) {
+				error = -EINVAL;
+				goto out;
+			}
+
+			*cache_mb_res = cache_mb;
+			break;
 		default:
 			break;
 		}
@@ -1314,6 +1345,13 @@ static int apfs_fill_super(struct super_block *sb,
 		return err;
 	}
 
+	/* a missing sysfs directory isn't worth failing the mount */
+	err = apfs_sysfs_add_volume(fs_info);
+	if (err)
+		apfs_warn(fs_info, "failed to add sysfs entries: %d", err);
+
+	apfs_warm_metadata(fs_info);
+
 	inode = apfs_iget(sb, APFS_ROOT_DIR_INO, fs_info->root_root);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
@@ -1392,6 +1430,11 @@ static int apfs_show_options(struct seq_file *seq, struct dentry *dentry)
 	struct apfs_fs_info *info = apfs_sb(dentry->d_sb);
 
 	seq_printf(seq, ",subvolid=%dtest", info->index);
+	if (info->warm_levels)
+		seq_printf(seq, ",warm=%u", info->warm_levels);
+	if (info->metadata_cache_limit)
+		seq_printf(seq, ",metadata_cache_mb=%llu",
+			   info->metadata_cache_limit >> 20);
 
 	return 0;
 }
@@ -1446,8 +1489,11 @@ apfs_mount(struct file_system_type *fs_type,
 	int error = 0;
 	u64 subvol_objectid = -1;
 	u64 xid = 0;
+	u32 warm = 0;
+	u32 cache_mb = 0;
 
-	error = apfs_parse_subvol_options(data, NULL, &subvol_objectid, &xid);
+	error = apfs_parse_subvol_options(data, NULL, &subvol_objectid, &xid,
+					  &warm, &cache_mb);
 	if (error)
 		return ERR_PTR(error);
 
@@ -1479,8 +1525,12 @@ apfs_mount(struct file_system_type *fs_type,
 		goto error_sec_opts;
 	}
 	apfs_init_fs_info(fs_info);
+	/* volumes are only ever mounted readonly */
+	set_bit(APFS_FS_STATE_NO_TRANS, &fs_info->fs_state);
 	fs_info->index = subvol_objectid;
 	fs_info->xid = xid;
+	fs_info->warm_levels = warm;
+	fs_info->metadata_cache_limit = (u64)cache_mb << 20;
 
 	fs_info->super_copy = kzalloc(APFS_SUPER_INFO_SIZE, GFP_KERNEL);
 	fs_info->super_for_commit = kzalloc(APFS_SUPER_INFO_SIZE, GFP_KERNEL);
@@ -1739,6 +1789,11 @@ static int apfs_remount(struct super_block *sb, int *flags, char *data)
 		if (ret)
 			goto restore;
 	} else {
+		if (apfs_fs_no_trans(fs_info)) {
+			apfs_err(fs_info, "Remounting read-write is not supported");
+			ret = -EROFS;
+			goto restore;
+		}
 		if (test_bit(APFS_FS_STATE_ERROR, &fs_info->fs_state)) {
 			apfs_err(fs_info,
 				"Remounting read-write after error is not allowed");
@@ -2185,12 +2240,15 @@ static int __init init_apfs_fs(void)
 	int err;
 
 	apfs_props_init();
+	apfs_fletcher64_init();
 
 	err = apfs_init_sysfs();
 	if (err)
 		return err;
 
-	apfs_init_compress();
+	err = apfs_init_compress();
+	if (err)
+		goto free_sysfs;
 
 	err = apfs_init_cachep();
 	if (err)
@@ -2272,6 +2330,7 @@ free_cachep:
 	apfs_destroy_cachep();
 free_compress:
 	apfs_exit_compress();
+free_sysfs:
 	apfs_exit_sysfs();
 
 	return err;
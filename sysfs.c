@@ -17,6 +17,7 @@
 #include "send.h"
 #include "transaction.h"
 #include "sysfs.h"
+#include "compression.h"
 #include "volumes.h"
 #include "space-info.h"
 #include "block-group.h"
@@ -374,12 +375,36 @@ static ssize_t supported_sectorsizes_show(struct kobject *kobj,
 APFS_ATTR(static_feature, supported_sectorsizes,
 	   supported_sectorsizes_show);
 
+/*
+ * fletcher64 implementations usable on this cpu, the one picked at module
+ * load in brackets
+ */
+static ssize_t fletcher64_impl_show(struct kobject *kobj,
+				    struct kobj_attribute *a, char *buf)
+{
+	const struct apfs_fletcher64_ops *const *algo;
+	const struct apfs_fletcher64_ops *active = apfs_fletcher64_active();
+	ssize_t ret = 0;
+
+	for (algo = apfs_fletcher64_algos; *algo; algo++) {
+		if (!(*algo)->valid())
+			continue;
+		ret += scnprintf(buf + ret, PAGE_SIZE - ret,
+				 (*algo == active ? "%s[%s]" : "%s%s"),
+				 (ret ? " " : ""), (*algo)->name);
+	}
+	ret += scnprintf(buf + ret, PAGE_SIZE - ret, "\n");
+	return ret;
+}
+APFS_ATTR(static_feature, fletcher64_impl, fletcher64_impl_show);
+
 static struct attribute *apfs_supported_static_feature_attrs[] = {
 	APFS_ATTR_PTR(static_feature, rmdir_subvol),
 	APFS_ATTR_PTR(static_feature, supported_checksums),
 	APFS_ATTR_PTR(static_feature, send_stream_version),
 	APFS_ATTR_PTR(static_feature, supported_rescue_options),
 	APFS_ATTR_PTR(static_feature, supported_sectorsizes),
+	APFS_ATTR_PTR(static_feature, fletcher64_impl),
 	NULL
 };
 
@@ -394,6 +419,68 @@ static const struct attribute_group apfs_static_feature_attr_group = {
 	.attrs = apfs_supported_static_feature_attrs,
 };
 
+/*
+ * /sys/fs/apfs/chunk_cache, the decompressed chunk cache all mounts share.
+ * limit_bytes is writable, 0 turns the cache off.
+ */
+#define CHUNK_CACHE_STAT_ATTR(_name, _field)				\
+static ssize_t apfs_chunk_cache_##_name##_show(struct kobject *kobj,	\
+					       struct kobj_attribute *a, \
+					       char *buf)		\
+{									\
+	struct apfs_chunk_cache_stats stats;				\
+									\
+	apfs_chunk_cache_get_stats(&stats);				\
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", stats._field);	\
+}									\
+APFS_ATTR(chunk_cache, _name, apfs_chunk_cache_##_name##_show)
+
+CHUNK_CACHE_STAT_ATTR(total_bytes, bytes);
+CHUNK_CACHE_STAT_ATTR(hits, hits);
+CHUNK_CACHE_STAT_ATTR(misses, misses);
+CHUNK_CACHE_STAT_ATTR(evictions, evictions);
+
+static ssize_t apfs_chunk_cache_limit_bytes_show(struct kobject *kobj,
+						 struct kobj_attribute *a,
+						 char *buf)
+{
+	struct apfs_chunk_cache_stats stats;
+
+	apfs_chunk_cache_get_stats(&stats);
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", stats.limit);
+}
+
+static ssize_t apfs_chunk_cache_limit_bytes_store(struct kobject *kobj,
+						  struct kobj_attribute *a,
+						  const char *buf, size_t len)
+{
+	u64 limit;
+	int ret;
+
+	ret = kstrtou64(buf, 10, &limit);
+	if (ret)
+		return -EINVAL;
+
+	apfs_chunk_cache_set_limit(limit);
+	return len;
+}
+APFS_ATTR_RW(chunk_cache, limit_bytes, apfs_chunk_cache_limit_bytes_show,
+	     apfs_chunk_cache_limit_bytes_store);
+
+static struct attribute *apfs_chunk_cache_attrs[] = {
+	APFS_ATTR_PTR(chunk_cache, total_bytes),
+	APFS_ATTR_PTR(chunk_cache, limit_bytes),
+	APFS_ATTR_PTR(chunk_cache, hits),
+	APFS_ATTR_PTR(chunk_cache, misses),
+	APFS_ATTR_PTR(chunk_cache, evictions),
+	NULL
+};
+
+static const struct attribute_group apfs_chunk_cache_attr_group = {
+	.name = "chunk_cache",
+	.attrs = apfs_chunk_cache_attrs,
+};
+
 #ifdef CONFIG_APFS_DEBUG
 
 /*
@@ -1760,6 +1847,370 @@ failure:
 	return error;
 }
 
+/*
+ * Volumes of a container share the device and have no fs_devices of their
+ * own, so each mounted volume gets a kobject in fs_info instead, named after
+ * the volume uuid plus the xid for snapshot mounts.
+ */
+static inline struct apfs_fs_info *vol_to_fs_info(struct kobject *kobj)
+{
+	return container_of(kobj, struct apfs_fs_info, vol_kobj);
+}
+
+static ssize_t apfs_warm_blocks_show(struct kobject *kobj,
+				      struct kobj_attribute *a, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 vol_to_fs_info(kobj)->warm_blocks);
+}
+APFS_ATTR(volume, warm_blocks, apfs_warm_blocks_show);
+
+static ssize_t apfs_warm_usecs_show(struct kobject *kobj,
+				     struct kobj_attribute *a, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 vol_to_fs_info(kobj)->warm_usecs);
+}
+APFS_ATTR(volume, warm_usecs, apfs_warm_usecs_show);
+
+/* The verified block set belongs to whoever owns the volume's tree blocks */
+static ssize_t apfs_verified_blocks_show(struct kobject *kobj,
+					 struct kobj_attribute *a, char *buf)
+{
+	struct apfs_fs_info *owner = apfs_eb_owner(vol_to_fs_info(kobj));
+
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+			 atomic_long_read(&owner->nr_verified_blocks));
+}
+APFS_ATTR(volume, verified_blocks, apfs_verified_blocks_show);
+
+static ssize_t apfs_verify_always_show(struct kobject *kobj,
+				       struct kobj_attribute *a, char *buf)
+{
+	struct apfs_fs_info *owner = apfs_eb_owner(vol_to_fs_info(kobj));
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n",
+			 test_bit(APFS_FS_VERIFY_ALWAYS, &owner->flags));
+}
+
+/*
+ * Writing 1 makes every tree block read go through checksum and
+ * tree-checker again and drops the verified set, 0 goes back to validating
+ * each block once.
+ */
+static ssize_t apfs_verify_always_store(struct kobject *kobj,
+					struct kobj_attribute *a,
+					const char *buf, size_t len)
+{
+	struct apfs_fs_info *owner = apfs_eb_owner(vol_to_fs_info(kobj));
+	unsigned long knob;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	err = kstrtoul(buf, 10, &knob);
+	if (err)
+		return err;
+	if (knob > 1)
+		return -EINVAL;
+
+	if (knob) {
+		set_bit(APFS_FS_VERIFY_ALWAYS, &owner->flags);
+		apfs_clear_verified_blocks(owner);
+	} else {
+		clear_bit(APFS_FS_VERIFY_ALWAYS, &owner->flags);
+	}
+
+	return len;
+}
+APFS_ATTR_RW(volume, verify_always, apfs_verify_always_show,
+	     apfs_verify_always_store);
+
+/*
+ * /sys/fs/apfs/UUID[-XID]/metadata_cache, the extent buffer cache the
+ * volume's mounts share.
+ */
+static inline struct apfs_fs_info *eb_cache_kobj_to_owner(struct kobject *kobj)
+{
+	return apfs_eb_owner(vol_to_fs_info(kobj->parent));
+}
+
+static ssize_t apfs_eb_cache_bytes_show(struct kobject *kobj,
+					struct kobj_attribute *a, char *buf)
+{
+	struct apfs_fs_info *owner = eb_cache_kobj_to_owner(kobj);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 READ_ONCE(owner->eb_lru_bytes));
+}
+APFS_ATTR(metadata_cache, total_bytes, apfs_eb_cache_bytes_show);
+
+static ssize_t apfs_eb_cache_limit_show(struct kobject *kobj,
+					struct kobj_attribute *a, char *buf)
+{
+	struct apfs_fs_info *owner = eb_cache_kobj_to_owner(kobj);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n",
+			 READ_ONCE(owner->eb_cache_limit));
+}
+APFS_ATTR(metadata_cache, limit_bytes, apfs_eb_cache_limit_show);
+
+#define EB_CACHE_STAT_ATTR(_tree, _idx, _stat)				\
+static ssize_t apfs_eb_cache_##_tree##_##_stat##_show(struct kobject *kobj, \
+					struct kobj_attribute *a,	\
+					char *buf)			\
+{									\
+	struct apfs_fs_info *owner = eb_cache_kobj_to_owner(kobj);	\
+									\
+	return scnprintf(buf, PAGE_SIZE, "%lld\n",			\
+			 atomic64_read(&owner->eb_stats[_idx]._stat));	\
+}									\
+APFS_ATTR(metadata_cache, _tree##_##_stat,				\
+	  apfs_eb_cache_##_tree##_##_stat##_show)
+
+#define EB_CACHE_TREE_ATTRS(_tree, _idx)				\
+	EB_CACHE_STAT_ATTR(_tree, _idx, cached_bytes);			\
+	EB_CACHE_STAT_ATTR(_tree, _idx, hits);				\
+	EB_CACHE_STAT_ATTR(_tree, _idx, misses);			\
+	EB_CACHE_STAT_ATTR(_tree, _idx, evictions)
+
+#define EB_CACHE_TREE_ATTR_PTRS(_tree)					\
+	APFS_ATTR_PTR(metadata_cache, _tree##_cached_bytes),		\
+	APFS_ATTR_PTR(metadata_cache, _tree##_hits),			\
+	APFS_ATTR_PTR(metadata_cache, _tree##_misses),			\
+	APFS_ATTR_PTR(metadata_cache, _tree##_evictions)
+
+EB_CACHE_TREE_ATTRS(omap, APFS_EB_TREE_OMAP);
+EB_CACHE_TREE_ATTRS(fs, APFS_EB_TREE_FS);
+EB_CACHE_TREE_ATTRS(extentref, APFS_EB_TREE_EXTENTREF);
+EB_CACHE_TREE_ATTRS(snap, APFS_EB_TREE_SNAP);
+
+static const struct attribute *apfs_metadata_cache_attrs[] = {
+	APFS_ATTR_PTR(metadata_cache, total_bytes),
+	APFS_ATTR_PTR(metadata_cache, limit_bytes),
+	EB_CACHE_TREE_ATTR_PTRS(omap),
+	EB_CACHE_TREE_ATTR_PTRS(fs),
+	EB_CACHE_TREE_ATTR_PTRS(extentref),
+	EB_CACHE_TREE_ATTR_PTRS(snap),
+	NULL,
+};
+
+static const char * const apfs_stat_names[APFS_NR_STATS] = {
+	[APFS_STAT_META_READS]		= "metadata_reads",
+	[APFS_STAT_META_READ_BYTES]	= "metadata_read_bytes",
+	[APFS_STAT_OMAP_LOOKUPS]	= "omap_lookups",
+	[APFS_STAT_OMAP_HITS]		= "omap_hits",
+	[APFS_STAT_OMAP_LEAF_HITS]	= "omap_leaf_hits",
+	[APFS_STAT_SEARCHES]		= "btree_searches",
+	[APFS_STAT_NODE_VISITS]		= "btree_node_visits",
+	[APFS_STAT_ZLIB_CHUNKS]		= "zlib_chunks",
+	[APFS_STAT_ZLIB_BYTES]		= "zlib_bytes",
+	[APFS_STAT_LZVN_CHUNKS]		= "lzvn_chunks",
+	[APFS_STAT_LZVN_BYTES]		= "lzvn_bytes",
+	[APFS_STAT_LZFSE_CHUNKS]	= "lzfse_chunks",
+	[APFS_STAT_LZFSE_BYTES]		= "lzfse_bytes",
+	[APFS_STAT_INLINE_READS]	= "inline_reads",
+	[APFS_STAT_EM_HITS]		= "extent_map_hits",
+	[APFS_STAT_CHUNK_CACHE_HITS]	= "chunk_cache_hits",
+	[APFS_STAT_CHUNK_CACHE_MISSES]	= "chunk_cache_misses",
+	[APFS_STAT_CHUNK_FILL_PAGES]	= "chunk_fill_pages",
+	[APFS_STAT_ZERO_COPY_CHUNKS]	= "zero_copy_chunks",
+};
+
+/* All counters of the mount, one "<name> <value>" line each */
+static ssize_t apfs_stats_show(struct kobject *kobj,
+			       struct kobj_attribute *a, char *buf)
+{
+	struct apfs_fs_info *fs_info = vol_to_fs_info(kobj);
+	ssize_t len = 0;
+	int stat;
+	int cpu;
+
+	if (!fs_info->stats)
+		return -ENODATA;
+
+	for (stat = 0; stat < APFS_NR_STATS; stat++) {
+		u64 val = 0;
+
+		for_each_possible_cpu(cpu)
+			val += READ_ONCE(per_cpu_ptr(fs_info->stats,
+						     cpu)->counters[stat]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu\n",
+				 apfs_stat_names[stat], val);
+	}
+
+	return len;
+}
+APFS_ATTR(volume, stats, apfs_stats_show);
+
+/*
+ * /sys/fs/apfs/UUID[-XID]/latency, one log2 histogram of this mount per
+ * operation.  Each line is "<low>-<high> <count>" with the bounds in
+ * nanoseconds, empty buckets are skipped.
+ */
+static ssize_t apfs_latency_show(struct apfs_fs_info *fs_info,
+				 enum apfs_lat_op op, char *buf)
+{
+	ssize_t len = 0;
+	int bucket;
+	int cpu;
+
+	if (!fs_info->lat_hist)
+		return -ENODATA;
+
+	for (bucket = 0; bucket < APFS_LAT_NR_BUCKETS; bucket++) {
+		u64 low = bucket ? 1ULL << (bucket - 1) : 0;
+		u64 high = (1ULL << bucket) - 1;
+		u64 count = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct apfs_lat_hist *hist;
+
+			hist = per_cpu_ptr(fs_info->lat_hist, cpu);
+			count += READ_ONCE(hist->buckets[op][bucket]);
+		}
+		if (!count)
+			continue;
+
+		if (bucket == APFS_LAT_NR_BUCKETS - 1)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%llu-inf %llu\n", low, count);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%llu-%llu %llu\n", low, high, count);
+	}
+
+	return len;
+}
+
+#define LATENCY_ATTR(_name, _op)					\
+static ssize_t apfs_latency_##_name##_show(struct kobject *kobj,	\
+					   struct kobj_attribute *a,	\
+					   char *buf)			\
+{									\
+	return apfs_latency_show(vol_to_fs_info(kobj->parent), _op, buf); \
+}									\
+APFS_ATTR(latency, _name, apfs_latency_##_name##_show)
+
+LATENCY_ATTR(lookup, APFS_LAT_LOOKUP);
+LATENCY_ATTR(readdir, APFS_LAT_READDIR);
+LATENCY_ATTR(readpage, APFS_LAT_READPAGE);
+LATENCY_ATTR(omap, APFS_LAT_OMAP);
+LATENCY_ATTR(decompress, APFS_LAT_DECOMPRESS);
+
+static const struct attribute *apfs_latency_attrs[] = {
+	APFS_ATTR_PTR(latency, lookup),
+	APFS_ATTR_PTR(latency, readdir),
+	APFS_ATTR_PTR(latency, readpage),
+	APFS_ATTR_PTR(latency, omap),
+	APFS_ATTR_PTR(latency, decompress),
+	NULL,
+};
+
+static const struct attribute *apfs_volume_attrs[] = {
+	APFS_ATTR_PTR(volume, warm_blocks),
+	APFS_ATTR_PTR(volume, warm_usecs),
+	APFS_ATTR_PTR(volume, verified_blocks),
+	APFS_ATTR_PTR(volume, verify_always),
+	APFS_ATTR_PTR(volume, stats),
+	NULL,
+};
+
+static void apfs_release_vol_kobj(struct kobject *kobj)
+{
+	struct apfs_fs_info *fs_info = vol_to_fs_info(kobj);
+
+	memset(&fs_info->vol_kobj, 0, sizeof(struct kobject));
+	complete(&fs_info->vol_kobj_unregister);
+}
+
+static struct kobj_type apfs_vol_ktype = {
+	.sysfs_ops	= &kobj_sysfs_ops,
+	.release	= apfs_release_vol_kobj,
+};
+
+/*
+ * Creates:
+ *		/sys/fs/apfs/UUID[-XID]
+ *		/sys/fs/apfs/UUID[-XID]/metadata_cache
+ *		/sys/fs/apfs/UUID[-XID]/latency
+ */
+int apfs_sysfs_add_volume(struct apfs_fs_info *fs_info)
+{
+	struct kobject *kobj = &fs_info->vol_kobj;
+	int error;
+
+	init_completion(&fs_info->vol_kobj_unregister);
+	kobj->kset = apfs_kset;
+	if (fs_info->xid)
+		error = kobject_init_and_add(kobj, &apfs_vol_ktype, NULL,
+					     "%pU-%llu", &fs_info->sb->s_uuid,
+					     fs_info->xid);
+	else
+		error = kobject_init_and_add(kobj, &apfs_vol_ktype, NULL,
+					     "%pU", &fs_info->sb->s_uuid);
+	if (error) {
+		kobject_put(kobj);
+		return error;
+	}
+
+	error = sysfs_create_files(kobj, apfs_volume_attrs);
+	if (error)
+		goto failure;
+
+	fs_info->metadata_cache_kobj = kobject_create_and_add("metadata_cache",
+							      kobj);
+	if (!fs_info->metadata_cache_kobj) {
+		error = -ENOMEM;
+		goto failure;
+	}
+	error = sysfs_create_files(fs_info->metadata_cache_kobj,
+				   apfs_metadata_cache_attrs);
+	if (error)
+		goto failure;
+
+	fs_info->latency_kobj = kobject_create_and_add("latency", kobj);
+	if (!fs_info->latency_kobj) {
+		error = -ENOMEM;
+		goto failure;
+	}
+	error = sysfs_create_files(fs_info->latency_kobj, apfs_latency_attrs);
+	if (error)
+		goto failure;
+
+	return 0;
+failure:
+	apfs_sysfs_remove_volume(fs_info);
+	return error;
+}
+
+void apfs_sysfs_remove_volume(struct apfs_fs_info *fs_info)
+{
+	struct kobject *kobj = &fs_info->vol_kobj;
+
+	if (!kobj->state_initialized)
+		return;
+
+	if (fs_info->latency_kobj) {
+		sysfs_remove_files(fs_info->latency_kobj, apfs_latency_attrs);
+		kobject_del(fs_info->latency_kobj);
+		kobject_put(fs_info->latency_kobj);
+		fs_info->latency_kobj = NULL;
+	}
+	if (fs_info->metadata_cache_kobj) {
+		sysfs_remove_files(fs_info->metadata_cache_kobj,
+				   apfs_metadata_cache_attrs);
+		kobject_del(fs_info->metadata_cache_kobj);
+		kobject_put(fs_info->metadata_cache_kobj);
+		fs_info->metadata_cache_kobj = NULL;
+	}
+	sysfs_remove_files(kobj, apfs_volume_attrs);
+	kobject_del(kobj);
+	kobject_put(kobj);
+	wait_for_completion(&fs_info->vol_kobj_unregister);
+}
+
 static inline struct apfs_fs_info *qgroup_kobj_to_fs_info(struct kobject *kobj)
 {
 	return to_fs_info(kobj->parent->parent);
@@ -1962,6 +2413,10 @@ int __init apfs_init_sysfs(void)
 				&apfs_static_feature_attr_group);
 	if (ret)
 		goto out_remove_group;
+	ret = sysfs_create_group(&apfs_kset->kobj,
+				 &apfs_chunk_cache_attr_group);
+	if (ret)
+		goto out_unmerge_group;
 
 #ifdef CONFIG_APFS_DEBUG
 	ret = sysfs_create_group(&apfs_kset->kobj, &apfs_debug_feature_attr_group);
@@ -1971,6 +2426,9 @@ int __init apfs_init_sysfs(void)
 
 	return 0;
 
+out_unmerge_group:
+	sysfs_unmerge_group(&apfs_kset->kobj,
+			    &apfs_static_feature_attr_group);
 out_remove_group:
 	sysfs_remove_group(&apfs_kset->kobj, &apfs_feature_attr_group);
 out2:
@@ -1981,6 +2439,7 @@ out2:
 
 void __cold apfs_exit_sysfs(void)
 {
+	sysfs_remove_group(&apfs_kset->kobj, &apfs_chunk_cache_attr_group);
 	sysfs_unmerge_group(&apfs_kset->kobj,
 			    &apfs_static_feature_attr_group);
 	sysfs_remove_group(&apfs_kset->kobj, &apfs_feature_attr_group);
@@ -29,6 +29,8 @@ int __init apfs_init_sysfs(void);
 void __cold apfs_exit_sysfs(void);
 int apfs_sysfs_add_mounted(struct apfs_fs_info *fs_info);
 void apfs_sysfs_remove_mounted(struct apfs_fs_info *fs_info);
+int apfs_sysfs_add_volume(struct apfs_fs_info *fs_info);
+void apfs_sysfs_remove_volume(struct apfs_fs_info *fs_info);
 void apfs_sysfs_add_block_group_type(struct apfs_block_group *cache);
 int apfs_sysfs_add_space_info_type(struct apfs_fs_info *fs_info,
 				    struct apfs_space_info *space_info);
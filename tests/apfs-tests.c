@@ -73,13 +73,13 @@ static int apfs_init_test_fs(void)
 
 	ret = register_filesystem(&test_type);
 	if (ret) {
-		trace_printk(KERN_ERR "apfs: cannot register test file system\n");
+		printk(KERN_ERR "apfs: cannot register test file system\n");
 		return ret;
 	}
 
 	test_mnt = kern_mount(&test_type);
 	if (IS_ERR(test_mnt)) {
-		trace_printk(KERN_ERR "apfs: cannot mount test file system\n");
+		printk(KERN_ERR "apfs: cannot mount test file system\n");
 		unregister_filesystem(&test_type);
 		return PTR_ERR(test_mnt);
 	}
@@ -293,6 +293,15 @@ int apfs_run_sanity_tests(void)
 				goto out;
 		}
 	}
+	ret = apfs_test_btree_search(PAGE_SIZE, PAGE_SIZE);
+	if (ret)
+		goto out;
+	ret = apfs_test_fletcher64();
+	if (ret)
+		goto out;
+	ret = apfs_test_decompress();
+	if (ret)
+		goto out;
 	ret = apfs_test_extent_map();
 
 out:
@@ -26,6 +26,7 @@ enum {
 };
 
 extern const char *test_error[];
+extern atomic_t apfs_test_path_slab_allocs;
 
 struct apfs_root;
 struct apfs_trans_handle;
@@ -37,6 +38,9 @@ int apfs_test_inodes(u32 sectorsize, u32 nodesize);
 int apfs_test_qgroups(u32 sectorsize, u32 nodesize);
 int apfs_test_free_space_tree(u32 sectorsize, u32 nodesize);
 int apfs_test_extent_map(void);
+int apfs_test_btree_search(u32 sectorsize, u32 nodesize);
+int apfs_test_fletcher64(void);
+int apfs_test_decompress(void);
 struct inode *apfs_new_test_inode(void);
 struct apfs_fs_info *apfs_alloc_dummy_fs_info(u32 nodesize, u32 sectorsize);
 void apfs_free_dummy_fs_info(struct apfs_fs_info *fs_info);
@@ -0,0 +1,529 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include "apfs-tests.h"
+#include "../ctree.h"
+#include "../extent_io.h"
+#include "../disk-io.h"
+#include "../tree-checker.h"
+
+#define NR_TEST_OIDS		30
+#define KEYS_PER_OID		5
+#define NR_TEST_KEYS		(NR_TEST_OIDS * KEYS_PER_OID)
+#define NR_BENCH_ROUNDS		2000
+#define NR_DIR_ENTRIES		100000
+#define TEST_DIR_OID		1024
+
+static const char *xattr_name = "com.apple.test";
+
+/*
+ * Lay out the keys of one fs-tree leaf: for each oid an inode, an xattr, a
+ * file extent and two drecs sharing one hash, so that the name compare
+ * fallback of the packed search is exercised too.
+ */
+static void fill_fs_leaf(void *node, u32 nodesize)
+{
+	struct apfs_node_header *header = node;
+	struct apfs_disk_kv *toc;
+	u16 toc_len = NR_TEST_KEYS * sizeof(*toc);
+	u32 key_start = sizeof(*header) + toc_len;
+	u32 key_off = 0;
+	int nr = 0;
+	int i;
+
+	header->o.subtype = cpu_to_le32(APFS_OBJ_TYPE_FSTREE);
+	header->flags = cpu_to_le16(APFS_NODE_LEAF);
+	header->level = 0;
+	header->nkeys = cpu_to_le32(NR_TEST_KEYS);
+	header->table_space.off = 0;
+	header->table_space.len = cpu_to_le16(toc_len);
+	toc = node + sizeof(*header);
+
+	for (i = 0; i < NR_TEST_OIDS; i++) {
+		u64 oid = 16 + i * 3;
+		int j;
+
+		for (j = 0; j < KEYS_PER_OID; j++) {
+			struct apfs_disk_key *disk = node + key_start + key_off;
+			u16 len = sizeof(disk->id);
+			const char *name = NULL;
+			u8 type;
+
+			switch (j) {
+			case 0:
+				type = APFS_TYPE_INODE;
+				break;
+			case 1:
+				type = APFS_TYPE_XATTR;
+				name = xattr_name;
+				disk->namelen1 = cpu_to_le16(strlen(name) + 1);
+				len += sizeof(disk->namelen1);
+				break;
+			case 2:
+				type = APFS_TYPE_FILE_EXTENT;
+				disk->offset = cpu_to_le64(oid * 4096);
+				len += sizeof(disk->offset);
+				break;
+			default:
+				type = APFS_TYPE_DIR_REC;
+				name = j == 3 ? "a" : "b";
+				disk->namelen_and_hash = cpu_to_le32(2 |
+					((u32)oid << APFS_DREC_HASH_SHIFT));
+				len += sizeof(disk->namelen_and_hash);
+				break;
+			}
+			disk->id = cpu_to_le64(oid |
+					((u64)type << APFS_FSKEY_TYPE_SHIFT));
+			if (name) {
+				memcpy((void *)disk + len, name, strlen(name) + 1);
+				len += strlen(name) + 1;
+			}
+
+			toc[nr].k.off = cpu_to_le16(key_off);
+			toc[nr].k.len = cpu_to_le16(len);
+			key_off += len;
+			nr++;
+		}
+	}
+	ASSERT(key_start + key_off <= nodesize);
+	/* no values, the free space runs from the keys to the node end */
+	header->free_space.off = cpu_to_le16(key_off);
+	header->free_space.len = cpu_to_le16(nodesize - key_start - key_off);
+}
+
+static void make_search_key(struct apfs_key *key, int nr, bool miss)
+{
+	u64 oid = 16 + (nr / KEYS_PER_OID) * 3;
+
+	memset(key, 0, sizeof(*key));
+	key->oid = oid;
+
+	switch (nr % KEYS_PER_OID) {
+	case 0:
+		key->type = APFS_TYPE_INODE;
+		if (miss)
+			key->oid--;
+		break;
+	case 1:
+		key->type = APFS_TYPE_XATTR;
+		key->name = miss ? "com.apple.zzz" : xattr_name;
+		break;
+	case 2:
+		key->type = APFS_TYPE_FILE_EXTENT;
+		key->offset = oid * 4096 + miss;
+		break;
+	default:
+		key->type = APFS_TYPE_DIR_REC;
+		key->hash = oid;
+		if (miss)
+			key->name = "c";
+		else
+			key->name = nr % KEYS_PER_OID == 3 ? "a" : "b";
+		break;
+	}
+	if (key->name)
+		key->namelen = strlen(key->name) + 1;
+}
+
+/* The search apfs_bin_search() did before keys were packed */
+static int ref_bin_search(struct extent_buffer *eb, const struct apfs_key *key,
+			  int *slot)
+{
+	int low = 0;
+	int high = apfs_header_nritems(eb);
+	int ret;
+
+	while (low < high) {
+		struct apfs_key tmp = {};
+		int mid = (low + high) / 2;
+
+		apfs_item_key_to_cpu(eb, &tmp, mid);
+		ret = apfs_comp_cpu_keys(eb, &tmp, key);
+		if (ret < 0)
+			low = mid + 1;
+		else if (ret > 0)
+			high = mid;
+		else {
+			*slot = mid;
+			return 0;
+		}
+	}
+	*slot = low;
+	return 1;
+}
+
+static u64 bench_search(struct extent_buffer *eb, bool packed)
+{
+	struct apfs_key key;
+	u64 start;
+	u64 elapsed;
+	int slot;
+	int round;
+	int i;
+
+	start = ktime_get_ns();
+	for (round = 0; round < NR_BENCH_ROUNDS; round++) {
+		for (i = 0; i < NR_TEST_KEYS; i++) {
+			make_search_key(&key, i, round & 1);
+			if (packed)
+				apfs_bin_search(eb, &key, &slot);
+			else
+				ref_bin_search(eb, &key, &slot);
+		}
+	}
+	elapsed = max_t(u64, ktime_get_ns() - start, 1);
+
+	return div64_u64((u64)NR_BENCH_ROUNDS * NR_TEST_KEYS * NSEC_PER_SEC,
+			 elapsed);
+}
+
+struct test_drec {
+	u32 hash;
+	u16 namelen;
+	char name[12];
+};
+
+static int test_drec_cmp(const void *a, const void *b)
+{
+	const struct test_drec *d1 = a;
+	const struct test_drec *d2 = b;
+
+	if (d1->hash != d2->hash)
+		return d1->hash < d2->hash ? -1 : 1;
+	if (d1->namelen != d2->namelen)
+		return d1->namelen < d2->namelen ? -1 : 1;
+	return memcmp(d1->name, d2->name, d1->namelen);
+}
+
+/*
+ * Pack as many of @drecs as fit into one hashed fs-tree leaf of directory
+ * TEST_DIR_OID. Returns the number of records stored.
+ */
+static int fill_drec_leaf(void *node, u32 nodesize,
+			  const struct test_drec *drecs, int nr)
+{
+	struct apfs_node_header *header = node;
+	struct apfs_disk_kv *toc = node + sizeof(*header);
+	u32 used = sizeof(*header);
+	u32 key_start;
+	u32 key_off = 0;
+	int count;
+	int i;
+
+	for (count = 0; count < nr; count++) {
+		u32 len = sizeof(*toc) + sizeof(__le64) + sizeof(__le32) +
+			drecs[count].namelen;
+
+		if (used + len > nodesize)
+			break;
+		used += len;
+	}
+
+	memset(node, 0, nodesize);
+	header->o.subtype = cpu_to_le32(APFS_OBJ_TYPE_FSTREE);
+	header->flags = cpu_to_le16(APFS_NODE_LEAF);
+	header->nkeys = cpu_to_le32(count);
+	header->table_space.len = cpu_to_le16(count * sizeof(*toc));
+	key_start = sizeof(*header) + count * sizeof(*toc);
+
+	for (i = 0; i < count; i++) {
+		struct apfs_disk_key *disk = node + key_start + key_off;
+		u16 len = sizeof(disk->id) + sizeof(disk->namelen_and_hash);
+
+		disk->id = cpu_to_le64(TEST_DIR_OID |
+			((u64)APFS_TYPE_DIR_REC << APFS_FSKEY_TYPE_SHIFT));
+		disk->namelen_and_hash = cpu_to_le32(drecs[i].namelen |
+			(drecs[i].hash << APFS_DREC_HASH_SHIFT));
+		memcpy(disk->name2, drecs[i].name, drecs[i].namelen);
+		len += drecs[i].namelen;
+
+		toc[i].k.off = cpu_to_le16(key_off);
+		toc[i].k.len = cpu_to_le16(len);
+		key_off += len;
+	}
+	header->free_space.off = cpu_to_le16(key_off);
+	header->free_space.len = cpu_to_le16(nodesize - key_start - key_off);
+
+	return count;
+}
+
+/* Pick the leaf the way an index node would, then search inside it */
+static int dir_lookup(struct extent_buffer **leaves, int nr_leaves,
+		      const struct apfs_key *key, int *slot)
+{
+	struct apfs_key first;
+	int low = 0;
+	int high = nr_leaves;
+
+	while (low < high) {
+		int mid = (low + high) / 2;
+
+		apfs_item_key_to_cpu(leaves[mid], &first, 0);
+		if (apfs_comp_cpu_keys(leaves[mid], &first, key) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low == 0)
+		return 1;
+
+	return apfs_bin_search(leaves[low - 1], key, slot);
+}
+
+static int test_dir_lookup(struct apfs_fs_info *fs_info, void *node,
+			   u32 nodesize)
+{
+	struct extent_buffer **leaves = NULL;
+	struct test_drec *drecs;
+	struct apfs_key key;
+	int max_leaves;
+	int nr_leaves = 0;
+	u64 rate[2];
+	int done = 0;
+	u64 start;
+	u64 elapsed;
+	int ret = 0;
+	int pass;
+	int i;
+
+	drecs = kvmalloc_array(NR_DIR_ENTRIES, sizeof(*drecs), GFP_KERNEL);
+	max_leaves = NR_DIR_ENTRIES / 32;
+	leaves = kvcalloc(max_leaves, sizeof(*leaves), GFP_KERNEL);
+	if (!drecs || !leaves) {
+		test_std_err(TEST_ALLOC_EXTENT_BUFFER);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* a narrow hash so that some records share one */
+	for (i = 0; i < NR_DIR_ENTRIES; i++) {
+		drecs[i].namelen = snprintf(drecs[i].name,
+					    sizeof(drecs[i].name), "f%x", i) + 1;
+		drecs[i].hash = hash_32(i, 16);
+	}
+	sort(drecs, NR_DIR_ENTRIES, sizeof(*drecs), test_drec_cmp, NULL);
+
+	while (done < NR_DIR_ENTRIES) {
+		struct extent_buffer *eb;
+
+		if (nr_leaves == max_leaves) {
+			test_err("directory does not fit %d leaves", max_leaves);
+			ret = -EINVAL;
+			goto out;
+		}
+		eb = alloc_dummy_extent_buffer(fs_info,
+					       (u64)nr_leaves * nodesize);
+		if (!eb) {
+			test_std_err(TEST_ALLOC_EXTENT_BUFFER);
+			ret = -ENOMEM;
+			goto out;
+		}
+		leaves[nr_leaves++] = eb;
+		done += fill_drec_leaf(node, nodesize, drecs + done,
+				       NR_DIR_ENTRIES - done);
+		write_extent_buffer(eb, node, 0, nodesize);
+		/* or the lookups below quietly skip the packed search */
+		ret = apfs_check_node_toc(eb, NULL);
+		if (ret) {
+			test_err("directory leaf %d fails the toc check: %d",
+				 nr_leaves - 1, ret);
+			goto out;
+		}
+	}
+
+	/* the first pass also builds the key tables */
+	for (pass = 0; pass < 2; pass++) {
+		start = ktime_get_ns();
+		for (i = 0; i < NR_DIR_ENTRIES; i++) {
+			int slot;
+
+			memset(&key, 0, sizeof(key));
+			key.oid = TEST_DIR_OID;
+			key.type = APFS_TYPE_DIR_REC;
+			key.hash = drecs[i].hash;
+			key.namelen = drecs[i].namelen;
+			key.name = drecs[i].name;
+
+			ret = dir_lookup(leaves, nr_leaves, &key, &slot);
+			if (ret) {
+				test_err("lookup of %s hash %u failed: %d",
+					 drecs[i].name, drecs[i].hash, ret);
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+		elapsed = max_t(u64, ktime_get_ns() - start, 1);
+		rate[pass] = div64_u64((u64)NR_DIR_ENTRIES * NSEC_PER_SEC,
+				       elapsed);
+	}
+
+	test_msg("dir lookup: %d entries in %d leaves, %llu lookups/s cold, %llu lookups/s warm",
+		 NR_DIR_ENTRIES, nr_leaves, rate[0], rate[1]);
+
+	/* readdir resumes from a key rebuilt out of the last record it saw */
+	for (i = 0; i < nr_leaves; i++) {
+		int nritems = apfs_header_nritems(leaves[i]);
+		int resume[] = { 0, nritems / 2, nritems - 1 };
+		struct apfs_key dkey;
+		char name[sizeof(drecs[0].name)];
+		int slot = -1;
+		int j;
+
+		for (j = 0; j < ARRAY_SIZE(resume); j++) {
+			apfs_item_key_to_cpu(leaves[i], &dkey, resume[j]);
+
+			memset(&key, 0, sizeof(key));
+			key.oid = dkey.oid;
+			key.type = dkey.type;
+			key.offset = dkey.offset;
+			key.namelen = dkey.namelen;
+			key.hash = dkey.hash;
+			strncpy(name, dkey.name, sizeof(name));
+			key.name = name;
+
+			ret = dir_lookup(leaves, nr_leaves, &key, &slot);
+			if (ret || slot != resume[j]) {
+				test_err("resume from leaf %d slot %d found slot %d: %d",
+					 i, resume[j], slot, ret);
+				ret = -EINVAL;
+				goto out;
+			}
+		}
+	}
+out:
+	for (i = 0; i < nr_leaves; i++)
+		free_extent_buffer(leaves[i]);
+	kvfree(leaves);
+	kvfree(drecs);
+	return ret;
+}
+
+/* Steady-state path allocations must come from the per-cpu pool */
+static int test_path_pool(void)
+{
+	int before;
+	int allocs;
+	int i;
+
+	/* park a path in this cpu's slot first */
+	apfs_free_path(apfs_alloc_path());
+
+	before = atomic_read(&apfs_test_path_slab_allocs);
+	for (i = 0; i < 1000; i++) {
+		struct apfs_path *path = apfs_alloc_path();
+
+		if (!path) {
+			test_std_err(TEST_ALLOC_PATH);
+			return -ENOMEM;
+		}
+		apfs_free_path(path);
+	}
+	allocs = atomic_read(&apfs_test_path_slab_allocs) - before;
+
+	/* migrating to another cpu may have to fill its slot once */
+	if (allocs > num_possible_cpus()) {
+		test_err("%d slab allocations for 1000 path lookups", allocs);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+int apfs_test_btree_search(u32 sectorsize, u32 nodesize)
+{
+	struct apfs_fs_info *fs_info;
+	struct extent_buffer *eb = NULL;
+	struct apfs_key key;
+	void *node = NULL;
+	u64 ref_rate;
+	u64 packed_rate;
+	int ret = 0;
+	int i;
+
+	test_msg("running btree search tests");
+
+	ret = test_path_pool();
+	if (ret)
+		return ret;
+
+	fs_info = apfs_alloc_dummy_fs_info(nodesize, sectorsize);
+	if (!fs_info) {
+		test_std_err(TEST_ALLOC_FS_INFO);
+		return -ENOMEM;
+	}
+
+	fs_info->__super_copy = kzalloc(sizeof(*fs_info->__super_copy),
+					GFP_KERNEL);
+	node = kzalloc(nodesize, GFP_KERNEL);
+	if (!fs_info->__super_copy || !node) {
+		test_std_err(TEST_ALLOC_FS_INFO);
+		ret = -ENOMEM;
+		goto out;
+	}
+	apfs_set_volume_super_incompat_features(fs_info->__super_copy,
+					APFS_INCOMPAT_NORMALIZATION_INSENSITIVE);
+	fs_info->normalization_insensitive = true;
+
+	eb = alloc_dummy_extent_buffer(fs_info, nodesize);
+	if (!eb) {
+		test_std_err(TEST_ALLOC_EXTENT_BUFFER);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	fill_fs_leaf(node, nodesize);
+	write_extent_buffer(eb, node, 0, nodesize);
+	ret = apfs_check_node_toc(eb, NULL);
+	if (ret) {
+		test_err("fs-tree leaf fails the toc check: %d", ret);
+		goto out;
+	}
+
+	for (i = 0; i < NR_TEST_KEYS * 2; i++) {
+		bool miss = i >= NR_TEST_KEYS;
+		int ref_slot;
+		int ref_ret;
+		int slot;
+
+		make_search_key(&key, i % NR_TEST_KEYS, miss);
+		ref_ret = ref_bin_search(eb, &key, &ref_slot);
+		ret = apfs_bin_search(eb, &key, &slot);
+		if (ret != ref_ret || slot != ref_slot) {
+			test_err(
+		"key %d miss %d: got ret %d slot %d, expected ret %d slot %d",
+				 i % NR_TEST_KEYS, miss, ret, slot, ref_ret,
+				 ref_slot);
+			ret = -EINVAL;
+			goto out;
+		}
+		if (ret != miss) {
+			test_err("key %d miss %d: unexpected ret %d",
+				 i % NR_TEST_KEYS, miss, ret);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (!eb->key_table) {
+		test_err("no packed key table built for fs-tree leaf");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ref_rate = bench_search(eb, false);
+	packed_rate = bench_search(eb, true);
+	test_msg("btree search: %d keys, %llu searches/s decoded, %llu searches/s packed",
+		 NR_TEST_KEYS, ref_rate, packed_rate);
+
+	ret = test_dir_lookup(fs_info, node, nodesize);
+out:
+	free_extent_buffer(eb);
+	kfree(node);
+	kfree(fs_info->__super_copy);
+	fs_info->__super_copy = NULL;
+	apfs_free_dummy_fs_info(fs_info);
+	return ret;
+}
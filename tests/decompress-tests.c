@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/bio.h>
+#include "apfs-tests.h"
+#include "../ctree.h"
+#include "../extent_io.h"
+#include "../compression.h"
+
+#define CHUNK_PAGES		(APFS_MAX_UNCOMPRESSED >> PAGE_SHIFT)
+/* compressed data can start anywhere in its first page */
+#define NR_IN_PAGES		(CHUNK_PAGES + 1)
+#define NR_BENCH_ROUNDS		2000
+/* file offset of the chunk the bio tests read */
+#define TEST_CHUNK_START	(4 * (u64)APFS_MAX_UNCOMPRESSED)
+
+static u8 test_pattern(unsigned long pos)
+{
+	return (pos * 31) ^ (pos >> 8);
+}
+
+static void free_test_pages(struct page **pages, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (pages[i])
+			__free_page(pages[i]);
+		pages[i] = NULL;
+	}
+}
+
+static int alloc_test_pages(struct page **pages, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		pages[i] = alloc_page(GFP_KERNEL | __GFP_HIGHMEM);
+		if (!pages[i]) {
+			free_test_pages(pages, i);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* The contiguous view has to be the pages back to back */
+static int test_map_compressed_pages(struct compressed_bio *cb)
+{
+	unsigned long pos;
+	u8 *addr;
+	u8 *kaddr;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < cb->nr_pages; i++) {
+		kaddr = kmap_local_page(cb->compressed_pages[i]);
+		for (pos = 0; pos < PAGE_SIZE; pos++)
+			kaddr[pos] = test_pattern(i * PAGE_SIZE + pos);
+		kunmap_local(kaddr);
+	}
+
+	addr = apfs_map_compressed_pages(cb);
+	if (!addr) {
+		test_err("cannot map %u compressed pages", cb->nr_pages);
+		return -ENOMEM;
+	}
+
+	for (pos = 0; pos < cb->nr_pages * PAGE_SIZE; pos++) {
+		if (addr[pos] != test_pattern(pos)) {
+			test_err("mapped byte %lu is %u, expected %u", pos,
+				 addr[pos], test_pattern(pos));
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	apfs_unmap_compressed_pages(cb, addr);
+	return ret;
+}
+
+/*
+ * A read bio of the first @nr of @pages, whole pages but for the last one
+ * which gets @last_len bytes.
+ */
+static struct bio *alloc_chunk_bio(struct page **pages, int nr, u32 last_len)
+{
+	struct bio *bio;
+	int i;
+
+	bio = apfs_bio_alloc(0);
+	for (i = 0; i < nr; i++) {
+		u32 len = i == nr - 1 ? last_len : PAGE_SIZE;
+
+		if (bio_add_page(bio, pages[i], len, 0) != len) {
+			bio_put(bio);
+			return NULL;
+		}
+	}
+	return bio;
+}
+
+/* A short last chunk is decoded in place and its tail past EOF zeroed */
+static int test_chunk_bio_short(struct compressed_bio *cb,
+				struct page **pages)
+{
+	const u32 tail = 100;
+	struct apfs_chunk_map map;
+	u8 *kaddr;
+	u32 pos;
+	int ret = 0;
+
+	i_size_write(cb->inode, TEST_CHUNK_START + 3 * PAGE_SIZE + tail);
+	cb->orig_bio = alloc_chunk_bio(pages, 4, PAGE_SIZE);
+	if (!cb->orig_bio)
+		return -ENOMEM;
+
+	if (!apfs_map_chunk_bio(cb, &map)) {
+		test_err("bio of a short last chunk not mapped");
+		ret = -EINVAL;
+		goto out;
+	}
+	if (map.len != 3 * PAGE_SIZE + tail || map.nr_pages != 4) {
+		test_err("short chunk mapped as %u bytes in %u pages",
+			 map.len, map.nr_pages);
+		apfs_unmap_chunk_bio(cb, &map, 0);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	/* a decoder may scribble up to the end of the mapping */
+	memset(map.addr, 0x5a, (size_t)map.nr_pages << PAGE_SHIFT);
+	ret = apfs_unmap_chunk_bio(cb, &map, map.len);
+	if (ret) {
+		test_err("unmapping a fully decoded chunk failed: %d", ret);
+		goto out;
+	}
+	if (cb->orig_bio->bi_iter.bi_size) {
+		test_err("%u bytes of the bio left after the decode",
+			 cb->orig_bio->bi_iter.bi_size);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	kaddr = kmap_local_page(pages[3]);
+	for (pos = 0; pos < PAGE_SIZE; pos++) {
+		u8 expected = pos < tail ? 0x5a : 0;
+
+		if (kaddr[pos] != expected) {
+			test_err("last page byte %u is %u, expected %u", pos,
+				 kaddr[pos], expected);
+			ret = -EINVAL;
+			break;
+		}
+	}
+	kunmap_local(kaddr);
+out:
+	bio_put(cb->orig_bio);
+	cb->orig_bio = NULL;
+	return ret;
+}
+
+/* A decode of the wrong size leaves the bio to the copying path */
+static int test_chunk_bio_bad_len(struct compressed_bio *cb,
+				  struct page **pages)
+{
+	struct apfs_chunk_map map;
+	struct bvec_iter iter;
+	int ret;
+
+	i_size_write(cb->inode, TEST_CHUNK_START + APFS_MAX_UNCOMPRESSED);
+	cb->orig_bio = alloc_chunk_bio(pages, CHUNK_PAGES, PAGE_SIZE);
+	if (!cb->orig_bio)
+		return -ENOMEM;
+
+	if (!apfs_map_chunk_bio(cb, &map)) {
+		test_err("bio of a whole chunk not mapped");
+		ret = -EINVAL;
+		goto out;
+	}
+	iter = cb->orig_bio->bi_iter;
+	ret = apfs_unmap_chunk_bio(cb, &map, map.len - 1);
+	if (ret != -EAGAIN) {
+		test_err("short decode returned %d, expected %d", ret,
+			 -EAGAIN);
+		ret = -EINVAL;
+		goto out;
+	}
+	ret = 0;
+	if (cb->orig_bio->bi_iter.bi_size != iter.bi_size ||
+	    cb->orig_bio->bi_iter.bi_idx != iter.bi_idx) {
+		test_err("short decode advanced the bio");
+		ret = -EINVAL;
+	}
+out:
+	bio_put(cb->orig_bio);
+	cb->orig_bio = NULL;
+	return ret;
+}
+
+/* Only a bio of exactly the chunk's pages in file order is decoded into */
+static int test_chunk_bio_reject(struct compressed_bio *cb,
+				 struct page **pages)
+{
+	struct page *swapped[CHUNK_PAGES];
+	const struct {
+		const char *what;
+		struct page **pages;
+		int nr;
+		u32 last_len;
+		u64 start;
+	} cases[] = {
+		{ "pages out of order", swapped, CHUNK_PAGES, PAGE_SIZE,
+		  TEST_CHUNK_START },
+		{ "missing the last page", pages, CHUNK_PAGES - 1, PAGE_SIZE,
+		  TEST_CHUNK_START },
+		{ "ending in a partial page", pages, CHUNK_PAGES,
+		  PAGE_SIZE / 2, TEST_CHUNK_START },
+		{ "chunk not page aligned", pages, CHUNK_PAGES, PAGE_SIZE,
+		  TEST_CHUNK_START + 512 },
+	};
+	struct apfs_chunk_map map;
+	int ret = 0;
+	int i;
+
+	memcpy(swapped, pages, sizeof(swapped));
+	swap(swapped[0], swapped[1]);
+	i_size_write(cb->inode, TEST_CHUNK_START + APFS_MAX_UNCOMPRESSED);
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		cb->start = cases[i].start;
+		cb->orig_bio = alloc_chunk_bio(cases[i].pages, cases[i].nr,
+					       cases[i].last_len);
+		if (!cb->orig_bio) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (apfs_map_chunk_bio(cb, &map)) {
+			test_err("bio %s mapped", cases[i].what);
+			apfs_unmap_chunk_bio(cb, &map, 0);
+			ret = -EINVAL;
+		}
+		bio_put(cb->orig_bio);
+		cb->orig_bio = NULL;
+		if (ret)
+			break;
+	}
+
+	cb->start = TEST_CHUNK_START;
+	return ret;
+}
+
+static int test_chunk_bio(struct page **pages)
+{
+	struct apfs_fs_info *fs_info = NULL;
+	struct compressed_bio cb = { .start = TEST_CHUNK_START };
+	struct inode *inode;
+	int ret = -ENOMEM;
+	int i;
+
+	inode = apfs_new_test_inode();
+	if (!inode) {
+		test_std_err(TEST_ALLOC_INODE);
+		return ret;
+	}
+
+	/* apfs_unmap_chunk_bio() counts into the fs_info of the inode */
+	fs_info = apfs_alloc_dummy_fs_info(PAGE_SIZE, PAGE_SIZE);
+	if (!fs_info) {
+		test_std_err(TEST_ALLOC_FS_INFO);
+		goto out;
+	}
+	cb.inode = inode;
+
+	/* stand-ins for the page cache pages of the chunk */
+	for (i = 0; i < CHUNK_PAGES; i++)
+		pages[i]->index = (TEST_CHUNK_START >> PAGE_SHIFT) + i;
+
+	ret = test_chunk_bio_short(&cb, pages);
+	if (ret)
+		goto out;
+	ret = test_chunk_bio_bad_len(&cb, pages);
+	if (ret)
+		goto out;
+	ret = test_chunk_bio_reject(&cb, pages);
+out:
+	for (i = 0; i < CHUNK_PAGES; i++)
+		pages[i]->index = 0;
+	iput(inode);
+	apfs_free_dummy_fs_info(fs_info);
+	return ret;
+}
+
+/*
+ * What the copying decoders do around the decode itself for one chunk: copy
+ * the compressed pages into the workspace, then the decoded chunk out to the
+ * file pages.
+ */
+static void copy_chunk(struct compressed_bio *cb, u8 *in_buf, u8 *out_buf,
+		       struct page **out_pages)
+{
+	int i;
+
+	for (i = 0; i < cb->nr_pages; i++)
+		memcpy_from_page(in_buf + i * PAGE_SIZE,
+				 cb->compressed_pages[i], 0, PAGE_SIZE);
+	for (i = 0; i < CHUNK_PAGES; i++)
+		memcpy_to_page(out_pages[i], 0, out_buf + i * PAGE_SIZE,
+			       PAGE_SIZE);
+}
+
+/* What replaces it: mapping both sides */
+static int map_chunk(struct compressed_bio *cb, struct page **out_pages)
+{
+	void *in;
+	void *out;
+
+	in = apfs_map_compressed_pages(cb);
+	if (!in)
+		return -ENOMEM;
+	out = vm_map_ram(out_pages, CHUNK_PAGES, NUMA_NO_NODE);
+	if (!out) {
+		apfs_unmap_compressed_pages(cb, in);
+		return -ENOMEM;
+	}
+
+	vm_unmap_ram(out, CHUNK_PAGES);
+	apfs_unmap_compressed_pages(cb, in);
+	return 0;
+}
+
+int apfs_test_decompress(void)
+{
+	struct page *in_pages[NR_IN_PAGES] = { NULL };
+	struct page *out_pages[CHUNK_PAGES] = { NULL };
+	struct compressed_bio cb = {
+		.nr_pages = NR_IN_PAGES,
+		.compressed_pages = in_pages,
+	};
+	u8 *in_buf = NULL;
+	u8 *out_buf = NULL;
+	u64 copy_ns;
+	u64 map_ns;
+	u64 start;
+	int round;
+	int ret;
+
+	test_msg("running decompress tests");
+
+	ret = alloc_test_pages(in_pages, NR_IN_PAGES);
+	if (ret) {
+		test_err("cannot allocate compressed pages");
+		return ret;
+	}
+	ret = alloc_test_pages(out_pages, CHUNK_PAGES);
+	if (ret) {
+		test_err("cannot allocate file pages");
+		goto out;
+	}
+
+	ret = test_map_compressed_pages(&cb);
+	if (ret)
+		goto out;
+
+	ret = test_chunk_bio(out_pages);
+	if (ret)
+		goto out;
+
+	in_buf = kvmalloc(NR_IN_PAGES * PAGE_SIZE, GFP_KERNEL);
+	out_buf = kvmalloc(APFS_MAX_UNCOMPRESSED, GFP_KERNEL);
+	if (!in_buf || !out_buf) {
+		test_err("cannot allocate workspace buffers");
+		ret = -ENOMEM;
+		goto out;
+	}
+	memset(out_buf, 0x5a, APFS_MAX_UNCOMPRESSED);
+
+	start = ktime_get_ns();
+	for (round = 0; round < NR_BENCH_ROUNDS; round++)
+		copy_chunk(&cb, in_buf, out_buf, out_pages);
+	copy_ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	start = ktime_get_ns();
+	for (round = 0; round < NR_BENCH_ROUNDS; round++) {
+		ret = map_chunk(&cb, out_pages);
+		if (ret) {
+			test_err("cannot map chunk pages");
+			goto out;
+		}
+	}
+	map_ns = max_t(u64, ktime_get_ns() - start, 1);
+
+	test_msg("decompress: copies removed per 64K chunk: %llu ns (%llu MB/s), mapping instead: %llu ns",
+		 div_u64(copy_ns, NR_BENCH_ROUNDS),
+		 div64_u64((u64)NR_BENCH_ROUNDS *
+			   (NR_IN_PAGES * PAGE_SIZE + APFS_MAX_UNCOMPRESSED) *
+			   NSEC_PER_SEC, copy_ns) >> 20,
+		 div_u64(map_ns, NR_BENCH_ROUNDS));
+out:
+	kvfree(in_buf);
+	kvfree(out_buf);
+	free_test_pages(out_pages, CHUNK_PAGES);
+	free_test_pages(in_pages, NR_IN_PAGES);
+	return ret;
+}
@@ -47,7 +47,7 @@ static noinline int process_page_range(struct inode *inode, u64 start, u64 end,
 		cond_resched();
 		loops++;
 		if (loops > 100000) {
-			trace_printk(KERN_ERR
+			printk(KERN_ERR
 		"stuck in a loop, start %llu, end %llu, nr_pages %lu, ret %d\n",
 				start, end, nr_pages, ret);
 			break;
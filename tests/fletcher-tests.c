@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/slab.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include "apfs-tests.h"
+#include "../ctree.h"
+#include "../fletcher.h"
+
+#define TEST_BUF_SIZE		(SZ_64K + SZ_4K)
+
+/* The plain loop every implementation has to agree with */
+static u64 ref_fletcher64(const void *addr, size_t len)
+{
+	const __le32 *buff = addr;
+	u64 sum1 = 0;
+	u64 sum2 = 0;
+	u64 c1, c2;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(u32); i++) {
+		sum1 += le32_to_cpu(buff[i]);
+		sum2 += sum1;
+	}
+
+	c1 = sum1 + sum2;
+	c1 = 0xFFFFFFFF - c1 % (u64)0xFFFFFFFF;
+	c2 = sum1 + c1;
+	c2 = 0xFFFFFFFF - c2 % (u64)0xFFFFFFFF;
+
+	return (c2 << 32) | c1;
+}
+
+static int test_one_algo(const struct apfs_fletcher64_ops *ops, u8 *buf)
+{
+	static const size_t block_sizes[] = { SZ_4K, SZ_8K, SZ_16K, SZ_32K,
+					      SZ_64K };
+	size_t len;
+	u64 csum;
+	int off;
+	int i;
+
+	/* an all zero block sums to all ones */
+	memset(buf, 0, SZ_4K);
+	csum = apfs_fletcher64_ops_sum(ops, buf, SZ_4K);
+	if (csum != U64_MAX) {
+		test_err("%s: zero block csum %llx, expected %llx", ops->name,
+			 csum, U64_MAX);
+		return -EINVAL;
+	}
+
+	get_random_bytes(buf, TEST_BUF_SIZE);
+	/* words with the top bit set stress the u64 lanes the most */
+	for (i = 0; i < SZ_4K; i += sizeof(u32))
+		buf[i + 3] |= 0x80;
+
+	for (off = 0; off < 2 * sizeof(u32); off += sizeof(u32)) {
+		/* short lengths hit every tail a stride can leave */
+		for (len = 0; len <= 64 * sizeof(u32); len += sizeof(u32)) {
+			csum = apfs_fletcher64_ops_sum(ops, buf + off, len);
+			if (csum != ref_fletcher64(buf + off, len)) {
+				test_err("%s: wrong csum, offset %d len %zu",
+					 ops->name, off, len);
+				return -EINVAL;
+			}
+		}
+		for (i = 0; i < ARRAY_SIZE(block_sizes); i++) {
+			len = block_sizes[i] - APFS_CSUM_SIZE;
+			csum = apfs_fletcher64_ops_sum(ops, buf + off, len);
+			if (csum != ref_fletcher64(buf + off, len)) {
+				test_err("%s: wrong csum, offset %d len %zu",
+					 ops->name, off, len);
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int apfs_test_fletcher64(void)
+{
+	const struct apfs_fletcher64_ops *const *algo;
+	u8 *buf;
+	int ret = 0;
+
+	test_msg("running fletcher64 tests");
+
+	buf = kmalloc(TEST_BUF_SIZE, GFP_KERNEL);
+	if (!buf) {
+		test_err("cannot allocate test buffer");
+		return -ENOMEM;
+	}
+
+	for (algo = apfs_fletcher64_algos; *algo; algo++) {
+		if (!(*algo)->valid())
+			continue;
+		ret = test_one_algo(*algo, buf);
+		if (ret)
+			break;
+	}
+
+	kfree(buf);
+	return ret;
+}
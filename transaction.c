@@ -580,7 +580,8 @@ start_transaction(struct apfs_root *root, unsigned int num_items,
 	bool do_chunk_alloc = false;
 	int ret;
 
-	if (test_bit(APFS_FS_STATE_ERROR, &fs_info->fs_state))
+	if (test_bit(APFS_FS_STATE_ERROR, &fs_info->fs_state) ||
+	    apfs_fs_no_trans(fs_info))
 		return ERR_PTR(-EROFS);
 
 	if (current->journal_info) {
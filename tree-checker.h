@@ -12,7 +12,7 @@
 /*
  * Comprehensive leaf checker.
  * Will check not only the item pointers, but also every possible member
- * in item data.
+ * in item data. No apfs value is checked beyond its bounds yet.
  */
 int apfs_check_leaf_full(struct extent_buffer *leaf);
 
@@ -22,6 +22,7 @@ int apfs_check_leaf_full(struct extent_buffer *leaf);
  */
 int apfs_check_leaf_relaxed(struct extent_buffer *leaf);
 int apfs_check_node(struct extent_buffer *node);
+int apfs_check_node_toc(struct extent_buffer *eb, struct apfs_packed_key *keys);
 
 int apfs_check_chunk_valid(struct extent_buffer *leaf,
 			    struct apfs_chunk *chunk, u64 logical);
@@ -2892,9 +2892,6 @@ struct extent_map *apfs_get_chunk_map(struct apfs_fs_info *fs_info,
 		apfs_crit(fs_info, "unable to add extent map logical %llu length %llu",
 			  logical, length);
 		return ERR_PTR(ret);
-	} else {
-		trace_printk("add chunk map logical %llu length %llu",
-			     logical, length);
 	}
 
 out:
@@ -6288,11 +6285,6 @@ static void submit_stripe_bio(struct apfs_bio *bbio, struct bio *bio,
 	bio->bi_end_io = apfs_end_bio;
 	bio->bi_iter.bi_sector = physical >> 9;
 	apfs_debug_in_rcu(fs_info,
-	"apfs_map_bio: rw %d 0x%x, sector=%llu, dev=%lu (%s id %llu), size=%u",
-		bio_op(bio), bio->bi_opf, bio->bi_iter.bi_sector,
-		(unsigned long)dev->bdev->bd_dev, rcu_str_deref(dev->name),
-		dev->devid, bio->bi_iter.bi_size);
-	trace_printk(
 	"apfs_map_bio: rw %d 0x%x, sector=%llu, dev=%lu (%s id %llu), size=%u",
 		bio_op(bio), bio->bi_opf, bio->bi_iter.bi_sector,
 		(unsigned long)dev->bdev->bd_dev, rcu_str_deref(dev->name),
@@ -6931,13 +6923,14 @@ out:
 	return ret;
 }
 
-static void readahead_tree_node_children(struct extent_buffer *node)
+static void readahead_tree_node_children(struct apfs_fs_info *fs_info,
+					 struct extent_buffer *node)
 {
 	int i;
 	const int nr_items = apfs_header_nritems(node);
 
 	for (i = 0; i < nr_items; i++)
-		apfs_readahead_node_child(node, i);
+		apfs_readahead_node_child(fs_info, node, i);
 }
 
 int apfs_read_chunk_tree(struct apfs_fs_info *fs_info)
@@ -7002,7 +6995,7 @@ int apfs_read_chunk_tree(struct apfs_fs_info *fs_info)
 		node = path->nodes[1];
 		if (node) {
 			if (last_ra_node != node->start) {
-				readahead_tree_node_children(node);
+				readahead_tree_node_children(fs_info, node);
 				last_ra_node = node->start;
 			}
 		}
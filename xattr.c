@@ -25,15 +25,11 @@ int apfs_getxattr(struct inode *inode, const char *name,
 {
 	struct apfs_xattr_item *xi;
 	struct apfs_root *root = APFS_I(inode)->root;
-	struct apfs_path *path;
+	APFS_DEFINE_PATH(path);
 	struct extent_buffer *leaf;
 	int ret = 0;
 	unsigned long data_ptr;
 
-	path = apfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
 	/* lookup the xattr by name */
 	xi = apfs_lookup_xattr_item(NULL, root, path, apfs_ino(APFS_I(inode)),
 				    name, 0);
@@ -73,7 +69,7 @@ int apfs_getxattr(struct inode *inode, const char *name,
 
 	ret = apfs_xattr_item_len(leaf, xi);
 out:
-	apfs_free_path(path);
+	apfs_release_path(path);
 	return ret;
 }
 
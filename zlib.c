@@ -47,8 +47,6 @@ void zlib_free_workspace(struct list_head *ws)
 {
 	struct workspace *workspace = list_entry(ws, struct workspace, list);
 
-	trace_printk("zlib free workspce %p\n", workspace);
-
 	kvfree(workspace->strm.workspace);
 	kfree(workspace->buf);
 	kfree(workspace);
@@ -87,7 +85,6 @@ struct list_head *zlib_alloc_workspace(unsigned int level)
 
 	INIT_LIST_HEAD(&workspace->list);
 
-	trace_printk("zlib alloc workspce %p\n", workspace);
 	return &workspace->list;
 fail:
 	zlib_free_workspace(&workspace->list);
@@ -304,8 +301,14 @@ int zlib_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 	workspace->strm.total_in = 0;
 
 	workspace->strm.total_out = 0;
-	workspace->strm.next_out = workspace->buf;
-	workspace->strm.avail_out = workspace->buf_size;
+	if (cb->chunk) {
+		/* the chunk cache wants the whole chunk, inflate it all */
+		workspace->strm.next_out = cb->chunk->data;
+		workspace->strm.avail_out = APFS_MAX_UNCOMPRESSED;
+	} else {
+		workspace->strm.next_out = workspace->buf;
+		workspace->strm.avail_out = workspace->buf_size;
+	}
 
 	if (pg_offset + 2 >= PAGE_SIZE)
 		BUG();
@@ -344,6 +347,10 @@ int zlib_decompress_bio(struct list_head *ws, struct compressed_bio *cb)
 			break;
 		}
 
+		/* copied out in one go once the stream ends */
+		if (cb->chunk)
+			goto next_page;
+
 		ret2 = apfs_decompress_buf2page(workspace->buf, buf_start,
 						 total_out, disk_start,
 						 orig_bio);
@@ -376,12 +383,21 @@ next_page:
 	}
 	if (ret != Z_STREAM_END) {
 		ret = -EIO;
-		trace_printk("failed to decompress start %llu total_pages_in %d cb offset %llu srclen %zu cdata 0x%x\n",
-		       cb->start, cb->nr_pages, cb->offset, srclen, cdata);
-	
+		pr_info("APFS: zlib decompressed bio failed, cb start %llu compressed len %zu cdata 0x%x",
+			cb->start, srclen, cdata);
 	} else {
 		ret = 0;
-	}	
+	}
+	if (!ret && cb->chunk) {
+		if (apfs_decompress_buf2page(cb->chunk->data, 0, total_out,
+					     disk_start, orig_bio) < 0) {
+			ret = -EIO;
+		} else {
+			apfs_fill_chunk_pages(cb->inode, disk_start,
+					      cb->chunk->data, total_out);
+			cb->chunk->len = total_out;
+		}
+	}
 done:
 	zlib_inflateEnd(&workspace->strm);
 	if (data_in)